@@ -0,0 +1,389 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pixman.h>
+
+#include "driver.h"
+
+/*
+ * "AccelMethod" "auto".
+ *
+ * Whether glamor or fb draws a typical 2D frame faster depends on the
+ * GPU and its driver. The first time a GPU is seen two paths are timed
+ * on a short frame loop: a fill, a copy and a composite of
+ * HWC_ACCEL_RECT sized rectangles, then the full screen draw that
+ * presents the root.
+ *
+ * glamor isn't loaded yet when this runs in PreInit and needs a screen
+ * to draw anything, so it isn't called. The "gl" path stands in for it:
+ * the same operations as GL draws into a texture with the renderer's
+ * own program, i.e. what glamor asks of the GPU, less its own overhead.
+ * fb does them on the CPU with pixman and then pays what the fb path
+ * pays to present, i.e. the native buffer unlock and lock or the upload
+ * of the damage. Both present into a texture of the panel's size, the
+ * renderer's surface may be a 1x1 pbuffer when a swapchain is used.
+ * Each method runs for at most HWC_ACCEL_BENCH_MS. The choice is stored
+ * in HWC_ACCEL_CACHE keyed by the GL_RENDERER string, so later starts
+ * only read it back.
+ */
+
+#define HWC_ACCEL_CACHE "/var/lib/xorg/hwcomposer-accel"
+#define HWC_ACCEL_BENCH_MS 150    /* time budget per method */
+#define HWC_ACCEL_BENCH_FRAMES 60 /* ... and frame limit */
+#define HWC_ACCEL_RECT 256
+
+extern const char vertex_src[];
+extern const char fragment_src[];
+
+static const GLfloat hwc_accel_quad[] = {
+    -1.0f, -1.0f,
+    1.0f, -1.0f,
+    -1.0f,  1.0f,
+    1.0f,  1.0f,
+};
+
+static const GLfloat hwc_accel_texcoords[] = {
+    0.0f, 0.0f,
+    1.0f, 0.0f,
+    0.0f, 1.0f,
+    1.0f, 1.0f,
+};
+
+typedef struct {
+    ScrnInfoPtr pScrn;
+    int width;
+    int height;
+    GLint viewport[4]; /* of the renderer's surface, restored after */
+
+    /* what the root is presented to, of the panel's size */
+    GLuint screen;
+    GLuint screenFbo;
+
+    /* gl: the root and a source pixmap as textures */
+    GLuint target;
+    GLuint targetFbo;
+    GLuint source;
+
+    /* fb: the root in a native buffer or uploaded, a source in memory */
+    EGLClientBuffer buffer;
+    EGLImageKHR image;
+    int stride;
+    uint32_t *pixels;
+    uint32_t *sourcePixels;
+    GLuint fbTexture;
+} hwc_accel_bench;
+
+/* Draw the bound program with texture over a rectangle of the current framebuffer */
+static void hwc_accel_draw(GLuint texture, int x, int y, int w, int h)
+{
+    glViewport(x, y, w, h);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+/* Present the root: a full screen draw of it, finished like a swap would be */
+static void hwc_accel_present(hwc_accel_bench *bench, GLuint texture)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, bench->screenFbo);
+    glDisable(GL_BLEND);
+    hwc_accel_draw(texture, 0, 0, bench->width, bench->height);
+    glFinish();
+}
+
+/* Rectangles move around so caches don't make later frames free */
+static void hwc_accel_rect(hwc_accel_bench *bench, int frame, int *x, int *y, int *w, int *h)
+{
+    *w = min(HWC_ACCEL_RECT, bench->width);
+    *h = min(HWC_ACCEL_RECT, bench->height);
+    *x = (frame * 37) % (bench->width - *w + 1);
+    *y = (frame * 53) % (bench->height - *h + 1);
+}
+
+static void hwc_accel_gl_frame(hwc_accel_bench *bench, int frame)
+{
+    int x, y, w, h;
+
+    hwc_accel_rect(bench, frame, &x, &y, &w, &h);
+    glBindFramebuffer(GL_FRAMEBUFFER, bench->targetFbo);
+
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(x, y, w, h);
+    glClearColor(0.2f, 0.4f, 0.6f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glDisable(GL_SCISSOR_TEST);
+
+    glDisable(GL_BLEND);
+    hwc_accel_draw(bench->source, bench->width - x - w, y, w, h);
+    glEnable(GL_BLEND);
+    hwc_accel_draw(bench->source, x, bench->height - y - h, w, h);
+
+    hwc_accel_present(bench, bench->target);
+}
+
+static void hwc_accel_fb_frame(hwc_accel_bench *bench, int frame)
+{
+    hwc_renderer_ptr renderer = &HWCPTR(bench->pScrn)->renderer;
+    pixman_image_t *dst, *src;
+    void *pixels = bench->pixels;
+    int x, y, w, h;
+
+    hwc_accel_rect(bench, frame, &x, &y, &w, &h);
+
+    if (bench->buffer)
+        renderer->eglHybrisLockNativeBuffer(bench->buffer,
+                                            HYBRIS_USAGE_SW_READ_OFTEN | HYBRIS_USAGE_SW_WRITE_OFTEN,
+                                            0, 0, bench->stride, bench->height, &pixels);
+
+    pixman_fill(pixels, bench->stride, 32, x, y, w, h, 0xff336699);
+    pixman_blt(bench->sourcePixels, pixels, bench->width, bench->stride, 32, 32,
+               0, 0, bench->width - x - w, y, w, h);
+
+    src = pixman_image_create_bits(PIXMAN_a8r8g8b8, bench->width, bench->height,
+                                   bench->sourcePixels, bench->width * 4);
+    dst = pixman_image_create_bits(PIXMAN_a8r8g8b8, bench->width, bench->height,
+                                   pixels, bench->stride * 4);
+    pixman_image_composite32(PIXMAN_OP_OVER, src, NULL, dst,
+                             0, 0, 0, 0, x, bench->height - y - h, w, h);
+    pixman_image_unref(dst);
+    pixman_image_unref(src);
+
+    if (bench->buffer)
+        renderer->eglHybrisUnlockNativeBuffer(bench->buffer);
+    else {
+        /* Roughly what upload.c sends for this damage */
+        glBindTexture(GL_TEXTURE_2D, bench->fbTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bench->width, min(3 * h, bench->height),
+                        GL_RGBA, GL_UNSIGNED_BYTE, bench->pixels);
+    }
+
+    hwc_accel_present(bench, bench->fbTexture);
+}
+
+/* Average microseconds per frame */
+static CARD32 hwc_accel_run(hwc_accel_bench *bench,
+                            void (*frame)(hwc_accel_bench *bench, int frame))
+{
+    CARD64 start, deadline, now;
+    int frames = 0;
+
+    /* The first frame may still compile or allocate something */
+    frame(bench, 0);
+
+    start = now = GetTimeInMicros();
+    deadline = start + HWC_ACCEL_BENCH_MS * 1000;
+    while (frames < HWC_ACCEL_BENCH_FRAMES && now < deadline) {
+        frame(bench, ++frames);
+        now = GetTimeInMicros();
+    }
+
+    return (now - start) / frames;
+}
+
+static GLuint hwc_accel_texture(int width, int height, const void *pixels)
+{
+    GLuint texture;
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    return texture;
+}
+
+/* Framebuffer drawing into texture */
+static Bool hwc_accel_fbo(GLuint texture, GLuint *fbo)
+{
+    glGenFramebuffers(1, fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+static Bool hwc_accel_bench_init(ScrnInfoPtr pScrn, hwc_accel_bench *bench)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    size_t i, size;
+
+    memset(bench, 0, sizeof(*bench));
+    bench->pScrn = pScrn;
+    bench->width = hwc->hwcWidth;
+    bench->height = hwc->hwcHeight;
+    bench->image = EGL_NO_IMAGE_KHR;
+    glGetIntegerv(GL_VIEWPORT, bench->viewport);
+
+    size = (size_t) bench->width * bench->height;
+    bench->sourcePixels = malloc(size * 4);
+    if (!bench->sourcePixels)
+        return FALSE;
+    for (i = 0; i < size; i++)
+        bench->sourcePixels[i] = 0x80000000 | (i * 2654435761U >> 8);
+
+    bench->source = hwc_accel_texture(bench->width, bench->height, bench->sourcePixels);
+    bench->target = hwc_accel_texture(bench->width, bench->height, NULL);
+    bench->screen = hwc_accel_texture(bench->width, bench->height, NULL);
+    if (!hwc_accel_fbo(bench->target, &bench->targetFbo) ||
+        !hwc_accel_fbo(bench->screen, &bench->screenFbo))
+        return FALSE;
+
+    if (renderer->eglHybrisCreateNativeBuffer && !hwc->upload.enabled) {
+        renderer->eglHybrisCreateNativeBuffer(bench->width, bench->height,
+                                              HYBRIS_USAGE_HW_TEXTURE |
+                                              HYBRIS_USAGE_SW_READ_OFTEN | HYBRIS_USAGE_SW_WRITE_OFTEN,
+                                              HYBRIS_PIXEL_FORMAT_RGBA_8888,
+                                              &bench->stride, &bench->buffer);
+        if (!bench->buffer)
+            return FALSE;
+
+        glGenTextures(1, &bench->fbTexture);
+        glBindTexture(GL_TEXTURE_2D, bench->fbTexture);
+        bench->image = renderer->eglCreateImageKHR(renderer->display, EGL_NO_CONTEXT,
+                                                   EGL_NATIVE_BUFFER_HYBRIS, bench->buffer, NULL);
+        if (bench->image == EGL_NO_IMAGE_KHR)
+            return FALSE;
+        renderer->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, bench->image);
+    }
+    else {
+        bench->stride = bench->width;
+        bench->pixels = calloc(size, 4);
+        if (!bench->pixels)
+            return FALSE;
+        bench->fbTexture = hwc_accel_texture(bench->width, bench->height, NULL);
+    }
+
+    return TRUE;
+}
+
+static void hwc_accel_bench_fini(ScrnInfoPtr pScrn, hwc_accel_bench *bench)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    GLuint textures[] = { bench->source, bench->target, bench->screen, bench->fbTexture };
+    GLuint fbos[] = { bench->targetFbo, bench->screenFbo };
+    int i;
+
+    for (i = 0; i < sizeof(textures) / sizeof(textures[0]); i++) {
+        if (textures[i])
+            glDeleteTextures(1, &textures[i]);
+    }
+    for (i = 0; i < sizeof(fbos) / sizeof(fbos[0]); i++) {
+        if (fbos[i])
+            glDeleteFramebuffers(1, &fbos[i]);
+    }
+    if (bench->image != EGL_NO_IMAGE_KHR)
+        renderer->eglDestroyImageKHR(renderer->display, bench->image);
+    if (bench->buffer)
+        renderer->eglHybrisReleaseNativeBuffer(bench->buffer);
+    free(bench->pixels);
+    free(bench->sourcePixels);
+
+    /* Leave the context the way the renderer expects it */
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(bench->viewport[0], bench->viewport[1], bench->viewport[2], bench->viewport[3]);
+    glDisable(GL_BLEND);
+    glDisableVertexAttribArray(HWC_ATTRIB_POSITION);
+    glDisableVertexAttribArray(HWC_ATTRIB_TEXCOORDS);
+    hwc_gl_state_invalidate(&renderer->state);
+}
+
+/* Cached choice for a GPU, -1 if there is none */
+static int hwc_accel_cache_lookup(const char *gpu)
+{
+    char line[512], *tab;
+    int glamor = -1;
+    FILE *f;
+
+    f = fopen(HWC_ACCEL_CACHE, "r");
+    if (!f)
+        return -1;
+
+    while (glamor < 0 && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        tab = strrchr(line, '\t');
+        if (!tab)
+            continue;
+        *tab = '\0';
+        if (!strcmp(line, gpu))
+            glamor = !strcmp(tab + 1, "glamor");
+    }
+
+    fclose(f);
+    return glamor;
+}
+
+static void hwc_accel_cache_store(ScrnInfoPtr pScrn, const char *gpu, Bool glamor)
+{
+    FILE *f = fopen(HWC_ACCEL_CACHE, "a");
+
+    if (!f) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "can't write %s, the benchmark will run again\n", HWC_ACCEL_CACHE);
+        return;
+    }
+
+    fprintf(f, "%s\t%s\n", gpu, glamor ? "glamor" : "fb");
+    fclose(f);
+}
+
+/* Whether glamor should be used, the renderer's context must be current */
+Bool hwc_accel_prefer_glamor(ScrnInfoPtr pScrn)
+{
+    const char *gpu = (const char *) glGetString(GL_RENDERER);
+    hwc_accel_bench bench;
+    CARD32 glTime, fbTime;
+    GLuint program;
+    int cached;
+
+    if (!gpu || strchr(gpu, '\n'))
+        gpu = "unknown";
+
+    cached = hwc_accel_cache_lookup(gpu);
+    if (cached >= 0) {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "AccelMethod auto: %s for \"%s\" (cached)\n",
+                   cached ? "glamor" : "fb", gpu);
+        return cached;
+    }
+
+    program = hwc_link_program(vertex_src, fragment_src);
+    if (!program || !hwc_accel_bench_init(pScrn, &bench)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "AccelMethod auto: benchmark setup failed, using glamor\n");
+        if (program) {
+            hwc_accel_bench_fini(pScrn, &bench);
+            glDeleteProgram(program);
+        }
+        return TRUE;
+    }
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "texture"), 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glVertexAttribPointer(HWC_ATTRIB_POSITION, 2, GL_FLOAT, GL_FALSE, 0, hwc_accel_quad);
+    glVertexAttribPointer(HWC_ATTRIB_TEXCOORDS, 2, GL_FLOAT, GL_FALSE, 0, hwc_accel_texcoords);
+    glEnableVertexAttribArray(HWC_ATTRIB_POSITION);
+    glEnableVertexAttribArray(HWC_ATTRIB_TEXCOORDS);
+
+    glTime = hwc_accel_run(&bench, hwc_accel_gl_frame);
+    fbTime = hwc_accel_run(&bench, hwc_accel_fb_frame);
+
+    hwc_accel_bench_fini(pScrn, &bench);
+    glUseProgram(0);
+    glDeleteProgram(program);
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "AccelMethod auto: gl %u us, fb %u us per frame on \"%s\", using %s\n",
+               (unsigned int) glTime, (unsigned int) fbTime, gpu,
+               glTime <= fbTime ? "glamor" : "fb");
+
+    hwc_accel_cache_store(pScrn, gpu, glTime <= fbTime);
+    return glTime <= fbTime;
+}
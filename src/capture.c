@@ -0,0 +1,534 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <android-config.h>
+#include <sync/sync.h>
+#include <hardware/gralloc.h>
+
+#include "driver.h"
+
+/*
+ * Screen capture through the HWC virtual display ("Capture" option).
+ *
+ * Recording the screen through X means reading back every frame with
+ * the CPU. Instead, at most "CaptureRate" times a second, the frame
+ * that goes to the panel is also given to HWC as the only layer of
+ * HWC_DISPLAY_VIRTUAL, whose output buffer is a gralloc buffer of
+ * "CaptureSize". HWC scales it in there, and once the virtual display's
+ * retire fence signals the frame is published in a ring shared with
+ * consumers, see capture.h. No pixel goes through the CPU.
+ *
+ * This relies on HWC composing the layer itself. If it wants it drawn
+ * with GLES instead the output is undefined and capture is turned off.
+ */
+
+#define HWC_CAPTURE_USAGE (GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_HW_RENDER | \
+                           GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_VIDEO_ENCODER)
+
+#define HWC_CAPTURE_DEFAULT_RATE 30
+
+/* Consecutive frames HWC may refuse to compose before capture is turned off */
+#define HWC_CAPTURE_MAX_REFUSALS 3
+
+#ifdef HWC_DEVICE_API_VERSION_1_3
+#define HWC_CAPTURE_MIN_VERSION HWC_DEVICE_API_VERSION_1_3
+#else
+#define HWC_CAPTURE_MIN_VERSION UINT32_MAX /* no virtual display, no outbuf */
+#endif
+
+static void hwc_capture_init_layer(hwc_layer_1_t *layer, int type, const hwc_rect_t *crop,
+                                   const hwc_rect_t *frame)
+{
+    memset(layer, 0, sizeof(*layer));
+    layer->compositionType = type;
+    layer->blending = HWC_BLENDING_NONE;
+#ifdef HWC_DEVICE_API_VERSION_1_3
+    layer->sourceCropf.left = crop->left;
+    layer->sourceCropf.top = crop->top;
+    layer->sourceCropf.right = crop->right;
+    layer->sourceCropf.bottom = crop->bottom;
+#else
+    layer->sourceCrop = *crop;
+#endif
+    layer->displayFrame = *frame;
+    layer->visibleRegionScreen.numRects = 1;
+    layer->visibleRegionScreen.rects = &layer->displayFrame;
+    layer->acquireFenceFd = -1;
+    layer->releaseFenceFd = -1;
+#if (ANDROID_VERSION_MAJOR >= 4) && (ANDROID_VERSION_MINOR >= 3) || (ANDROID_VERSION_MAJOR >= 5)
+    layer->planeAlpha = 0xff;
+#endif
+}
+
+static Bool hwc_capture_supported(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (hwc->headless || hwc->hwc2 || hwc->hwcVersion < HWC_CAPTURE_MIN_VERSION)
+        return FALSE;
+
+#ifdef HWC_DEVICE_API_VERSION_1_3
+    {
+        hwc_composer_device_1_t *hwcDevicePtr = hwc->hwcDevicePtr;
+        int types = 0;
+
+        if (hwcDevicePtr->query(hwcDevicePtr, HWC_DISPLAY_TYPES_SUPPORTED, &types) == 0)
+            return (types & HWC_DISPLAY_VIRTUAL_BIT) != 0;
+    }
+#endif
+
+    return FALSE;
+}
+
+static Bool hwc_capture_alloc(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_capture_ptr capture = &hwc->capture;
+    hwc_capture_header *shm;
+    char name[64];
+    int i, stride;
+
+    for (i = 0; i < HWC_CAPTURE_SLOTS; i++) {
+        if (hwc->alloc->alloc(hwc->alloc, capture->width, capture->height,
+                              HAL_PIXEL_FORMAT_RGBA_8888, HWC_CAPTURE_USAGE,
+                              &capture->buffers[i], &stride) != 0)
+            return FALSE;
+        if (capture->buffers[i]->numFds > HWC_CAPTURE_MAX_FDS ||
+            capture->buffers[i]->numInts > HWC_CAPTURE_MAX_INTS)
+            return FALSE;
+        capture->stride = stride;
+    }
+
+    /* The segment is only reachable through the fd handed to consumers */
+    snprintf(name, sizeof(name), "/hwcomposer-capture-%d", (int) getpid());
+    capture->shmFd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (capture->shmFd < 0)
+        return FALSE;
+    shm_unlink(name);
+
+    if (ftruncate(capture->shmFd, sizeof(hwc_capture_header)) != 0)
+        return FALSE;
+    shm = mmap(NULL, sizeof(hwc_capture_header), PROT_READ | PROT_WRITE, MAP_SHARED,
+               capture->shmFd, 0);
+    if (shm == MAP_FAILED)
+        return FALSE;
+
+    memset(shm, 0, sizeof(*shm));
+    shm->magic = HWC_CAPTURE_MAGIC;
+    shm->version = HWC_CAPTURE_VERSION;
+    shm->width = capture->width;
+    shm->height = capture->height;
+    shm->stride = capture->stride;
+    shm->format = HAL_PIXEL_FORMAT_RGBA_8888;
+    shm->usage = HWC_CAPTURE_USAGE;
+    capture->shm = shm;
+    return TRUE;
+}
+
+static Bool hwc_capture_listen(ScrnInfoPtr pScrn, const char *path)
+{
+    hwc_capture_ptr capture = &HWCPTR(pScrn)->capture;
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return FALSE;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    capture->listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (capture->listenFd < 0)
+        return FALSE;
+
+    unlink(path);
+    if (bind(capture->listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(capture->listenFd, 4) != 0)
+        return FALSE;
+
+    capture->socketPath = xnfstrdup(path);
+    return TRUE;
+}
+
+/* Only called on PreInit, "Capture" gives the socket, width and height 0 mean half the panel */
+void hwc_capture_init(ScrnInfoPtr pScrn, const char *path, int width, int height, int rate)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_capture_ptr capture = &hwc->capture;
+    hwc_rect_t crop = { 0, 0, hwc->hwcWidth, hwc->hwcHeight };
+    hwc_rect_t frame;
+    size_t size;
+
+    memset(capture, 0, sizeof(*capture));
+    capture->listenFd = -1;
+    capture->shmFd = -1;
+    capture->current = -1;
+    capture->retireFence = -1;
+    RegionNull(&capture->damage);
+
+    if (!path)
+        return;
+
+    if (!hwc_capture_supported(pScrn)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "capture needs an HWComposer 1.3 virtual display, ignoring \"Capture\"\n");
+        return;
+    }
+
+    capture->width = width > 0 ? width : hwc->hwcWidth / 2;
+    capture->height = height > 0 ? height : hwc->hwcHeight / 2;
+    capture->interval = max(1000 / (rate > 0 ? rate : HWC_CAPTURE_DEFAULT_RATE), 1);
+
+    if (!hwc_capture_alloc(pScrn) || !hwc_capture_listen(pScrn, path)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "failed to set up capture on %s: %s\n",
+                   path, strerror(errno));
+        hwc_capture_close(pScrn);
+        return;
+    }
+
+    size = sizeof(hwc_display_contents_1_t) + 2 * sizeof(hwc_layer_1_t);
+    capture->list = xnfcalloc(1, size);
+    frame.left = frame.top = 0;
+    frame.right = capture->width;
+    frame.bottom = capture->height;
+    hwc_capture_init_layer(&capture->list->hwLayers[0], HWC_FRAMEBUFFER, &crop, &frame);
+    hwc_capture_init_layer(&capture->list->hwLayers[1], HWC_FRAMEBUFFER_TARGET, &frame, &frame);
+    capture->list->numHwLayers = 2;
+    capture->list->retireFenceFd = -1;
+#ifdef HWC_DEVICE_API_VERSION_1_3
+    capture->list->outbufAcquireFenceFd = -1;
+#endif
+
+    capture->enabled = TRUE;
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "capturing %dx%d at up to %d Hz on %s\n",
+               capture->width, capture->height, 1000 / capture->interval, path);
+}
+
+void hwc_capture_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_capture_ptr capture = &hwc->capture;
+    int i;
+
+    if (capture->frames || capture->dropped)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "capture: %lu frames, %lu dropped, %lu clients\n",
+                   capture->frames, capture->dropped, capture->clients);
+
+    if (capture->retireFence != -1) {
+        sync_wait(capture->retireFence, -1);
+        close(capture->retireFence);
+    }
+    if (capture->listenFd >= 0) {
+        close(capture->listenFd);
+        unlink(capture->socketPath);
+    }
+    free(capture->socketPath);
+    if (capture->shm)
+        munmap(capture->shm, sizeof(hwc_capture_header));
+    if (capture->shmFd >= 0)
+        close(capture->shmFd);
+    for (i = 0; i < HWC_CAPTURE_SLOTS; i++) {
+        if (capture->buffers[i])
+            hwc->alloc->free(hwc->alloc, capture->buffers[i]);
+    }
+    free(capture->list);
+    RegionUninit(&capture->damage);
+
+    memset(capture, 0, sizeof(*capture));
+    capture->listenFd = -1;
+    capture->shmFd = -1;
+    capture->current = -1;
+    capture->retireFence = -1;
+    RegionNull(&capture->damage);
+}
+
+/* Root window damage since the last captured frame */
+void hwc_capture_damage(ScrnInfoPtr pScrn, RegionPtr region)
+{
+    hwc_capture_ptr capture = &HWCPTR(pScrn)->capture;
+
+    if (capture->enabled)
+        RegionUnion(&capture->damage, &capture->damage, region);
+}
+
+static Bool hwc_capture_send(int fd, const void *data, size_t size, const int *fds, int numFds)
+{
+    char control[CMSG_SPACE(sizeof(int) * (HWC_CAPTURE_MAX_FDS + 1))];
+    struct iovec iov = { (void *) data, size };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (numFds) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFds);
+    }
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t) size;
+}
+
+/* Hand the ring to a new consumer, it keeps the fds and the connection is done */
+static void hwc_capture_accept(ScrnInfoPtr pScrn)
+{
+    hwc_capture_ptr capture = &HWCPTR(pScrn)->capture;
+    hwc_capture_hello hello = { HWC_CAPTURE_MAGIC, HWC_CAPTURE_VERSION, HWC_CAPTURE_SLOTS };
+    hwc_capture_buffer msg;
+    const native_handle_t *handle;
+    Bool ok;
+    int fd, i;
+
+    while ((fd = accept(capture->listenFd, NULL, NULL)) >= 0) {
+        ok = hwc_capture_send(fd, &hello, sizeof(hello), &capture->shmFd, 1);
+
+        for (i = 0; ok && i < HWC_CAPTURE_SLOTS; i++) {
+            handle = capture->buffers[i];
+            memset(&msg, 0, sizeof(msg));
+            msg.slot = i;
+            msg.numFds = handle->numFds;
+            msg.numInts = handle->numInts;
+            memcpy(msg.ints, &handle->data[handle->numFds], sizeof(int) * handle->numInts);
+            ok = hwc_capture_send(fd, &msg, sizeof(msg), handle->data, handle->numFds);
+        }
+
+        if (ok)
+            capture->clients++;
+        else
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "capture: failed to send the buffers to a client\n");
+        close(fd);
+    }
+}
+
+/* A box of the root in panel coordinates, as the output rotation puts it there */
+static void hwc_capture_rotate(HWCPtr hwc, const BoxRec *root, BoxPtr panel)
+{
+    int w = hwc->hwcWidth, h = hwc->hwcHeight;
+
+    switch (hwc->rotation) {
+    case HWC_ROTATE_CW:
+        panel->x1 = w - root->y2;
+        panel->y1 = root->x1;
+        panel->x2 = w - root->y1;
+        panel->y2 = root->x2;
+        break;
+    case HWC_ROTATE_UD:
+        panel->x1 = w - root->x2;
+        panel->y1 = h - root->y2;
+        panel->x2 = w - root->x1;
+        panel->y2 = h - root->y1;
+        break;
+    case HWC_ROTATE_CCW:
+        panel->x1 = root->y1;
+        panel->y1 = h - root->x2;
+        panel->x2 = root->y2;
+        panel->y2 = h - root->x1;
+        break;
+    case HWC_ROTATE_NORMAL:
+    default:
+        *panel = *root;
+        break;
+    }
+
+    /* A root larger than the panel has parts that aren't shown */
+    panel->x1 = max(panel->x1, 0);
+    panel->y1 = max(panel->y1, 0);
+    panel->x2 = min(panel->x2, w);
+    panel->y2 = min(panel->y2, h);
+}
+
+/* Damage in capture coordinates, none if there are too many rectangles to list */
+static uint32_t hwc_capture_rects(hwc_capture_ptr capture, ScrnInfoPtr pScrn,
+                                  hwc_capture_rect *rects)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    int n = RegionNumRects(&capture->damage);
+    BoxPtr boxes = RegionRects(&capture->damage);
+    BoxRec box;
+    int i, count = 0;
+
+    if (n > HWC_CAPTURE_MAX_RECTS) {
+        boxes = RegionExtents(&capture->damage);
+        n = 1;
+    }
+
+    /* Round outwards, a partly damaged pixel of the scaled frame is damaged */
+    for (i = 0; i < n; i++) {
+        hwc_capture_rotate(hwc, &boxes[i], &box);
+        if (box.x1 >= box.x2 || box.y1 >= box.y2)
+            continue;
+
+        rects[count].x1 = box.x1 * capture->width / hwc->hwcWidth;
+        rects[count].y1 = box.y1 * capture->height / hwc->hwcHeight;
+        rects[count].x2 = min((box.x2 * capture->width + hwc->hwcWidth - 1) / hwc->hwcWidth,
+                              capture->width);
+        rects[count].y2 = min((box.y2 * capture->height + hwc->hwcHeight - 1) / hwc->hwcHeight,
+                              capture->height);
+        count++;
+    }
+
+    RegionEmpty(&capture->damage);
+    return count;
+}
+
+/* Publish the frame HWC composed once it is complete */
+static void hwc_capture_publish(ScrnInfoPtr pScrn)
+{
+    hwc_capture_ptr capture = &HWCPTR(pScrn)->capture;
+    hwc_capture_header *shm = capture->shm;
+    hwc_capture_slot *slot;
+
+    if (capture->current < 0 || capture->retireFence == -1 ||
+        sync_wait(capture->retireFence, 0) != 0)
+        return;
+
+    close(capture->retireFence);
+    capture->retireFence = -1;
+
+    slot = &shm->slots[capture->current];
+    slot->frame = shm->frame + 1;
+    slot->time = capture->composed;
+    slot->numRects = hwc_capture_rects(capture, pScrn, slot->rects);
+    __atomic_store_n(&shm->latest, capture->current, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&shm->frame, slot->frame, __ATOMIC_SEQ_CST);
+
+    capture->current = -1;
+    capture->frames++;
+}
+
+/* Called from the compositor timer */
+void hwc_capture_poll(ScrnInfoPtr pScrn)
+{
+    hwc_capture_ptr capture = &HWCPTR(pScrn)->capture;
+
+    if (!capture->enabled)
+        return;
+
+    hwc_capture_accept(pScrn);
+    hwc_capture_publish(pScrn);
+}
+
+#ifdef HWC_DEVICE_API_VERSION_1_3
+/* A free slot: not the one consumers are sent to and not read by one */
+static int hwc_capture_free_slot(hwc_capture_ptr capture)
+{
+    hwc_capture_header *shm = capture->shm;
+    uint32_t latest = __atomic_load_n(&shm->latest, __ATOMIC_SEQ_CST);
+    Bool published = __atomic_load_n(&shm->frame, __ATOMIC_SEQ_CST) != 0;
+    int i;
+
+    for (i = 0; i < HWC_CAPTURE_SLOTS; i++) {
+        if (published && i == latest)
+            continue;
+        if (!__atomic_load_n(&shm->slots[i].busy, __ATOMIC_SEQ_CST))
+            return i;
+    }
+
+    return -1;
+}
+#endif
+
+/*
+ * Before prepare(): add the virtual display to the contents if a frame
+ * is due. source is the buffer shown on the panel this frame.
+ */
+void hwc_capture_attach(ScrnInfoPtr pScrn, buffer_handle_t source, int acquireFence)
+{
+#ifdef HWC_DEVICE_API_VERSION_1_3
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_capture_ptr capture = &hwc->capture;
+    hwc_display_contents_1_t *list = capture->list;
+    CARD32 now = GetTimeInMillis();
+    int slot;
+
+    if (!capture->enabled)
+        return;
+
+    hwc->hwcContents[HWC_DISPLAY_VIRTUAL] = NULL;
+
+    hwc_capture_publish(pScrn);
+
+    /* HWC is still writing the last one or the rate says not yet */
+    if (capture->current >= 0 || (CARD32) (now - capture->lastFrame) < capture->interval)
+        return;
+
+    slot = hwc_capture_free_slot(capture);
+    if (slot < 0) {
+        capture->dropped++;
+        return;
+    }
+
+    list->outbuf = capture->buffers[slot];
+    list->outbufAcquireFenceFd = -1;
+    list->retireFenceFd = -1;
+    /* The display comes and goes, HWC has to plan it every time */
+    list->flags = HWC_GEOMETRY_CHANGED;
+    list->hwLayers[0].compositionType = HWC_FRAMEBUFFER;
+    list->hwLayers[0].handle = source;
+    list->hwLayers[0].acquireFenceFd = acquireFence == -1 ? -1 : dup(acquireFence);
+    list->hwLayers[0].releaseFenceFd = -1;
+    list->hwLayers[1].handle = capture->buffers[slot];
+    list->hwLayers[1].acquireFenceFd = -1;
+    list->hwLayers[1].releaseFenceFd = -1;
+
+    hwc->hwcContents[HWC_DISPLAY_VIRTUAL] = list;
+    capture->current = slot;
+    capture->lastFrame = now;
+#endif
+}
+
+/* After set(): the frame is on its way if HWC composed it itself */
+void hwc_capture_submitted(ScrnInfoPtr pScrn)
+{
+#ifdef HWC_DEVICE_API_VERSION_1_3
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_capture_ptr capture = &hwc->capture;
+    hwc_display_contents_1_t *list = hwc->hwcContents[HWC_DISPLAY_VIRTUAL];
+    int i;
+
+    if (!list)
+        return;
+    hwc->hwcContents[HWC_DISPLAY_VIRTUAL] = NULL;
+
+    for (i = 0; i < 2; i++) {
+        if (list->hwLayers[i].releaseFenceFd != -1)
+            close(list->hwLayers[i].releaseFenceFd);
+    }
+    /* set() took ownership of the acquire fence */
+    list->hwLayers[0].acquireFenceFd = -1;
+
+    if (list->hwLayers[0].compositionType != HWC_OVERLAY || list->retireFenceFd == -1) {
+        if (list->retireFenceFd != -1)
+            close(list->retireFenceFd);
+        capture->current = -1;
+        capture->dropped++;
+        if (++capture->refusals == HWC_CAPTURE_MAX_REFUSALS) {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "HWC doesn't compose the virtual display itself, capture turned off\n");
+            capture->enabled = FALSE;
+        }
+        return;
+    }
+
+    capture->refusals = 0;
+    capture->retireFence = list->retireFenceFd;
+    capture->composed = GetTimeInMicros();
+#endif
+}
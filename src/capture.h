@@ -0,0 +1,75 @@
+/*
+ * Screen capture ring shared with local consumers, e.g. an encoder.
+ *
+ * HWC composes the screen into one of HWC_CAPTURE_SLOTS gralloc buffers
+ * through its virtual display, see capture.c. A consumer connects to the
+ * SOCK_SEQPACKET socket given by Option "Capture" and receives:
+ *
+ *  1. a hwc_capture_hello with the fd of a shared hwc_capture_header,
+ *  2. a hwc_capture_buffer per slot with the fds of its native_handle.
+ *
+ * The consumer rebuilds the native handles (fds first, then ints) and
+ * imports them with gralloc. Then, for the newest frame:
+ *
+ *  - read latest, set slots[latest].busy to 1, read latest again and
+ *    start over if it changed, the driver never writes the latest slot
+ *    nor a busy one,
+ *  - use the buffer, then clear busy.
+ *
+ * All fields written by the driver are published by the store to
+ * latest and frame, use atomic loads for them. The damage of a slot is
+ * relative to the frame before it, a consumer that missed a frame must
+ * take the whole frame as damaged.
+ */
+
+#ifndef HWC_CAPTURE_H
+#define HWC_CAPTURE_H
+
+#include <stdint.h>
+
+#define HWC_CAPTURE_MAGIC 0x48574343 /* "HWCC" */
+#define HWC_CAPTURE_VERSION 1
+#define HWC_CAPTURE_SLOTS 3
+#define HWC_CAPTURE_MAX_RECTS 16
+#define HWC_CAPTURE_MAX_FDS 4
+#define HWC_CAPTURE_MAX_INTS 32
+
+typedef struct {
+    int16_t x1, y1, x2, y2;
+} hwc_capture_rect;
+
+typedef struct {
+    uint32_t busy;     /* set by a consumer while it reads the buffer */
+    uint32_t numRects; /* 0 means everything changed */
+    uint64_t frame;    /* number of the frame in the slot */
+    uint64_t time;     /* when it was composed, in microseconds */
+    hwc_capture_rect rects[HWC_CAPTURE_MAX_RECTS];
+} hwc_capture_slot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;   /* in pixels */
+    uint32_t format;   /* HAL_PIXEL_FORMAT_* */
+    uint32_t usage;    /* gralloc usage the buffers were allocated with */
+    uint32_t latest;   /* slot of the newest frame */
+    uint64_t frame;    /* frames published so far, 0 before the first */
+    hwc_capture_slot slots[HWC_CAPTURE_SLOTS];
+} hwc_capture_header;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numSlots;
+} hwc_capture_hello;
+
+typedef struct {
+    uint32_t slot;
+    uint32_t numFds;
+    uint32_t numInts;
+    int32_t ints[HWC_CAPTURE_MAX_INTS];
+} hwc_capture_buffer;
+
+#endif
@@ -0,0 +1,265 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "driver.h"
+
+/*
+ * Cursor image cache.
+ *
+ * X reloads the cursor image on every frame of an animated cursor and on
+ * every switch between e.g. the text and the pointer cursor. Instead of
+ * re-uploading the image each time, recently used images are kept in
+ * slots of a single atlas texture and a cache hit only changes which
+ * region of the atlas is sampled when the cursor is drawn.
+ */
+
+static uint64_t hwc_cursor_hash(const CARD32 *image, int count)
+{
+    /* FNV-1a over the 32-bit pixels */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        hash ^= image[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Slots are drawn 1:1, nearest filtering keeps neighbours from bleeding in */
+static void hwc_cursor_cache_alloc_texture(HWCPtr hwc)
+{
+    hwc_gl_bind_texture(&hwc->renderer.state, hwc->renderer.cursorTexture);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+                 hwc->cursorWidth * HWC_CURSOR_CACHE_COLS,
+                 hwc->cursorHeight * HWC_CURSOR_CACHE_ROWS,
+                 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+}
+
+void hwc_cursor_cache_init(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_cursor_cache_ptr cache = &hwc->cursorCache;
+    size_t size = hwc->cursorWidth * hwc->cursorHeight * sizeof(CARD32);
+    int i;
+
+    for (i = 0; i < HWC_CURSOR_CACHE_SLOTS; i++) {
+        cache->slots[i].image = xnfalloc(size);
+        cache->slots[i].valid = FALSE;
+        cache->slots[i].lastUsed = 0;
+    }
+    cache->current = 0;
+    cache->clock = 0;
+    cache->hits = cache->misses = cache->evictions = 0;
+
+    /* The CPU compositor blends straight from the slot images */
+    if (hwc->swCompositor)
+        return;
+
+    if (hwc->glamor)
+        hwc_gl_state_invalidate(&hwc->renderer.state);
+    hwc_cursor_cache_alloc_texture(hwc);
+}
+
+void hwc_cursor_cache_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_cursor_cache_ptr cache = &hwc->cursorCache;
+    unsigned long lookups = cache->hits + cache->misses;
+    int i;
+
+    if (lookups)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "cursor cache: %lu hits, %lu misses, %lu evictions (%lu%% hit rate)\n",
+                   cache->hits, cache->misses, cache->evictions,
+                   cache->hits * 100 / lookups);
+
+    for (i = 0; i < HWC_CURSOR_CACHE_SLOTS; i++) {
+        free(cache->slots[i].image);
+        cache->slots[i].image = NULL;
+        cache->slots[i].valid = FALSE;
+    }
+}
+
+/* Free the atlas texture while the panel is off, the slot images are kept */
+void hwc_cursor_cache_suspend(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (hwc->swCursor || hwc->swCompositor || !hwc->renderer.cursorTexture)
+        return;
+
+    glDeleteTextures(1, &hwc->renderer.cursorTexture);
+    hwc->renderer.cursorTexture = 0;
+    hwc_gl_state_invalidate(&hwc->renderer.state);
+}
+
+/* Recreate the atlas texture and upload the cached images into it again */
+void hwc_cursor_cache_resume(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_cursor_cache_ptr cache = &hwc->cursorCache;
+    int i;
+
+    if (hwc->swCursor || hwc->swCompositor || hwc->renderer.cursorTexture)
+        return;
+
+    hwc_gl_state_invalidate(&hwc->renderer.state);
+    glGenTextures(1, &hwc->renderer.cursorTexture);
+    hwc_cursor_cache_alloc_texture(hwc);
+
+    for (i = 0; i < HWC_CURSOR_CACHE_SLOTS; i++) {
+        if (!cache->slots[i].valid)
+            continue;
+        glTexSubImage2D(GL_TEXTURE_2D, 0,
+                        (i % HWC_CURSOR_CACHE_COLS) * hwc->cursorWidth,
+                        (i / HWC_CURSOR_CACHE_COLS) * hwc->cursorHeight,
+                        hwc->cursorWidth, hwc->cursorHeight,
+                        GL_RGBA, GL_UNSIGNED_BYTE, cache->slots[i].image);
+    }
+}
+
+/*
+ * Make the given image the current cursor, uploading it into the atlas
+ * only if it isn't cached yet. The least recently used slot is evicted
+ * when the cache is full.
+ */
+void hwc_cursor_cache_load(ScrnInfoPtr pScrn, CARD32 *image)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_cursor_cache_ptr cache = &hwc->cursorCache;
+    int count = hwc->cursorWidth * hwc->cursorHeight;
+    uint64_t hash = hwc_cursor_hash(image, count);
+    hwc_cursor_slot *slot;
+    int i, victim = 0;
+
+    cache->clock++;
+
+    for (i = 0; i < HWC_CURSOR_CACHE_SLOTS; i++) {
+        slot = &cache->slots[i];
+        if (slot->valid && slot->hash == hash &&
+            memcmp(slot->image, image, count * sizeof(CARD32)) == 0) {
+            slot->lastUsed = cache->clock;
+            cache->current = i;
+            cache->hits++;
+            return;
+        }
+    }
+
+    for (i = 0; i < HWC_CURSOR_CACHE_SLOTS; i++) {
+        if (!cache->slots[i].valid) {
+            victim = i;
+            break;
+        }
+        if (cache->slots[i].lastUsed < cache->slots[victim].lastUsed)
+            victim = i;
+    }
+
+    slot = &cache->slots[victim];
+    if (slot->valid)
+        cache->evictions++;
+    cache->misses++;
+
+    memcpy(slot->image, image, count * sizeof(CARD32));
+    slot->hash = hash;
+    slot->valid = TRUE;
+    slot->lastUsed = cache->clock;
+    cache->current = victim;
+
+    /* While suspended the slot is uploaded on resume */
+    if (hwc->swCompositor || !hwc->renderer.cursorTexture)
+        return;
+
+    /* glamor may have rebound textures behind the state tracker's back */
+    if (hwc->glamor)
+        hwc_gl_state_invalidate(&hwc->renderer.state);
+    hwc_gl_bind_texture(&hwc->renderer.state, hwc->renderer.cursorTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0,
+                    (victim % HWC_CURSOR_CACHE_COLS) * hwc->cursorWidth,
+                    (victim / HWC_CURSOR_CACHE_COLS) * hwc->cursorHeight,
+                    hwc->cursorWidth, hwc->cursorHeight,
+                    GL_RGBA, GL_UNSIGNED_BYTE, image);
+}
+
+/*
+ * Map whole-texture coordinates (0..1) into the atlas region of the
+ * current cursor.
+ */
+void hwc_cursor_cache_texcoords(ScrnInfoPtr pScrn, const GLfloat *in, GLfloat *out)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    int slot = hwc->cursorCache.current;
+    GLfloat col = slot % HWC_CURSOR_CACHE_COLS;
+    GLfloat row = slot / HWC_CURSOR_CACHE_COLS;
+    int i;
+
+    for (i = 0; i < 8; i += 2) {
+        out[i] = (col + in[i]) / HWC_CURSOR_CACHE_COLS;
+        out[i + 1] = (row + in[i + 1]) / HWC_CURSOR_CACHE_ROWS;
+    }
+}
+
+/*
+ * Cursor position.
+ *
+ * With threaded input the server moves the cursor from the input thread
+ * while the compositor timer runs on the main thread. The position is
+ * published under a sequence lock, so the compositor never sees x of one
+ * move and y of another, and it is read only when the cursor is drawn,
+ * right before the frame is handed over. The age of the position at
+ * that point is what the HWC_CURSOR_LATENCY property reports.
+ */
+
+/* Called with the input lock held, so there is only ever one writer */
+void hwc_cursor_publish(ScrnInfoPtr pScrn, int x, int y)
+{
+    hwc_cursor_pos_ptr pos = &HWCPTR(pScrn)->cursorPos;
+    uint32_t seq = __atomic_load_n(&pos->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&pos->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&pos->x, x, __ATOMIC_RELAXED);
+    __atomic_store_n(&pos->y, y, __ATOMIC_RELAXED);
+    __atomic_store_n(&pos->time, GetTimeInMicros(), __ATOMIC_RELAXED);
+
+    __atomic_store_n(&pos->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Latch the latest position for the frame being composited */
+void hwc_cursor_sample(ScrnInfoPtr pScrn, int *x, int *y)
+{
+    hwc_cursor_pos_ptr pos = &HWCPTR(pScrn)->cursorPos;
+    uint32_t seq;
+    CARD64 time, now;
+
+    do {
+        seq = __atomic_load_n(&pos->seq, __ATOMIC_ACQUIRE);
+        *x = __atomic_load_n(&pos->x, __ATOMIC_RELAXED);
+        *y = __atomic_load_n(&pos->y, __ATOMIC_RELAXED);
+        time = __atomic_load_n(&pos->time, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&pos->seq, __ATOMIC_RELAXED));
+
+    /* Only a move shows up on screen, a still cursor has no latency */
+    if (seq == pos->sampledSeq)
+        return;
+    pos->sampledSeq = seq;
+
+    now = GetTimeInMicros();
+    pos->samples[pos->index] = (CARD32) min(now - time, 0xffffffffULL);
+    pos->index = (pos->index + 1) % HWC_STATS_SAMPLES;
+    if (pos->count < HWC_STATS_SAMPLES)
+        pos->count++;
+}
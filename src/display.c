@@ -71,15 +71,17 @@ static void
 hwc_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
 {
     HWCPtr hwc = HWCPTR(crtc->scrn);
-    hwc->cursorX = x;
-    hwc->cursorY = y;
-    hwc->dirty = TRUE;
+    hwc_cursor_publish(crtc->scrn, x, y);
+    /* From the input thread */
+    HWC_SET_DIRTY(hwc);
+    hwc_power_cursor(crtc->scrn);
 }
 
 /*
  * The load_cursor_argb_check driver hook.
  *
- * Sets the hardware cursor by uploading it to texture.
+ * Sets the hardware cursor by looking it up in the cursor cache,
+ * uploading it to the cursor atlas texture only when it's not cached yet.
  * On failure, returns FALSE indicating that the X server should fall
  * back to software cursors.
  */
@@ -88,13 +90,9 @@ hwc_load_cursor_argb_check(xf86CrtcPtr crtc, CARD32 *image)
 {
     HWCPtr hwc = HWCPTR(crtc->scrn);
 
-    glBindTexture(GL_TEXTURE_2D, hwc->renderer.cursorTexture);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, hwc->cursorWidth, hwc->cursorHeight,
-                    0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+    hwc_cursor_cache_load(crtc->scrn, image);
 
-    hwc->dirty = TRUE;
+    HWC_SET_DIRTY(hwc);
     return TRUE;
 }
 
@@ -103,7 +101,7 @@ hwc_hide_cursor(xf86CrtcPtr crtc)
 {
     HWCPtr hwc = HWCPTR(crtc->scrn);
     hwc->cursorShown = FALSE;
-    hwc->dirty = TRUE;
+    HWC_SET_DIRTY(hwc);
 }
 
 static void
@@ -111,11 +109,25 @@ hwc_show_cursor(xf86CrtcPtr crtc)
 {
     HWCPtr hwc = HWCPTR(crtc->scrn);
     hwc->cursorShown = TRUE;
-    hwc->dirty = TRUE;
+    HWC_SET_DIRTY(hwc);
+}
+
+static void
+hwc_crtc_gamma_set(xf86CrtcPtr crtc, CARD16 *red, CARD16 *green, CARD16 *blue,
+                   int size)
+{
+    ScrnInfoPtr pScrn = crtc->scrn;
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (hwc->swCompositor)
+        return;
+
+    hwc_egl_renderer_set_gamma(pScrn, red, green, blue, size);
 }
 
 static const xf86CrtcFuncsRec hwcomposer_crtc_funcs = {
     .dpms = hwcomposer_crtc_dpms,
+    .gamma_set = hwc_crtc_gamma_set,
     .set_mode_major = hwcomposer_set_mode_major,
     .set_cursor_colors = hwc_set_cursor_colors,
     .set_cursor_position = hwc_set_cursor_position,
@@ -124,21 +136,63 @@ static const xf86CrtcFuncsRec hwcomposer_crtc_funcs = {
     .load_cursor_argb_check = hwc_load_cursor_argb_check
 };
 
+/* Standby and suspend doze the panel when asked to, keeping it lit */
+static int
+hwc_output_power_mode(HWCPtr hwc, int mode)
+{
+    switch (mode) {
+    case DPMSModeOn:
+        return HWC_POWER_MODE_NORMAL;
+    case DPMSModeStandby:
+        return hwc->doze ? HWC_POWER_MODE_DOZE : HWC_POWER_MODE_OFF;
+    case DPMSModeSuspend:
+        return hwc->doze ? HWC_POWER_MODE_DOZE_SUSPEND : HWC_POWER_MODE_OFF;
+    default:
+        return HWC_POWER_MODE_OFF;
+    }
+}
+
 static void
 hwc_output_dpms(xf86OutputPtr output, int mode)
 {
     ScrnInfoPtr pScrn;
     pScrn = output->scrn;
     HWCPtr hwc = HWCPTR(pScrn);
+    int powerMode = hwc_output_power_mode(hwc, mode);
+    Bool off = powerMode == HWC_POWER_MODE_OFF;
 
     hwc->dpmsMode = mode;
-    hwc_toggle_screen_brightness(pScrn);
-
-    hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, (mode == DPMSModeOn) ? 1 : 0);
 
-    if (mode == DPMSModeOn)
-        // Force redraw after unblank
-        hwc->dirty = TRUE;
+    /* A dozing panel still shows the last frame, so keep the buffers */
+    if (!off)
+        hwc_resume(pScrn);
+
+    /* The HAL calls may block, the panel worker makes them */
+    hwc_panel_request(pScrn, off && hwc->backlightOnly ? HWC_POWER_MODE_NORMAL : powerMode,
+                      off ? 0 : hwc->screenBrightness);
+    hwc->powerMode = powerMode;
+    hwc_stats_power_mode(pScrn, powerMode);
+    hwc_power_set_interactive(pScrn, mode == DPMSModeOn);
+
+    /* The timer turns vsync events off once the worker is out of the HAL */
+    if (powerMode != HWC_POWER_MODE_NORMAL && hwc->sched.vsyncOn)
+        hwc_update_now(pScrn);
+
+    /*
+     * With only the backlight off HWC still scans out the last frame.
+     * Otherwise it may do so until the worker has the panel off, the
+     * timer suspends once hwc_panel_ready says it is.
+     */
+    hwc->suspendPending = off && hwc->dpmsSuspend && !hwc->backlightOnly;
+    if (hwc->suspendPending)
+        hwc_update_now(pScrn);
+
+    if (HWC_DISPLAY_ACTIVE(hwc)) {
+        // Force redraw after unblank, HWC has to revalidate the layers
+        hwc_hwcomposer_geometry_changed(pScrn);
+        HWC_SET_DIRTY(hwc);
+        hwc_update_now(pScrn);
+    }
 }
 
 static xf86OutputStatus
@@ -163,7 +217,23 @@ hwc_output_get_modes(xf86OutputPtr output)
     return xf86DuplicateModes(NULL, hwc->modes);
 }
 
+static void
+hwc_output_create_resources(xf86OutputPtr output)
+{
+    hwc_stats_create_resources(output);
+    hwc_gl_debug_create_resources(output);
+}
+
+static Bool
+hwc_output_set_property(xf86OutputPtr output, Atom property, RRPropertyValuePtr value)
+{
+    return hwc_gl_debug_set_property(output, property, value);
+}
+
 static const xf86OutputFuncsRec hwc_output_funcs = {
+    .create_resources = hwc_output_create_resources,
+    .set_property = hwc_output_set_property,
+    .get_property = hwc_stats_get_property,
     .dpms = hwc_output_dpms,
     .detect = hwc_output_detect,
     .mode_valid = hwc_output_mode_valid,
@@ -195,7 +265,7 @@ hwc_display_pre_init(ScrnInfoPtr pScrn)
     pScrn->displayWidth = pScrn->virtualX;
 
     /* Construct a mode with the screen's initial dimensions */
-    hwc->modes = xf86CVTMode(pScrn->virtualX, pScrn->virtualY, 60, 0, 0);
+    hwc->modes = xf86CVTMode(pScrn->virtualX, pScrn->virtualY, hwc->refreshRate, 0, 0);
 
     xf86CrtcConfigInit(pScrn, &hwc_xf86crtc_config_funcs);
     xf86CrtcSetSizeRange(pScrn, 8, 8, SHRT_MAX, SHRT_MAX);
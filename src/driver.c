@@ -28,6 +28,8 @@
 
 #include "picturestr.h"
 
+#include <stdio.h>
+
 /*
  * Driver data structures.
  */
@@ -75,6 +77,7 @@ static Bool	hwc_driver_func(ScrnInfoPtr pScrn, xorgDriverFuncOp op,
 
 // For ~60 FPS
 #define TIMER_DELAY 17 /* in milliseconds */
+#define DOZE_TIMER_DELAY 1000 /* in milliseconds, while the panel dozes */
 
 /*
  * This is intentionally screen-independent.  It indicates the binding
@@ -110,7 +113,26 @@ typedef enum {
     OPTION_ACCEL_METHOD,
     OPTION_EGL_PLATFORM,
     OPTION_SW_CURSOR,
-    OPTION_ROTATE
+    OPTION_ROTATE,
+    OPTION_DPMS_SUSPEND,
+    OPTION_HWC_API,
+    OPTION_HEADLESS,
+    OPTION_HEADLESS_SIZE,
+    OPTION_HEADLESS_REFRESH,
+    OPTION_POWER_HINTS,
+    OPTION_LATENCY_TRACE,
+    OPTION_SWAPCHAIN_DEPTH,
+    OPTION_SWAPCHAIN_MODE,
+    OPTION_GL_DEBUG,
+    OPTION_DOZE,
+    OPTION_ROOT_UPLOAD,
+    OPTION_DPMS_BACKLIGHT_ONLY,
+    OPTION_ROOT_OVERLAY,
+    OPTION_CAPTURE,
+    OPTION_CAPTURE_SIZE,
+    OPTION_CAPTURE_RATE,
+    OPTION_FRAME_SCHEDULER,
+    OPTION_ADAPTIVE_REFRESH
 } Opts;
 
 static const OptionInfoRec Options[] = {
@@ -118,6 +140,25 @@ static const OptionInfoRec Options[] = {
     { OPTION_EGL_PLATFORM, "EGLPlatform", OPTV_STRING, {0}, FALSE},
     { OPTION_SW_CURSOR,     "SWcursor",    OPTV_BOOLEAN,{0}, FALSE},
     { OPTION_ROTATE,       "Rotate",      OPTV_STRING, {0}, FALSE },
+    { OPTION_DPMS_SUSPEND, "DPMSSuspend", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_HWC_API,      "HWCAPI",      OPTV_STRING, {0}, FALSE },
+    { OPTION_HEADLESS,     "Headless",    OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_HEADLESS_SIZE, "HeadlessSize", OPTV_STRING, {0}, FALSE },
+    { OPTION_HEADLESS_REFRESH, "HeadlessRefresh", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_POWER_HINTS,  "PowerHints",  OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_LATENCY_TRACE, "LatencyTrace", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_SWAPCHAIN_DEPTH, "SwapchainDepth", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_SWAPCHAIN_MODE, "SwapchainMode", OPTV_STRING, {0}, FALSE },
+    { OPTION_GL_DEBUG,     "GLDebug",     OPTV_STRING, {0}, FALSE },
+    { OPTION_DOZE,         "Doze",        OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_ROOT_UPLOAD,  "RootUpload",  OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_DPMS_BACKLIGHT_ONLY, "DPMSBacklightOnly", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_ROOT_OVERLAY, "RootOverlay", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_CAPTURE,      "Capture",     OPTV_STRING, {0}, FALSE },
+    { OPTION_CAPTURE_SIZE, "CaptureSize", OPTV_STRING, {0}, FALSE },
+    { OPTION_CAPTURE_RATE, "CaptureRate", OPTV_INTEGER,{0}, FALSE },
+    { OPTION_FRAME_SCHEDULER, "FrameScheduler", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_ADAPTIVE_REFRESH, "AdaptiveRefresh", OPTV_BOOLEAN,{0}, FALSE },
     { -1,               NULL,       OPTV_NONE,    {0}, FALSE }
 };
 
@@ -291,7 +332,9 @@ try_enable_glamor(ScrnInfoPtr pScrn)
     const char *accel_method_str = xf86GetOptValString(hwc->Options,
                                                        OPTION_ACCEL_METHOD);
     Bool do_glamor = (!accel_method_str ||
-                      strcmp(accel_method_str, "glamor") == 0);
+                      strcmp(accel_method_str, "glamor") == 0 ||
+                      (strcmp(accel_method_str, "auto") == 0 &&
+                       hwc_accel_prefer_glamor(pScrn)));
 
     if (!do_glamor) {
         xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "glamor disabled\n");
@@ -341,12 +384,69 @@ void hwc_set_egl_platform(ScrnInfoPtr pScrn)
     if (egl_platform_str) {
         setenv("EGL_PLATFORM", egl_platform_str, 1);
     }
-    else {
+    else if (!hwc->headless) {
         // Default to EGL_PLATFORM=hwcomposer
         setenv("EGL_PLATFORM", "hwcomposer", 0);
     }
 }
 
+/* Size and refresh rate of the offscreen output that replaces HWComposer */
+static void hwc_headless_pre_init(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    const char *s;
+    int refresh;
+
+    hwc->hwcWidth = HWC_HEADLESS_WIDTH;
+    hwc->hwcHeight = HWC_HEADLESS_HEIGHT;
+
+    if ((s = xf86GetOptValString(hwc->Options, OPTION_HEADLESS_SIZE))) {
+        int width, height;
+
+        if (sscanf(s, "%dx%d", &width, &height) == 2 && width > 0 && height > 0) {
+            hwc->hwcWidth = width;
+            hwc->hwcHeight = height;
+        }
+        else {
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                    "\"%s\" is not a valid value for Option \"HeadlessSize\", expected WIDTHxHEIGHT\n", s);
+        }
+    }
+
+    if (xf86GetOptValInteger(hwc->Options, OPTION_HEADLESS_REFRESH, &refresh)) {
+        if (refresh > 0)
+            hwc->refreshRate = refresh;
+        else
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                    "%d is not a valid value for Option \"HeadlessRefresh\"\n", refresh);
+    }
+
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "headless output %dx%d at %d Hz\n",
+               hwc->hwcWidth, hwc->hwcHeight, hwc->refreshRate);
+}
+
+/* "Capture" streams the screen to a socket, see capture.c */
+static void hwc_capture_pre_init(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    const char *path = xf86GetOptValString(hwc->Options, OPTION_CAPTURE);
+    const char *s;
+    int width = 0, height = 0, rate = 0;
+
+    if ((s = xf86GetOptValString(hwc->Options, OPTION_CAPTURE_SIZE)) &&
+        (sscanf(s, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                "\"%s\" is not a valid value for Option \"CaptureSize\", expected WIDTHxHEIGHT\n", s);
+        width = height = 0;
+    }
+
+    if (xf86GetOptValInteger(hwc->Options, OPTION_CAPTURE_RATE, &rate) && rate <= 0)
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                "%d is not a valid value for Option \"CaptureRate\"\n", rate);
+
+    hwc_capture_init(pScrn, path, width, height, rate);
+}
+
 /* Mandatory */
 Bool
 PreInit(ScrnInfoPtr pScrn, int flags)
@@ -453,23 +553,139 @@ PreInit(ScrnInfoPtr pScrn, int flags)
         }
     }
 
+    s = xf86GetOptValString(hwc->Options, OPTION_ACCEL_METHOD);
+    hwc->swCompositor = s && !xf86NameCmp(s, "none");
+    if (hwc->swCompositor) {
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                    "using CPU compositor, EGL and GLES disabled\n");
+    }
+
     hwc->swCursor = xf86ReturnOptValBool(hwc->Options, OPTION_SW_CURSOR, FALSE);
     if (hwc->swCursor) {
         xf86DrvMsg(pScrn->scrnIndex, X_INFO,
                     "hardware cursor disabled\n");
     }
 
+    hwc->dpmsSuspend = xf86ReturnOptValBool(hwc->Options, OPTION_DPMS_SUSPEND, FALSE);
+    if (hwc->dpmsSuspend) {
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                    "releasing display buffers while DPMS is off\n");
+    }
+    hwc->suspended = FALSE;
+
+    hwc->hwcApi = 0;
+    if ((s = xf86GetOptValString(hwc->Options, OPTION_HWC_API))) {
+        if (!xf86NameCmp(s, "1"))
+            hwc->hwcApi = 1;
+        else if (!xf86NameCmp(s, "2")) {
+#ifdef HAVE_HWC2
+            hwc->hwcApi = 2;
+#else
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                    "built without HWComposer 2 support, using HWComposer 1\n");
+            hwc->hwcApi = 1;
+#endif
+        }
+        else if (xf86NameCmp(s, "auto")) {
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                    "\"%s\" is not a valid value for Option \"HWCAPI\"\n", s);
+            xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                    "valid options are \"auto\", \"1\", \"2\"\n");
+        }
+    }
+
+    hwc->refreshRate = HWC_DEFAULT_REFRESH;
+    hwc->headless = xf86ReturnOptValBool(hwc->Options, OPTION_HEADLESS, FALSE);
+    if (hwc->headless && hwc->swCompositor) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                    "the CPU compositor needs HWComposer, using EGL for the headless output\n");
+        hwc->swCompositor = FALSE;
+    }
+
+    hwc->powerMode = HWC_POWER_MODE_NORMAL;
+    hwc_stats_power_mode(pScrn, hwc->powerMode);
+    hwc->doze = xf86ReturnOptValBool(hwc->Options, OPTION_DOZE, FALSE);
+    if (hwc->doze)
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "DPMS standby and suspend put the display in doze mode\n");
+
     hwc_set_egl_platform(pScrn);
 
-    if (!hwc_hwcomposer_init(pScrn)) {
-        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-                    "failed to initialize HWComposer API and layers\n");
-        return FALSE;
+    if (hwc->headless)
+        hwc_headless_pre_init(pScrn);
+    else {
+        if (!hwc_hwcomposer_init(pScrn)) {
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                        "failed to initialize HWComposer API and layers\n");
+            return FALSE;
+        }
+
+        if (!hwc_lights_init(pScrn)) {
+            xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                        "failed to initialize lights module for backlight control\n");
+        }
     }
 
-    if (!hwc_lights_init(pScrn)) {
-        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
-                    "failed to initialize lights module for backlight control\n");
+    hwc_capture_pre_init(pScrn);
+    hwc_sched_init(pScrn, xf86ReturnOptValBool(hwc->Options, OPTION_FRAME_SCHEDULER, FALSE));
+    hwc_refresh_init(pScrn, xf86ReturnOptValBool(hwc->Options, OPTION_ADAPTIVE_REFRESH, FALSE));
+
+    hwc_panel_init(pScrn);
+    hwc->backlightOnly = xf86ReturnOptValBool(hwc->Options, OPTION_DPMS_BACKLIGHT_ONLY, FALSE);
+    if (hwc->backlightOnly)
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "DPMS off only turns the backlight off, HWC stays on\n");
+
+    memset(&hwc->power, 0, sizeof(hwc->power));
+    if (!hwc->headless && xf86ReturnOptValBool(hwc->Options, OPTION_POWER_HINTS, TRUE)) {
+        if (hwc_power_init(pScrn))
+            xf86DrvMsg(pScrn->scrnIndex, X_INFO, "power HAL interaction hints enabled\n");
+    }
+
+    memset(&hwc->swapchain, 0, sizeof(hwc->swapchain));
+    if (xf86GetOptValInteger(hwc->Options, OPTION_SWAPCHAIN_DEPTH, &hwc->swapchain.depth) &&
+        hwc->swapchain.depth) {
+        if (hwc->headless || hwc->swCompositor) {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                        "the swapchain needs HWComposer and the GL compositor, ignoring \"SwapchainDepth\"\n");
+            hwc->swapchain.depth = 0;
+        }
+        else if (hwc->swapchain.depth < 2 || hwc->swapchain.depth > HWC_SWAPCHAIN_MAX) {
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                        "\"SwapchainDepth\" must be 0 or 2 to %d\n", HWC_SWAPCHAIN_MAX);
+            hwc->swapchain.depth = 0;
+        }
+    }
+
+    if (hwc->swapchain.depth) {
+        hwc->swapchain.mode = HWC_SWAPCHAIN_FIFO;
+        if ((s = xf86GetOptValString(hwc->Options, OPTION_SWAPCHAIN_MODE))) {
+            if (!xf86NameCmp(s, "mailbox"))
+                hwc->swapchain.mode = HWC_SWAPCHAIN_MAILBOX;
+            else if (xf86NameCmp(s, "fifo")) {
+                xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                        "\"%s\" is not a valid value for Option \"SwapchainMode\"\n", s);
+                xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                        "valid options are \"fifo\", \"mailbox\"\n");
+            }
+        }
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "swapchain of %d buffers, %s\n",
+                    hwc->swapchain.depth,
+                    hwc->swapchain.mode == HWC_SWAPCHAIN_MAILBOX ? "mailbox" : "fifo");
+    }
+
+    memset(&hwc->glDebug, 0, sizeof(hwc->glDebug));
+    if ((s = xf86GetOptValString(hwc->Options, OPTION_GL_DEBUG))) {
+        if (!xf86NameCmp(s, "errors"))
+            hwc->glDebug.level = HWC_GL_DEBUG_ERRORS;
+        else if (!xf86NameCmp(s, "full"))
+            hwc->glDebug.level = HWC_GL_DEBUG_FULL;
+        else if (xf86NameCmp(s, "off")) {
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                        "\"%s\" is not a valid value for Option \"GLDebug\"\n", s);
+            xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                        "valid options are \"off\", \"errors\", \"full\"\n");
+        }
     }
 
     hwc_display_pre_init(pScrn);
@@ -494,22 +710,33 @@ PreInit(ScrnInfoPtr pScrn, int flags)
     pScrn->memPhysBase = 0;
     pScrn->fbOffset = 0;
 
-    if (!hwc_egl_renderer_init(pScrn)) {
-        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-                    "failed to initialize EGL renderer\n");
+    hwc->buffer = NULL;
+
+    hwc->glamor = FALSE;
+    hwc->drihybris = FALSE;
+
+    if (hwc->swCompositor) {
+        if (!hwc_sw_renderer_init(pScrn)) {
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                        "failed to initialize CPU compositor\n");
             return FALSE;
+        }
+        return TRUE;
     }
 
-    if (!hwc_init_hybris_native_buffer(pScrn)) {
+    if (!hwc_egl_renderer_init(pScrn)) {
         xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-                    "failed to initialize libhybris native buffer EGL extension\n");
-        return FALSE;
+                    "failed to initialize EGL renderer\n");
+            return FALSE;
     }
 
-    hwc->buffer = NULL;
+    /* Without native buffers the root is uploaded, "RootUpload" forces that for comparison */
+    memset(&hwc->upload, 0, sizeof(hwc->upload));
+    if (!hwc_init_hybris_native_buffer(pScrn) ||
+        xf86ReturnOptValBool(hwc->Options, OPTION_ROOT_UPLOAD, FALSE))
+        hwc_upload_init(pScrn);
+    hwc_overlay_init(pScrn, xf86ReturnOptValBool(hwc->Options, OPTION_ROOT_OVERLAY, FALSE));
 
-    hwc->glamor = FALSE;
-    hwc->drihybris = FALSE;
 #ifdef ENABLE_GLAMOR
     try_enable_glamor(pScrn);
 #endif
@@ -574,17 +801,106 @@ static void hwcBlockHandler(ScreenPtr pScreen, void *timeout)
     pScreen->BlockHandler(pScreen, timeout);
     pScreen->BlockHandler = hwcBlockHandler;
 
-    if (hwc->damage && hwc->dpmsMode == DPMSModeOn) {
+    hwc_power_flush(pScrn);
+
+    if (hwc->damage && HWC_DISPLAY_ACTIVE(hwc)) {
         RegionPtr dirty = DamageRegion(hwc->damage);
         unsigned num_cliprects = REGION_NUM_RECTS(dirty);
 
         if (num_cliprects) {
+            if (hwc->powerMode == HWC_POWER_MODE_NORMAL)
+                hwc_power_damage(pScrn);
+            hwc_latency_damage(pScrn);
+            if (hwc->swCompositor)
+                hwc_sw_renderer_damage(pScrn, dirty);
+            else if (hwc->upload.enabled && !hwc->glamor)
+                hwc_upload_damage(pScrn, dirty);
+            hwc_capture_damage(pScrn, dirty);
             DamageEmpty(hwc->damage);
-            hwc->dirty = TRUE;
+            HWC_SET_DIRTY(hwc);
         }
     }
 }
 
+static void
+ReleaseRootBuffer(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    hwc_upload_close(pScrn);
+
+    if (!hwc->buffer)
+        return;
+
+    hwc_overlay_release(pScrn);
+    hwc_egl_renderer_release_root(pScrn);
+    hwc->renderer.eglHybrisReleaseNativeBuffer(hwc->buffer);
+    hwc->buffer = NULL;
+}
+
+/* Back the root window with a libhybris native buffer sampled by the GL renderer */
+static void
+CreateRootBuffer(ScreenPtr pScreen, PixmapPtr rootPixmap)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    void *pixels = NULL;
+    int err;
+
+    /*
+     * glamor renders into its own texture. Mapping a native buffer for
+     * it would only make every frame wait for the GPU in gralloc lock.
+     */
+    if (hwc->glamor) {
+        hwc_egl_renderer_screen_init(pScreen);
+#ifdef ENABLE_GLAMOR
+        hwc->renderer.rootTexture = glamor_get_pixmap_texture(rootPixmap);
+#endif
+        return;
+    }
+
+    if (hwc->upload.enabled) {
+        pixels = hwc_upload_create_root(pScreen);
+        hwc_egl_renderer_screen_init(pScreen);
+        if (!pScreen->ModifyPixmapHeader(rootPixmap, -1, -1, -1, -1, -1, pixels))
+            FatalError("Couldn't adjust screen pixmap\n");
+        return;
+    }
+
+    /* The buffer of the previous server generation is kept while the size matches */
+    if (hwc->buffer && (hwc->bufferWidth != pScrn->virtualX ||
+                        hwc->bufferHeight != pScrn->virtualY))
+        ReleaseRootBuffer(pScrn);
+
+    if (!hwc->buffer) {
+        /* HWC scans an overlay root out as it is, it has to say what X draws */
+        hwc->bufferBGRA = hwc->overlay.enabled;
+        err = hwc->renderer.eglHybrisCreateNativeBuffer(pScrn->virtualX, pScrn->virtualY,
+                                          HYBRIS_USAGE_HW_TEXTURE |
+                                          (hwc->overlay.enabled ? HYBRIS_USAGE_HW_COMPOSER : 0) |
+                                          HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
+                                          hwc->bufferBGRA ? HYBRIS_PIXEL_FORMAT_BGRA_8888 :
+                                                            HYBRIS_PIXEL_FORMAT_RGBA_8888,
+                                          &hwc->stride, &hwc->buffer);
+
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "alloc: status=%d, stride=%d\n", err, hwc->stride);
+        hwc->bufferWidth = pScrn->virtualX;
+        hwc->bufferHeight = pScrn->virtualY;
+    }
+
+    hwc_egl_renderer_screen_init(pScreen);
+
+    err = hwc->renderer.eglHybrisLockNativeBuffer(hwc->buffer,
+                                    HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
+                                    0, 0, hwc->stride, pScrn->virtualY, &pixels);
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "gralloc lock returns %i\n", err);
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "lock to vaddr %p\n", pixels);
+
+    if (!pScreen->ModifyPixmapHeader(rootPixmap, -1, -1, -1, -1, -1, pixels))
+        FatalError("Couldn't adjust screen pixmap\n");
+}
+
 static Bool
 CreateScreenResources(ScreenPtr pScreen)
 {
@@ -592,8 +908,6 @@ CreateScreenResources(ScreenPtr pScreen)
     HWCPtr hwc = HWCPTR(pScrn);
     PixmapPtr rootPixmap;
     Bool ret;
-    void *pixels = NULL;
-    int err;
 
     pScreen->CreateScreenResources = hwc->CreateScreenResources;
     ret = pScreen->CreateScreenResources(pScreen);
@@ -614,39 +928,20 @@ CreateScreenResources(ScreenPtr pScreen)
     }
 #endif
 
-    err = hwc->renderer.eglHybrisCreateNativeBuffer(pScrn->virtualX, pScrn->virtualY,
-                                      HYBRIS_USAGE_HW_TEXTURE |
-                                      HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
-                                      HYBRIS_PIXEL_FORMAT_RGBA_8888,
-                                      &hwc->stride, &hwc->buffer);
-
-    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "alloc: status=%d, stride=%d\n", err, hwc->stride);
-
-    hwc_egl_renderer_screen_init(pScreen);
-
-#ifdef ENABLE_GLAMOR
-    if (hwc->glamor)
-        hwc->renderer.rootTexture = glamor_get_pixmap_texture(rootPixmap);
-#endif
-
-    err = hwc->renderer.eglHybrisLockNativeBuffer(hwc->buffer,
-                                    HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
-                                    0, 0, hwc->stride, pScrn->virtualY, &pixels);
-
-    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "gralloc lock returns %i\n", err);
-    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "lock to vaddr %p\n", pixels);
-
-    if (!hwc->glamor) {
-        if (!pScreen->ModifyPixmapHeader(rootPixmap, -1, -1, -1, -1, -1, pixels))
+    if (hwc->swCompositor) {
+        hwc_sw_renderer_screen_init(pScreen);
+        if (!pScreen->ModifyPixmapHeader(rootPixmap, -1, -1, -1, -1, -1, hwc->swRenderer.root))
             FatalError("Couldn't adjust screen pixmap\n");
     }
+    else
+        CreateRootBuffer(pScreen, rootPixmap);
 
     hwc->damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE,
                                 pScreen, rootPixmap);
 
     if (hwc->damage) {
         DamageRegister(&rootPixmap->drawable, hwc->damage);
-        hwc->dirty = FALSE;
+        __atomic_store_n(&hwc->dirty, FALSE, __ATOMIC_RELEASE);
         xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Damage tracking initialized\n");
     }
     else {
@@ -658,33 +953,201 @@ CreateScreenResources(ScreenPtr pScreen)
     return ret;
 }
 
-static CARD32 hwc_update_by_timer(OsTimerPtr timer, CARD32 time, void *ptr) {
-    ScreenPtr pScreen = (ScreenPtr) ptr;
+/* Composite the root window through the GL renderer */
+static void hwc_update_gl(ScreenPtr pScreen)
+{
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     HWCPtr hwc = HWCPTR(pScrn);
     PixmapPtr rootPixmap;
+    void *pixels = NULL;
     int err;
 
-    if (hwc->dirty && hwc->dpmsMode == DPMSModeOn) {
-        void *pixels = NULL;
-        rootPixmap = pScreen->GetScreenPixmap(pScreen);
-        hwc->renderer.eglHybrisUnlockNativeBuffer(hwc->buffer);
+    /* X rendering and the composite share the context, GL orders them */
+    if (hwc->glamor) {
+        hwc_egl_renderer_update(pScreen);
+        return;
+    }
+
+    /* The root is ordinary memory, nothing to unlock */
+    if (hwc->upload.enabled) {
+        hwc_upload_flush(pScrn);
+        hwc_egl_renderer_update(pScreen);
+        return;
+    }
+
+    rootPixmap = pScreen->GetScreenPixmap(pScreen);
+    hwc->renderer.eglHybrisUnlockNativeBuffer(hwc->buffer);
 
+    /* Scanned out as it is, or composited into the window surface */
+    if (!hwc_overlay_present(pScrn))
         hwc_egl_renderer_update(pScreen);
 
-        err = hwc->renderer.eglHybrisLockNativeBuffer(hwc->buffer,
-                        HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
-                        0, 0, hwc->stride, pScrn->virtualY, &pixels);
+    err = hwc->renderer.eglHybrisLockNativeBuffer(hwc->buffer,
+                    HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
+                    0, 0, hwc->stride, pScrn->virtualY, &pixels);
+
+    if (!pScreen->ModifyPixmapHeader(rootPixmap, -1, -1, -1, -1, -1, pixels))
+        FatalError("Couldn't adjust screen pixmap\n");
+}
 
-        if (!hwc->glamor) {
-            if (!pScreen->ModifyPixmapHeader(rootPixmap, -1, -1, -1, -1, -1, pixels))
-                FatalError("Couldn't adjust screen pixmap\n");
+/*
+ * Milliseconds until the compositor timer fires again, the first of:
+ *
+ *  - 0 while the panel is off, which stops the timer until DPMS or
+ *    hwc_update_now() starts it again,
+ *  - DOZE_TIMER_DELAY while the panel dozes,
+ *  - the frame scheduler's delay, see sched.c,
+ *  - a vsync period of the current config with AdaptiveRefresh,
+ *  - TIMER_DELAY for a panel otherwise,
+ *  - for the headless output, which has no vsync to pace it, a
+ *    simulated one: a fixed cadence derived from the refresh rate that
+ *    doesn't drift with the millisecond timer resolution.
+ */
+static CARD32 hwc_timer_delay(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    CARD64 period, now;
+
+    /* An off panel gets no frames, the timer stops until DPMS turns it on */
+    if (hwc->powerMode == HWC_POWER_MODE_OFF)
+        return 0;
+
+    /* A dozing one gets about one frame a second */
+    if (hwc->powerMode != HWC_POWER_MODE_NORMAL)
+        return DOZE_TIMER_DELAY;
+
+    if (hwc->sched.enabled)
+        return hwc_sched_delay(pScrn);
+
+    /* The refresh rate may change, see refresh.c */
+    if (hwc->refresh.enabled)
+        return max(hwc->vsyncPeriod / 1000000, 1);
+
+    if (!hwc->headless)
+        return TIMER_DELAY;
+
+    period = 1000000 / hwc->refreshRate;
+    now = GetTimeInMicros();
+
+    hwc->nextVblank += period;
+    if (hwc->nextVblank <= now)
+        hwc->nextVblank = now + period;
+
+    return (hwc->nextVblank - now + 999) / 1000;
+}
+
+static CARD32 hwc_update_by_timer(OsTimerPtr timer, CARD32 time, void *ptr) {
+    ScreenPtr pScreen = (ScreenPtr) ptr;
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    hwc->stats.wakeups++;
+    hwc_capture_poll(pScrn);
+
+    /* A panel still changing power modes can't take frames yet, look again soon */
+    if (!hwc_panel_ready(pScrn))
+        return TIMER_DELAY;
+
+    /* Only now, the worker may have been in the HAL until then */
+    if (hwc->powerMode != HWC_POWER_MODE_NORMAL)
+        hwc_sched_idle(pScrn);
+
+    /* The panel is off, HWC doesn't scan out the buffers anymore */
+    if (hwc->suspendPending) {
+        hwc->suspendPending = FALSE;
+        hwc_suspend(pScrn);
+        return 0;
+    }
+
+    /* Frames the swapchain held back while HWC was busy */
+    if (hwc->swapchain.depth && HWC_DISPLAY_ACTIVE(hwc))
+        hwc_swapchain_present(pScrn, FALSE);
+
+    /* HAL threads set dirty as well, take it before drawing so none gets lost */
+    if (HWC_DISPLAY_ACTIVE(hwc) && __atomic_exchange_n(&hwc->dirty, FALSE, __ATOMIC_ACQ_REL)) {
+        CARD64 start = GetTimeInMicros();
+        size_t bytes;
+
+        hwc_latency_frame_begin(pScrn);
+        hwc_sched_frame_begin(pScrn);
+        if (hwc->swCompositor)
+            bytes = hwc_sw_renderer_update(pScreen);
+        else {
+            hwc_update_gl(pScreen);
+            /* An overlay frame doesn't go through the GPU */
+            bytes = hwc->overlay.active ? 0 : (size_t) hwc->hwcWidth * hwc->hwcHeight * 4;
         }
 
-        hwc->dirty = FALSE;
+        /* Nothing scans out a pbuffer, treat the frame as shown once drawn */
+        if (hwc->headless)
+            hwc_latency_submit(pScrn, GetTimeInMicros(), -1);
+
+        hwc_stats_frame(pScrn, start, bytes);
+        hwc_refresh_frame(pScrn);
     }
+    else if (__atomic_load_n(&hwc->dirty, __ATOMIC_ACQUIRE)) {
+        hwc->stats.skippedFrames++;
+        hwc_latency_discard(pScrn);
+    }
+
+    hwc_refresh_update(pScrn);
+    return hwc_timer_delay(pScrn);
+}
+
+/* Draw the next frame right away instead of a timer period later */
+void hwc_update_now(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
 
-    return TIMER_DELAY;
+    hwc->timer = TimerSet(hwc->timer, 0, 1, hwc_update_by_timer, xf86ScrnToScreen(pScrn));
+}
+
+/*
+ * Stop compositing and free the buffers that are only needed to show
+ * something while the panel is off. The root window itself is kept.
+ */
+void hwc_suspend(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (hwc->suspended)
+        return;
+
+    TimerCancel(hwc->timer);
+
+    if (hwc->swCompositor)
+        hwc_sw_renderer_suspend(pScrn);
+    else {
+        hwc_cursor_cache_suspend(pScrn);
+        hwc_egl_renderer_suspend(pScrn);
+    }
+
+    hwc->suspended = TRUE;
+}
+
+void hwc_resume(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    CARD64 start;
+
+    if (!hwc->suspended)
+        return;
+
+    start = GetTimeInMicros();
+
+    if (hwc->swCompositor)
+        hwc_sw_renderer_resume(pScrn);
+    else {
+        hwc_egl_renderer_resume(pScrn);
+        hwc_cursor_cache_resume(pScrn);
+    }
+
+    hwc->suspended = FALSE;
+    HWC_SET_DIRTY(hwc);
+    hwc_update_now(pScrn);
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "resumed in %u us\n",
+               (unsigned int) (GetTimeInMicros() - start));
 }
 
 /* Mandatory */
@@ -763,6 +1226,12 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
     xf86SetBackingStore(pScreen);
     xf86SetSilkenMouse(pScreen);
 
+    /*
+     * Below the software cursor's GetImage wrap, which takes the cursor
+     * off the root before reading it, so the copy never has it.
+     */
+    hwc_shadow_screen_init(pScreen);
+
     /* Initialise cursor functions */
     miDCInitialize (pScreen, xf86GetPointerScreenFuncs());
 
@@ -774,8 +1243,11 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
         xf86_cursors_init(pScreen, hwc->cursorWidth, hwc->cursorHeight,
                           HARDWARE_CURSOR_UPDATE_UNHIDDEN |
                           HARDWARE_CURSOR_ARGB);
+        hwc_cursor_cache_init(pScrn);
     }
 
+    hwc_latency_init(pScrn, xf86ReturnOptValBool(hwc->Options, OPTION_LATENCY_TRACE, FALSE));
+
     /* Initialise default colourmap */
     if(!miCreateDefColormap(pScreen))
         return FALSE;
@@ -828,7 +1300,16 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
                     "Failed to initialize the Present extension.\n");
     }
 
-    TimerSet(hwc->timer, 0, TIMER_DELAY, hwc_update_by_timer, (void*) pScreen);
+    hwc_refresh_screen_init(pScrn);
+
+    hwc->nextVblank = GetTimeInMicros();
+    hwc->timer = TimerSet(hwc->timer, 0, hwc_timer_delay(pScrn), hwc_update_by_timer, (void*) pScreen);
+
+    if (serverGeneration > 1 && hwc->resetStart) {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "server regeneration took %u ms\n",
+                   (unsigned int) ((GetTimeInMicros() - hwc->resetStart) / 1000));
+        hwc->resetStart = 0;
+    }
 
     return TRUE;
 }
@@ -853,26 +1334,39 @@ CloseScreen(CLOSE_SCREEN_ARGS_DECL)
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     HWCPtr hwc = HWCPTR(pScrn);
 
+    hwc->resetStart = GetTimeInMicros();
+
+    /* The next generation expects a complete renderer */
+    hwc->suspendPending = FALSE;
+    hwc_resume(pScrn);
     TimerCancel(hwc->timer);
 
+    hwc_shadow_close_screen(pScreen);
+    hwc_power_close(pScrn);
+    hwc_latency_close(pScrn);
+    hwc_refresh_close_screen(pScrn);
+
     if (hwc->damage) {
         DamageUnregister(hwc->damage);
         DamageDestroy(hwc->damage);
         hwc->damage = NULL;
     }
 
-    hwc_egl_renderer_screen_close(pScreen);
+    if (hwc->swCompositor)
+        hwc_sw_renderer_screen_close(pScreen);
+    else
+        hwc_egl_renderer_screen_close(pScreen);
 
+    /* Kept for the next generation, see CreateRootBuffer */
     if (hwc->buffer != NULL)
-    {
         hwc->renderer.eglHybrisUnlockNativeBuffer(hwc->buffer);
-        hwc->renderer.eglHybrisReleaseNativeBuffer(hwc->buffer);
-        hwc->buffer = NULL;
-    }
 
     if (hwc->CursorInfo)
         xf86DestroyCursorInfoRec(hwc->CursorInfo);
 
+    if (!hwc->swCursor)
+        hwc_cursor_cache_close(pScrn);
+
     pScrn->vtSema = FALSE;
     pScreen->CloseScreen = hwc->CloseScreen;
     return (*pScreen->CloseScreen)(CLOSE_SCREEN_ARGS);
@@ -883,6 +1377,28 @@ static void
 FreeScreen(FREE_SCREEN_ARGS_DECL)
 {
     SCRN_INFO_PTR(arg);
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    /*
+     * HAL devices, EGL and the root buffer outlive CloseScreen so that
+     * server regeneration doesn't have to set them up again.
+     */
+    if (hwc) {
+        TimerFree(hwc->timer);
+        hwc->timer = NULL;
+        ReleaseRootBuffer(pScrn);
+        if (hwc->swCompositor)
+            hwc_sw_renderer_close(pScrn);
+        else
+            hwc_egl_renderer_close(pScrn);
+        hwc_panel_close(pScrn);
+        hwc_capture_close(pScrn);
+        hwc_sched_close(pScrn);
+        hwc_refresh_close(pScrn);
+        if (!hwc->headless)
+            hwc_hwcomposer_close(pScrn);
+    }
+
     FreeRec(pScrn);
 }
 
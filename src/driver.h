@@ -3,6 +3,7 @@
 #include "xf86_OSproc.h"
 
 #include "xf86Cursor.h"
+#include "xf86Crtc.h"
 
 #ifdef XvExtension
 #include "xf86xv.h"
@@ -20,13 +21,20 @@
 #include <hardware/hwcomposer.h>
 #include <hardware/lights.h>
 #include <hybris/eglplatformcommon/hybris_nativebufferext.h>
+#ifdef HAVE_HWC2
+#include <hybris/hwc2/hwc2_compatibility_layer.h>
+#endif
 
 #include "compat-api.h"
+#include "capture.h"
 
 /* function prototypes */
 
 extern Bool SwitchMode(SWITCH_MODE_ARGS_DECL);
 extern void AdjustFrame(ADJUST_FRAME_ARGS_DECL);
+void hwc_suspend(ScrnInfoPtr pScrn);
+void hwc_resume(ScrnInfoPtr pScrn);
+void hwc_update_now(ScrnInfoPtr pScrn);
 
 /* globals */
 typedef struct _color
@@ -39,25 +47,89 @@ typedef struct _color
 Bool hwc_display_pre_init(ScrnInfoPtr pScrn);
 Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn);
 void hwc_hwcomposer_close(ScrnInfoPtr pScrn);
+void hwc_hwcomposer_geometry_changed(ScrnInfoPtr pScrn);
 Bool hwc_lights_init(ScrnInfoPtr pScrn);
 
+struct ANativeWindowBuffer;
+
 struct ANativeWindow *hwc_get_native_window(ScrnInfoPtr pScrn);
-void hwc_toggle_screen_brightness(ScrnInfoPtr pScrn);
-void hwc_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode);
+void hwc_destroy_native_window(struct ANativeWindow *win);
+int hwc_hwcomposer_present(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+                           int acquireFence);
+Bool hwc_hwcomposer_idle(ScrnInfoPtr pScrn, Bool wait);
+Bool hwc_hwcomposer_present_overlay(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+                                    int *releaseFence);
+void hwc_hwcomposer_overlay_off(ScrnInfoPtr pScrn);
+Bool hwc_hwcomposer_init_vsync(ScrnInfoPtr pScrn);
+Bool hwc_hwcomposer_set_vsync(ScrnInfoPtr pScrn, Bool enable);
+Bool hwc_hwcomposer_set_config(ScrnInfoPtr pScrn, int config);
+#ifdef HAVE_HWC2
+Bool hwc_hwcomposer2_init(ScrnInfoPtr pScrn);
+void hwc_hwcomposer2_close(ScrnInfoPtr pScrn);
+int hwc_hwcomposer2_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode);
+Bool hwc_hwcomposer2_set_vsync(ScrnInfoPtr pScrn, Bool enable);
+int hwc_hwcomposer2_present(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+                            int acquireFence);
+#endif
+void hwc_set_screen_brightness(ScrnInfoPtr pScrn, int brightness);
+int hwc_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode);
 
 Bool hwc_init_hybris_native_buffer(ScrnInfoPtr pScrn);
 Bool hwc_egl_renderer_init(ScrnInfoPtr pScrn);
 void hwc_egl_renderer_close(ScrnInfoPtr pScrn);
 void hwc_egl_renderer_screen_init(ScreenPtr pScreen);
 void hwc_egl_renderer_screen_close(ScreenPtr pScreen);
+void hwc_egl_renderer_release_root(ScrnInfoPtr pScrn);
+int hwc_egl_renderer_fence(ScrnInfoPtr pScrn);
+Bool hwc_egl_renderer_wait_fence(ScrnInfoPtr pScrn, int fence);
 void hwc_egl_renderer_update(ScreenPtr pScreen);
+void hwc_egl_renderer_suspend(ScrnInfoPtr pScrn);
+void hwc_egl_renderer_resume(ScrnInfoPtr pScrn);
+void hwc_egl_renderer_set_gamma(ScrnInfoPtr pScrn, CARD16 *red, CARD16 *green,
+                                CARD16 *blue, int size);
 
 void hwc_ortho_2d(float* mat, float left, float right, float bottom, float top);
 GLuint hwc_link_program(const GLchar *vert_src, const GLchar *frag_src);
 
+/* Fixed vertex attribute locations shared by all programs */
+#define HWC_ATTRIB_POSITION 0
+#define HWC_ATTRIB_TEXCOORDS 1
+#define HWC_NUM_ATTRIBS 2
+
+#define HWC_GL_STATE_UNKNOWN ((GLuint) -1)
+
+typedef struct {
+    GLuint program;
+    GLuint texture;
+    GLuint arrayBuffer;
+    int blend;
+    int attribEnabled[HWC_NUM_ATTRIBS];
+    GLuint attribBuffer[HWC_NUM_ATTRIBS];
+    GLintptr attribOffset[HWC_NUM_ATTRIBS];
+
+    unsigned long issued;
+    unsigned long skipped;
+} hwc_gl_state_rec, *hwc_gl_state_ptr;
+
+void hwc_gl_state_invalidate(hwc_gl_state_ptr state);
+void hwc_gl_state_restore(hwc_gl_state_ptr state);
+void hwc_gl_use_program(hwc_gl_state_ptr state, GLuint program);
+void hwc_gl_bind_texture(hwc_gl_state_ptr state, GLuint texture);
+void hwc_gl_bind_array_buffer(hwc_gl_state_ptr state, GLuint buffer);
+void hwc_gl_set_blend(hwc_gl_state_ptr state, Bool enable);
+void hwc_gl_vertex_attrib(hwc_gl_state_ptr state, GLuint index,
+                          GLuint buffer, GLintptr offset);
+
 Bool hwc_present_screen_init(ScreenPtr pScreen);
 Bool hwc_cursor_init(ScreenPtr pScreen);
 
+void hwc_cursor_cache_init(ScrnInfoPtr pScrn);
+void hwc_cursor_cache_close(ScrnInfoPtr pScrn);
+void hwc_cursor_cache_suspend(ScrnInfoPtr pScrn);
+void hwc_cursor_cache_resume(ScrnInfoPtr pScrn);
+void hwc_cursor_cache_load(ScrnInfoPtr pScrn, CARD32 *image);
+void hwc_cursor_cache_texcoords(ScrnInfoPtr pScrn, const GLfloat *in, GLfloat *out);
+
 typedef enum {
     HWC_ROTATE_NORMAL,
     HWC_ROTATE_CW,
@@ -71,8 +143,11 @@ typedef struct {
     GLint texcoords;
     GLint transform;
     GLint texture;
+    GLint lut;
 } hwc_renderer_shader;
 
+#define HWC_GAMMA_SIZE 256
+
 typedef struct {
     PFNEGLHYBRISCREATENATIVEBUFFERPROC eglHybrisCreateNativeBuffer;
     PFNEGLHYBRISLOCKNATIVEBUFFERPROC eglHybrisLockNativeBuffer;
@@ -83,18 +158,476 @@ typedef struct {
     PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
 
     EGLDisplay display;
+    EGLConfig config;
     EGLSurface surface;
+    EGLSurface idleSurface;
     EGLContext context;
+    struct ANativeWindow *window;
+    Bool surfaceless;
+    Bool nativeFenceSync; /* EGL_ANDROID_native_fence_sync */
+    Bool waitSync;        /* EGL_KHR_wait_sync */
     GLuint rootTexture;
     GLuint cursorTexture;
+    GLuint vertexBuffer;
+    GLuint cursorBuffer;
+    GLfloat cursorVertices[16];
+
+    hwc_gl_state_rec state;
 
     float projection[16];
     EGLImageKHR image;
 
     hwc_renderer_shader rootShader;
     hwc_renderer_shader projShader;
+    hwc_renderer_shader rootLutShader;
+    hwc_renderer_shader projLutShader;
+
+    GLuint gammaTexture;
+    GLubyte gammaLut[HWC_GAMMA_SIZE * 4];
+    Bool gammaEnabled;
+    Bool gammaDirty;
 } hwc_renderer_rec, *hwc_renderer_ptr;
 
+/* Cursor images are cached in a COLS x ROWS atlas of cursor sized slots */
+#define HWC_CURSOR_CACHE_COLS 4
+#define HWC_CURSOR_CACHE_ROWS 4
+#define HWC_CURSOR_CACHE_SLOTS (HWC_CURSOR_CACHE_COLS * HWC_CURSOR_CACHE_ROWS)
+
+typedef struct {
+    uint64_t hash;
+    CARD32 *image;
+    uint32_t lastUsed;
+    Bool valid;
+} hwc_cursor_slot;
+
+typedef struct {
+    hwc_cursor_slot slots[HWC_CURSOR_CACHE_SLOTS];
+    int current;
+    uint32_t clock;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} hwc_cursor_cache_rec, *hwc_cursor_cache_ptr;
+
+/* Driver owned framebuffer targets, see swapchain.c */
+#define HWC_SWAPCHAIN_MAX 4
+
+typedef enum {
+    HWC_SWAPCHAIN_FIFO,
+    HWC_SWAPCHAIN_MAILBOX
+} hwc_swapchain_mode;
+
+typedef enum {
+    HWC_BUFFER_FREE,
+    HWC_BUFFER_RENDERING,
+    HWC_BUFFER_QUEUED,
+    HWC_BUFFER_DISPLAYED
+} hwc_buffer_state;
+
+typedef struct {
+    EGLClientBuffer buffer;
+    EGLImageKHR image;
+    GLuint texture;
+    GLuint fbo;
+    EGLSyncKHR sync;  /* rendering done */
+    int acquireFence; /* rendering done, as a native fence */
+    int releaseFence; /* HWC done reading */
+    hwc_buffer_state state;
+    uint32_t sequence;
+} hwc_swapchain_buffer_rec, *hwc_swapchain_buffer_ptr;
+
+typedef struct {
+    int depth; /* 0 when frames go through the libhybris native window */
+    hwc_swapchain_mode mode;
+    Bool fenceSync;
+    hwc_swapchain_buffer_rec buffers[HWC_SWAPCHAIN_MAX];
+    hwc_swapchain_buffer_ptr current;
+    uint32_t sequence;
+    unsigned long presented;
+    unsigned long dropped;
+    unsigned long stalls;
+    unsigned long cpuWaits;
+    uint64_t occupancySum;
+    unsigned long occupancySamples;
+} hwc_swapchain_rec, *hwc_swapchain_ptr;
+
+Bool hwc_swapchain_alloc(ScrnInfoPtr pScrn);
+void hwc_swapchain_release(ScrnInfoPtr pScrn);
+void hwc_swapchain_close(ScrnInfoPtr pScrn);
+void hwc_swapchain_begin_frame(ScrnInfoPtr pScrn);
+void hwc_swapchain_end_frame(ScrnInfoPtr pScrn);
+void hwc_swapchain_present(ScrnInfoPtr pScrn, Bool wait);
+int hwc_swapchain_queued(ScrnInfoPtr pScrn);
+unsigned long hwc_swapchain_occupancy(ScrnInfoPtr pScrn);
+
+/* Software compositor, see swrender.c */
+#define HWC_SW_MAX_BUFFERS 4
+
+typedef struct {
+    struct ANativeWindowBuffer *buffer;
+    RegionRec pending;
+    unsigned long used; /* dequeue it was last seen at */
+} hwc_sw_buffer_rec, *hwc_sw_buffer_ptr;
+
+typedef struct {
+    struct ANativeWindow *window;
+    uint32_t *root;
+    size_t rootSize; /* in pixels, kept across server generations */
+    hwc_sw_buffer_rec buffers[HWC_SW_MAX_BUFFERS];
+    unsigned long dequeues;
+} hwc_sw_renderer_rec, *hwc_sw_renderer_ptr;
+
+Bool hwc_sw_renderer_init(ScrnInfoPtr pScrn);
+void hwc_sw_renderer_close(ScrnInfoPtr pScrn);
+void hwc_sw_renderer_screen_init(ScreenPtr pScreen);
+void hwc_sw_renderer_screen_close(ScreenPtr pScreen);
+void hwc_sw_renderer_damage(ScrnInfoPtr pScrn, RegionPtr region);
+size_t hwc_sw_renderer_update(ScreenPtr pScreen);
+void hwc_sw_renderer_suspend(ScrnInfoPtr pScrn);
+void hwc_sw_renderer_resume(ScrnInfoPtr pScrn);
+
+void hwc_sw_blit(hwc_rotation rotation, const uint32_t *src, int srcStride,
+                 uint32_t *dst, int dstStride, int dstWidth, int dstHeight,
+                 const BoxRec *box);
+void hwc_sw_blend_cursor(hwc_rotation rotation, const CARD32 *image,
+                         int width, int height, int x, int y,
+                         int rootWidth, int rootHeight,
+                         uint32_t *dst, int dstStride, int dstWidth, int dstHeight);
+
+/* Performance telemetry, see telemetry.c */
+#define HWC_STATS_SAMPLES 128
+#define HWC_STATS_MAX_LAYERS 8
+#define HWC_STATS_POWER_MODES 4
+
+typedef struct {
+    CARD32 frameTimes[HWC_STATS_SAMPLES];
+    int frameTimeIndex;
+    int frameTimeCount;
+
+    unsigned long frames;
+    unsigned long fullFrames;
+    unsigned long partialFrames;
+    unsigned long skippedFrames;
+    uint64_t bytesComposited;
+
+    CARD32 lastFenceWait;
+    uint64_t fenceWaitTotal;
+
+    int32_t compositionTypes[HWC_STATS_MAX_LAYERS];
+    size_t numLayers;
+
+    /* compositor timer wakeups and time spent in each HWC_POWER_MODE_* */
+    unsigned long wakeups;
+    uint64_t powerModeTime[HWC_STATS_POWER_MODES];
+    CARD64 powerModeSince;
+    int powerMode;
+
+    CARD32 lastRefresh;
+    unsigned long lastRefreshFrames;
+    unsigned long lastRefreshWakeups;
+} hwc_stats_rec, *hwc_stats_ptr;
+
+void hwc_stats_frame(ScrnInfoPtr pScrn, CARD64 start, size_t bytes);
+void hwc_stats_fence_wait(ScrnInfoPtr pScrn, CARD64 start);
+void hwc_stats_layers(ScrnInfoPtr pScrn, hwc_display_contents_1_t *list);
+void hwc_stats_power_mode(ScrnInfoPtr pScrn, int mode);
+void hwc_stats_percentiles(const CARD32 *samples, int n, INT32 *out);
+void hwc_stats_create_resources(xf86OutputPtr output);
+Bool hwc_stats_get_property(xf86OutputPtr output, Atom property);
+
+/* Written by the input thread, read by the compositor, see cursor.c */
+typedef struct {
+    uint32_t seq; /* odd while an update is in progress */
+    int x;
+    int y;
+    CARD64 time;
+
+    uint32_t sampledSeq;
+    CARD32 samples[HWC_STATS_SAMPLES]; /* position age when drawn, in microseconds */
+    int index;
+    int count;
+} hwc_cursor_pos_rec, *hwc_cursor_pos_ptr;
+
+void hwc_cursor_publish(ScrnInfoPtr pScrn, int x, int y);
+void hwc_cursor_sample(ScrnInfoPtr pScrn, int *x, int *y);
+
+/* CPU copy of the root window used to answer GetImage */
+typedef struct {
+    CARD32 *pixels;
+    int stride;
+    Bool valid;
+    Bool readBGRA;
+    DamagePtr damage;
+    GLuint fbo;
+    CARD32 *scratch;
+    size_t scratchSize;
+    unsigned long captures;
+    unsigned long bytesRead;
+} hwc_shadow_rec, *hwc_shadow_ptr;
+
+void hwc_shadow_screen_init(ScreenPtr pScreen);
+void hwc_shadow_close_screen(ScreenPtr pScreen);
+
+/* Power HAL hints, see power.c */
+#define HWC_POWER_INTERACTION_MS 200   /* boost requested per interaction hint */
+#define HWC_POWER_IDLE_MS 100          /* damage after this much idle time is a new burst */
+#define HWC_POWER_LAUNCH_IDLE_MS 3000  /* ... and after this much it's treated as a launch */
+#define HWC_POWER_LAUNCH_MS 1000       /* duration of a launch boost */
+
+typedef struct {
+    struct power_module *module;
+    CARD32 lastDamage;
+    CARD32 lastInteraction;
+    Bool launchActive;
+    Bool cursorMoved;   /* set by the input thread, see hwc_power_cursor */
+    OsTimerPtr launchTimer;
+    unsigned long interactionHints;
+    unsigned long suppressedHints;
+    unsigned long launchHints;
+} hwc_power_rec, *hwc_power_ptr;
+
+Bool hwc_power_init(ScrnInfoPtr pScrn);
+void hwc_power_close(ScrnInfoPtr pScrn);
+void hwc_power_interaction(ScrnInfoPtr pScrn);
+void hwc_power_cursor(ScrnInfoPtr pScrn);
+void hwc_power_flush(ScrnInfoPtr pScrn);
+void hwc_power_damage(ScrnInfoPtr pScrn);
+void hwc_power_set_interactive(ScrnInfoPtr pScrn, Bool on);
+
+enum {
+    HWC_LATENCY_INPUT,  /* first input event to scanout */
+    HWC_LATENCY_DAMAGE, /* first damage to scanout */
+    HWC_LATENCY_SUBMIT, /* handed to HWC to scanout */
+    HWC_LATENCY_KINDS
+};
+
+typedef struct {
+    Bool enabled;
+    CARD64 pendingInput;
+    CARD64 pendingDamage;
+    CARD64 frameInput;
+    CARD64 frameDamage;
+    CARD64 inflightInput;
+    CARD64 inflightDamage;
+    CARD64 inflightSubmit;
+    int inflightFence;
+    CARD32 samples[HWC_LATENCY_KINDS][HWC_STATS_SAMPLES];
+    int index[HWC_LATENCY_KINDS];
+    int count[HWC_LATENCY_KINDS];
+    unsigned long frames;
+    unsigned long unresolved;
+} hwc_latency_rec, *hwc_latency_ptr;
+
+void hwc_latency_init(ScrnInfoPtr pScrn, Bool enable);
+void hwc_latency_close(ScrnInfoPtr pScrn);
+void hwc_latency_damage(ScrnInfoPtr pScrn);
+void hwc_latency_frame_begin(ScrnInfoPtr pScrn);
+void hwc_latency_discard(ScrnInfoPtr pScrn);
+void hwc_latency_submit(ScrnInfoPtr pScrn, CARD64 submit, int fence);
+CARD64 hwc_latency_fence_time(int fence);
+
+/* Frames start at the next vsync minus their predicted cost, see sched.c */
+typedef struct {
+    Bool enabled;
+    CARD64 period;      /* of vsync, in microseconds */
+    int64_t vsync;      /* last vsync in nanoseconds, written by the HAL's thread */
+    Bool vsyncOn;       /* vsync events were asked for */
+    CARD64 lastFrame;   /* start of the last frame, to stop vsync events when idle */
+    CARD64 cost;        /* moving average from frame start to ready, in microseconds */
+    CARD64 deviation;   /* moving mean deviation of the cost */
+    CARD64 lastCost;
+    CARD64 lead;        /* how long before the vsync frames start */
+    CARD64 target;      /* vsync the next scheduled frame aims at */
+    CARD64 start;       /* of the frame being drawn, 0 once it went to HWC */
+    Bool inflight;      /* a frame went to HWC and isn't accounted yet */
+    CARD64 inflightStart;
+    CARD64 inflightTarget;
+    CARD64 submit;
+    int gpuFence;
+    int retireFence;
+    unsigned long onTime;
+    unsigned long missed;
+    unsigned long missedMore; /* by more than a frame */
+    unsigned long unresolved;
+} hwc_sched_rec, *hwc_sched_ptr;
+
+void hwc_sched_init(ScrnInfoPtr pScrn, Bool enable);
+void hwc_sched_close(ScrnInfoPtr pScrn);
+void hwc_sched_vsync(ScrnInfoPtr pScrn, int64_t timestamp);
+void hwc_sched_idle(ScrnInfoPtr pScrn);
+void hwc_sched_frame_begin(ScrnInfoPtr pScrn);
+void hwc_sched_submit(ScrnInfoPtr pScrn, int acquireFence);
+void hwc_sched_retire(ScrnInfoPtr pScrn, int retireFence);
+CARD32 hwc_sched_delay(ScrnInfoPtr pScrn);
+void hwc_sched_set_period(ScrnInfoPtr pScrn);
+
+/* A display config HWC offers at the screen's size */
+#define HWC_MAX_CONFIGS 16
+
+typedef struct {
+    int index;           /* in HWC's list of configs */
+    int64_t vsyncPeriod; /* in nanoseconds */
+} hwc_display_config_rec;
+
+/* Refresh rate following the content, see refresh.c */
+#define HWC_REFRESH_FRAMES 64
+
+typedef struct {
+    Bool enabled;
+    CARD64 frames[HWC_REFRESH_FRAMES]; /* times of the latest composited frames */
+    int numFrames;
+    int nextFrame;
+    Bool input;           /* set by input events since the last check */
+    Bool listening;       /* on DeviceEventCallback for this server generation */
+    CARD64 lastCheck;
+    CARD64 lowerSince;    /* since when a lower rate would do, 0 if not */
+    int lowerConfig;      /* highest config wanted during that time */
+    int probed;           /* config whose rate frames on every vsync turned out to be */
+    CARD64 probedAt;
+    CARD64 configTime[HWC_MAX_CONFIGS]; /* microseconds spent per config */
+    unsigned long switches;
+} hwc_refresh_rec, *hwc_refresh_ptr;
+
+void hwc_refresh_init(ScrnInfoPtr pScrn, Bool enable);
+void hwc_refresh_close(ScrnInfoPtr pScrn);
+void hwc_refresh_screen_init(ScrnInfoPtr pScrn);
+void hwc_refresh_close_screen(ScrnInfoPtr pScrn);
+void hwc_refresh_frame(ScrnInfoPtr pScrn);
+void hwc_refresh_update(ScrnInfoPtr pScrn);
+
+/* Power and backlight transitions on a worker thread, see panel.c */
+typedef struct {
+    Bool threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Bool pending; /* a request the worker hasn't picked up yet */
+    Bool busy;    /* the worker is in the HAL */
+    Bool quit;
+    int mode;     /* requested HWC_POWER_MODE_* */
+    int brightness;
+    int appliedMode;
+    int appliedBrightness;
+    int target;   /* last mode requested, only used by the main thread */
+
+    unsigned long transitions;
+    unsigned long coalesced;
+    CARD32 lastTransitionMs;
+    CARD32 maxTransitionMs;
+} hwc_panel_rec, *hwc_panel_ptr;
+
+void hwc_panel_init(ScrnInfoPtr pScrn);
+void hwc_panel_close(ScrnInfoPtr pScrn);
+void hwc_panel_request(ScrnInfoPtr pScrn, int mode, int brightness);
+Bool hwc_panel_ready(ScrnInfoPtr pScrn);
+
+/* Root window in malloc'd memory streamed into rootTexture, see upload.c */
+typedef struct {
+    Bool enabled;
+    Bool usePbo;    /* GLES 3 pixel buffer objects */
+    Bool rowLength; /* GL_UNPACK_ROW_LENGTH, GLES 3 or GL_EXT_unpack_subimage */
+    uint32_t *root;
+    size_t rootSize;
+    int width;
+    int height;
+    RegionRec pending;
+    GLuint pbo[2];
+    int pboIndex;
+    unsigned long frames;
+    uint64_t bytes;
+} hwc_upload_rec, *hwc_upload_ptr;
+
+void hwc_upload_init(ScrnInfoPtr pScrn);
+void hwc_upload_close(ScrnInfoPtr pScrn);
+void *hwc_upload_create_root(ScreenPtr pScreen);
+void hwc_upload_damage(ScrnInfoPtr pScrn, RegionPtr region);
+void hwc_upload_flush(ScrnInfoPtr pScrn);
+
+/* The root native buffer scanned out as an HWC overlay layer, see overlay.c */
+typedef struct {
+    Bool enabled;     /* "RootOverlay" */
+    Bool active;      /* the last frame went out as an overlay */
+    Bool rejected;    /* prepare() wanted it composited, until the setup changes */
+    int releaseFence; /* of the last overlay frame */
+    unsigned long frames;
+    unsigned long rejections;
+} hwc_overlay_rec, *hwc_overlay_ptr;
+
+void hwc_overlay_init(ScrnInfoPtr pScrn, Bool enable);
+void hwc_overlay_release(ScrnInfoPtr pScrn);
+Bool hwc_overlay_present(ScrnInfoPtr pScrn);
+
+/* Screen capture through the HWC virtual display, see capture.c */
+typedef struct {
+    Bool enabled;
+    char *socketPath;
+    int listenFd;
+    int width;
+    int height;
+    int stride;
+    CARD32 interval;  /* minimum time between frames, in milliseconds */
+    CARD32 lastFrame;
+    hwc_display_contents_1_t *list;
+    buffer_handle_t buffers[HWC_CAPTURE_SLOTS];
+    int shmFd;
+    hwc_capture_header *shm;
+    int current;      /* slot HWC composes into, -1 if none */
+    int retireFence;  /* signals once it is done */
+    CARD64 composed;
+    RegionRec damage; /* of the root since the last published frame */
+    int refusals;
+    unsigned long frames;
+    unsigned long dropped;
+    unsigned long clients;
+} hwc_capture_rec, *hwc_capture_ptr;
+
+void hwc_capture_init(ScrnInfoPtr pScrn, const char *path, int width, int height, int rate);
+void hwc_capture_close(ScrnInfoPtr pScrn);
+void hwc_capture_damage(ScrnInfoPtr pScrn, RegionPtr region);
+void hwc_capture_poll(ScrnInfoPtr pScrn);
+void hwc_capture_attach(ScrnInfoPtr pScrn, buffer_handle_t source, int acquireFence);
+void hwc_capture_submitted(ScrnInfoPtr pScrn);
+
+/* "AccelMethod" "auto", see accel.c */
+Bool hwc_accel_prefer_glamor(ScrnInfoPtr pScrn);
+
+/* GL debug output, aggregated by message id, see gldebug.c */
+#define HWC_GL_DEBUG_MAX_IDS 32
+
+typedef enum {
+    HWC_GL_DEBUG_OFF,
+    HWC_GL_DEBUG_ERRORS,
+    HWC_GL_DEBUG_FULL
+} hwc_gl_debug_level;
+
+typedef struct {
+    GLuint id;
+    GLenum type;
+    GLenum severity;
+    unsigned long count;
+    unsigned long logged;
+    CARD32 lastLog;
+} hwc_gl_debug_entry, *hwc_gl_debug_entry_ptr;
+
+typedef struct {
+    hwc_gl_debug_level level;
+    Bool supported;
+    hwc_gl_debug_entry entries[HWC_GL_DEBUG_MAX_IDS];
+    int numEntries;
+    unsigned long total;
+    unsigned long overflow;
+} hwc_gl_debug_rec, *hwc_gl_debug_ptr;
+
+void hwc_gl_debug_init(ScrnInfoPtr pScrn);
+void hwc_gl_debug_set_level(ScrnInfoPtr pScrn, hwc_gl_debug_level level);
+void hwc_gl_debug_report(ScrnInfoPtr pScrn);
+void hwc_gl_debug_create_resources(xf86OutputPtr output);
+Bool hwc_gl_debug_set_property(xf86OutputPtr output, Atom property, RRPropertyValuePtr value);
+
+#define HWC_DEFAULT_REFRESH 60
+#define HWC_HEADLESS_WIDTH 1280
+#define HWC_HEADLESS_HEIGHT 720
+
 typedef struct HWCRec
 {
     /* options */
@@ -105,6 +638,7 @@ typedef struct HWCRec
     CreateScreenResourcesProcPtr	CreateScreenResources;
     xf86CursorInfoPtr CursorInfo;
     ScreenBlockHandlerProcPtr BlockHandler;
+    GetImageProcPtr GetImage;
     OsTimerPtr timer;
 
     dummy_colors colors[1024];
@@ -115,6 +649,7 @@ typedef struct HWCRec
     Bool dirty;
     Bool glamor;
     Bool drihybris;
+    Bool swCompositor;
     hwc_rotation rotation;
 
     gralloc_module_t *gralloc;
@@ -125,27 +660,75 @@ typedef struct HWCRec
     hwc_display_contents_1_t **hwcContents;
     hwc_layer_1_t *fblayer;
     uint32_t hwcVersion;
+    Bool headless;
+    int refreshRate;
+    int64_t vsyncPeriod; /* reported by HWC, in nanoseconds */
+    hwc_display_config_rec configs[HWC_MAX_CONFIGS];
+    int numConfigs;
+    int activeConfig;   /* in configs */
+    CARD64 nextVblank;
+    int hwcApi; /* 0 for auto, 1 or 2 */
+    Bool hwc2;
+#ifdef HAVE_HWC2
+    hwc2_compat_device_t *hwc2Device;
+    hwc2_compat_display_t *hwc2Display;
+    hwc2_compat_layer_t *hwc2Layer;
+    int hwc2PresentFence;
+#endif
+    uint32_t geometryGeneration;
+    uint32_t preparedGeometry;
     int hwcWidth;
     int hwcHeight;
 
     hwc_renderer_rec renderer;
+    hwc_sw_renderer_rec swRenderer;
     EGLClientBuffer buffer;
     int stride;
+    int bufferWidth;
+    int bufferHeight;
+    Bool bufferBGRA; /* gralloc format of buffer, else RGBA holding X's BGRA */
+    CARD64 resetStart;
 
     Bool cursorShown;
     xf86CursorInfoPtr cursorInfo;
-    int cursorX;
-    int cursorY;
+    hwc_cursor_pos_rec cursorPos;
     int cursorWidth;
     int cursorHeight;
+    hwc_cursor_cache_rec cursorCache;
 
     struct light_device_t *lightsDevice;
+    hwc_power_rec power;
     int screenBrightness;
 
     DisplayModePtr modes;
     int dpmsMode;
+    int powerMode; /* HWC_POWER_MODE_* */
+    Bool dpmsSuspend;
+    Bool doze;
+    Bool backlightOnly; /* DPMS off leaves HWC on */
+    hwc_panel_rec panel;
+    Bool suspended;
+    Bool suspendPending; /* suspend once the panel is off */
+
+    hwc_stats_rec stats;
+    hwc_shadow_rec shadow;
+    hwc_latency_rec latency;
+    hwc_swapchain_rec swapchain;
+    hwc_gl_debug_rec glDebug;
+    hwc_upload_rec upload;
+    hwc_overlay_rec overlay;
+    hwc_capture_rec capture;
+    hwc_sched_rec sched;
+    hwc_refresh_rec refresh;
 } HWCRec, *HWCPtr;
 
 /* The privates of the hwcomposer driver */
 #define HWCPTR(p)	((HWCPtr)((p)->driverPrivate))
 
+/* Whether composited frames still reach the panel, also true while dozing */
+#define HWC_DISPLAY_ACTIVE(hwc) ((hwc)->powerMode == HWC_POWER_MODE_NORMAL || \
+                                 (hwc)->powerMode == HWC_POWER_MODE_DOZE)
+
+/* HAL and input threads set dirty too, the compositor timer takes it atomically */
+#define HWC_SET_DIRTY(hwc) __atomic_store_n(&(hwc)->dirty, TRUE, __ATOMIC_RELEASE)
+
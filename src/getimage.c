@@ -0,0 +1,237 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <stdlib.h>
+#include "windowstr.h"
+#include "pixmapstr.h"
+
+#include "driver.h"
+
+/*
+ * Root window capture.
+ *
+ * Screenshot and remote assistance tools poll GetImage on the root
+ * window. Served directly, that is a glReadPixels stalling the GPU in
+ * glamor mode and reads from uncached gralloc memory in fb mode.
+ * Instead a copy of the root is kept in ordinary memory. It is created
+ * on the first capture and brought up to date from its own damage
+ * record, so repeated captures only read back what changed.
+ */
+
+static Bool hwc_shadow_is_root(DrawablePtr pDrawable)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+
+    if (pDrawable->type == DRAWABLE_WINDOW)
+        return pDrawable == &pScreen->root->drawable;
+    return pDrawable == &pScreen->GetScreenPixmap(pScreen)->drawable;
+}
+
+static Bool hwc_shadow_create(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_shadow_ptr shadow = &hwc->shadow;
+    PixmapPtr rootPixmap = pScreen->GetScreenPixmap(pScreen);
+
+    shadow->stride = pScreen->width;
+    shadow->pixels = malloc((size_t) shadow->stride * pScreen->height * sizeof(CARD32));
+    if (!shadow->pixels)
+        return FALSE;
+
+    shadow->damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE, pScreen, NULL);
+    if (!shadow->damage) {
+        free(shadow->pixels);
+        shadow->pixels = NULL;
+        return FALSE;
+    }
+    DamageRegister(&rootPixmap->drawable, shadow->damage);
+    shadow->valid = FALSE;
+
+    return TRUE;
+}
+
+/* Copy boxes of the CPU mapped root native buffer */
+static void hwc_shadow_read_fb(ScreenPtr pScreen, BoxPtr boxes, int n)
+{
+    HWCPtr hwc = HWCPTR(xf86ScreenToScrn(pScreen));
+    hwc_shadow_ptr shadow = &hwc->shadow;
+    PixmapPtr rootPixmap = pScreen->GetScreenPixmap(pScreen);
+    const char *src = rootPixmap->devPrivate.ptr;
+    int i, y;
+
+    for (i = 0; i < n; i++) {
+        size_t width = (boxes[i].x2 - boxes[i].x1) * sizeof(CARD32);
+
+        for (y = boxes[i].y1; y < boxes[i].y2; y++)
+            memcpy(shadow->pixels + y * shadow->stride + boxes[i].x1,
+                   src + y * rootPixmap->devKind + boxes[i].x1 * sizeof(CARD32),
+                   width);
+    }
+}
+
+/* Read boxes of the glamor root texture back through an FBO */
+static void hwc_shadow_read_gl(ScreenPtr pScreen, BoxPtr boxes, int n)
+{
+    HWCPtr hwc = HWCPTR(xf86ScreenToScrn(pScreen));
+    hwc_shadow_ptr shadow = &hwc->shadow;
+    GLenum format = shadow->readBGRA ? GL_BGRA_EXT : GL_RGBA;
+    int i, x, y;
+
+    if (!shadow->fbo) {
+        glGenFramebuffers(1, &shadow->fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, shadow->fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                               hwc->renderer.rootTexture, 0);
+    }
+    else
+        glBindFramebuffer(GL_FRAMEBUFFER, shadow->fbo);
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+    for (i = 0; i < n; i++) {
+        int w = boxes[i].x2 - boxes[i].x1;
+        int h = boxes[i].y2 - boxes[i].y1;
+        size_t size = (size_t) w * h;
+
+        if (size > shadow->scratchSize) {
+            free(shadow->scratch);
+            shadow->scratch = xnfalloc(size * sizeof(CARD32));
+            shadow->scratchSize = size;
+        }
+
+        glReadPixels(boxes[i].x1, boxes[i].y1, w, h, format, GL_UNSIGNED_BYTE, shadow->scratch);
+
+        for (y = 0; y < h; y++) {
+            CARD32 *src = shadow->scratch + y * w;
+            CARD32 *dst = shadow->pixels + (boxes[i].y1 + y) * shadow->stride + boxes[i].x1;
+
+            if (shadow->readBGRA)
+                memcpy(dst, src, w * sizeof(CARD32));
+            else {
+                /* RGBA in memory to x8r8g8b8 */
+                for (x = 0; x < w; x++)
+                    dst[x] = (src[x] & 0xff00ff00) |
+                             ((src[x] & 0xff) << 16) | ((src[x] >> 16) & 0xff);
+            }
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/* Bring the copy up to date with everything drawn since the last capture */
+static void hwc_shadow_update(ScreenPtr pScreen)
+{
+    HWCPtr hwc = HWCPTR(xf86ScreenToScrn(pScreen));
+    hwc_shadow_ptr shadow = &hwc->shadow;
+    BoxRec box = { 0, 0, pScreen->width, pScreen->height };
+    RegionRec full;
+    RegionPtr region;
+    int i, n;
+
+    if (shadow->valid)
+        region = DamageRegion(shadow->damage);
+    else {
+        RegionInit(&full, &box, 1);
+        region = &full;
+    }
+
+    n = RegionNumRects(region);
+    if (n) {
+        BoxPtr boxes = RegionRects(region);
+
+        if (hwc->glamor)
+            hwc_shadow_read_gl(pScreen, boxes, n);
+        else
+            hwc_shadow_read_fb(pScreen, boxes, n);
+
+        for (i = 0; i < n; i++)
+            shadow->bytesRead += (boxes[i].x2 - boxes[i].x1) *
+                                 (boxes[i].y2 - boxes[i].y1) * sizeof(CARD32);
+    }
+
+    if (!shadow->valid) {
+        RegionUninit(&full);
+        shadow->valid = TRUE;
+    }
+    DamageEmpty(shadow->damage);
+}
+
+static void
+hwc_get_image(DrawablePtr pDrawable, int sx, int sy, int w, int h,
+              unsigned int format, unsigned long planeMask, char *d)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    HWCPtr hwc = HWCPTR(xf86ScreenToScrn(pScreen));
+    hwc_shadow_ptr shadow = &hwc->shadow;
+    unsigned long fullMask = pDrawable->depth >= 32 ? ~0UL : (1UL << pDrawable->depth) - 1;
+    int stride, y;
+
+    if (format != ZPixmap || pDrawable->bitsPerPixel != 32 ||
+        (planeMask & fullMask) != fullMask || !hwc_shadow_is_root(pDrawable) ||
+        (!shadow->pixels && !hwc_shadow_create(pScreen))) {
+        pScreen->GetImage = hwc->GetImage;
+        pScreen->GetImage(pDrawable, sx, sy, w, h, format, planeMask, d);
+        pScreen->GetImage = hwc_get_image;
+        return;
+    }
+
+    hwc_shadow_update(pScreen);
+    shadow->captures++;
+
+    sx += pDrawable->x;
+    sy += pDrawable->y;
+    stride = PixmapBytePad(w, pDrawable->depth);
+    for (y = 0; y < h; y++)
+        memcpy(d + y * stride, shadow->pixels + (sy + y) * shadow->stride + sx,
+               w * sizeof(CARD32));
+}
+
+void hwc_shadow_screen_init(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_shadow_ptr shadow = &hwc->shadow;
+
+    memset(shadow, 0, sizeof(*shadow));
+
+    /* The CPU compositor's root already lives in cached memory */
+    if (hwc->swCompositor)
+        return;
+
+    if (hwc->glamor)
+        shadow->readBGRA = epoxy_has_gl_extension("GL_EXT_read_format_bgra");
+
+    hwc->GetImage = pScreen->GetImage;
+    pScreen->GetImage = hwc_get_image;
+}
+
+void hwc_shadow_close_screen(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_shadow_ptr shadow = &hwc->shadow;
+
+    /* The software cursor's wrap above restores ours when it closes */
+    if (pScreen->GetImage == hwc_get_image)
+        pScreen->GetImage = hwc->GetImage;
+
+    if (shadow->captures)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "root capture: %lu captures, %lu KB read back\n",
+                   shadow->captures, shadow->bytesRead >> 10);
+
+    if (shadow->damage) {
+        DamageUnregister(shadow->damage);
+        DamageDestroy(shadow->damage);
+    }
+    if (shadow->fbo)
+        glDeleteFramebuffers(1, &shadow->fbo);
+    free(shadow->scratch);
+    free(shadow->pixels);
+    memset(shadow, 0, sizeof(*shadow));
+}
@@ -0,0 +1,214 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+#include "xf86Crtc.h"
+
+#include <X11/Xatom.h>
+#include "randrstr.h"
+
+#include "driver.h"
+
+/*
+ * GL debug output ("GLDebug" option and HWC_GL_DEBUG output property).
+ *
+ * Debug output makes some drivers leave their fast paths, so it is off
+ * unless asked for, with no callback installed at all. When on, every
+ * message id is logged the first time it is seen and then only counted,
+ * with a repeat count logged at most every HWC_GL_DEBUG_LOG_INTERVAL.
+ */
+
+#define HWC_GL_DEBUG_LOG_INTERVAL 10000 /* in milliseconds */
+
+static const char *hwc_gl_debug_level_names[] = { "off", "errors", "full" };
+
+static Atom hwc_gl_debug_atom;
+
+static const char *hwc_gl_debug_severity(GLenum severity)
+{
+    switch (severity) {
+    case GL_DEBUG_SEVERITY_HIGH:
+        return "high";
+    case GL_DEBUG_SEVERITY_MEDIUM:
+        return "medium";
+    case GL_DEBUG_SEVERITY_LOW:
+        return "low";
+    default:
+        return "notification";
+    }
+}
+
+static hwc_gl_debug_entry_ptr
+hwc_gl_debug_lookup(hwc_gl_debug_ptr debug, GLuint id, GLenum type, GLenum severity)
+{
+    hwc_gl_debug_entry_ptr entry;
+    int i;
+
+    for (i = 0; i < debug->numEntries; i++) {
+        entry = &debug->entries[i];
+        if (entry->id == id && entry->type == type && entry->severity == severity)
+            return entry;
+    }
+
+    if (debug->numEntries == HWC_GL_DEBUG_MAX_IDS)
+        return NULL;
+
+    entry = &debug->entries[debug->numEntries++];
+    memset(entry, 0, sizeof(*entry));
+    entry->id = id;
+    entry->type = type;
+    entry->severity = severity;
+    return entry;
+}
+
+static void GLAPIENTRY
+hwc_gl_debug_callback(GLenum source, GLenum type, GLuint id, GLenum severity,
+                      GLsizei length, const GLchar *message, const void *userParam)
+{
+    ScrnInfoPtr pScrn = (ScrnInfoPtr) userParam;
+    hwc_gl_debug_ptr debug = &HWCPTR(pScrn)->glDebug;
+    hwc_gl_debug_entry_ptr entry;
+    MessageType from = type == GL_DEBUG_TYPE_ERROR ? X_ERROR : X_INFO;
+    CARD32 now = GetTimeInMillis();
+
+    debug->total++;
+
+    entry = hwc_gl_debug_lookup(debug, id, type, severity);
+    if (!entry) {
+        debug->overflow++;
+        return;
+    }
+
+    if (entry->count++ == 0) {
+        xf86DrvMsg(pScrn->scrnIndex, from, "GL %s (id 0x%x, %s): %s\n",
+                   type == GL_DEBUG_TYPE_ERROR ? "error" : "debug", id,
+                   hwc_gl_debug_severity(severity), message);
+        entry->lastLog = now;
+        entry->logged = 1;
+    }
+    else if ((CARD32) (now - entry->lastLog) >= HWC_GL_DEBUG_LOG_INTERVAL) {
+        xf86DrvMsg(pScrn->scrnIndex, from, "GL id 0x%x repeated %lu times\n",
+                   id, entry->count - entry->logged);
+        entry->lastLog = now;
+        entry->logged = entry->count;
+    }
+}
+
+/* Apply a level, the GL context must be current */
+void hwc_gl_debug_set_level(ScrnInfoPtr pScrn, hwc_gl_debug_level level)
+{
+    hwc_gl_debug_ptr debug = &HWCPTR(pScrn)->glDebug;
+
+    if (!debug->supported) {
+        if (level != HWC_GL_DEBUG_OFF)
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "GL debug output needs GL_KHR_debug, keeping it off\n");
+        debug->level = HWC_GL_DEBUG_OFF;
+        return;
+    }
+
+    if (level == HWC_GL_DEBUG_OFF) {
+        glDisable(GL_DEBUG_OUTPUT);
+        glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+        glDebugMessageCallback(NULL, NULL);
+    }
+    else {
+        glDebugMessageCallback(hwc_gl_debug_callback, pScrn);
+        /* Deliver on the calling thread, the callback logs */
+        glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+        glEnable(GL_DEBUG_OUTPUT);
+
+        if (level == HWC_GL_DEBUG_ERRORS) {
+            glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_FALSE);
+            glDebugMessageControl(GL_DONT_CARE, GL_DEBUG_TYPE_ERROR, GL_DONT_CARE, 0, NULL, GL_TRUE);
+        }
+        else
+            glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_TRUE);
+    }
+
+    if (level != debug->level)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "GL debug output: %s\n",
+                   hwc_gl_debug_level_names[level]);
+    debug->level = level;
+}
+
+/* Called once the renderer's context is current */
+void hwc_gl_debug_init(ScrnInfoPtr pScrn)
+{
+    hwc_gl_debug_ptr debug = &HWCPTR(pScrn)->glDebug;
+    hwc_gl_debug_level level = debug->level;
+
+    debug->supported = epoxy_gl_version() >= 32 || epoxy_has_gl_extension("GL_KHR_debug");
+    debug->level = HWC_GL_DEBUG_OFF;
+
+    /* Off is the context default, leave the driver alone */
+    if (level != HWC_GL_DEBUG_OFF)
+        hwc_gl_debug_set_level(pScrn, level);
+}
+
+void hwc_gl_debug_report(ScrnInfoPtr pScrn)
+{
+    hwc_gl_debug_ptr debug = &HWCPTR(pScrn)->glDebug;
+    int i;
+
+    if (!debug->total)
+        return;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "GL debug: %lu messages, %d ids (%lu not tracked)\n",
+               debug->total, debug->numEntries, debug->overflow);
+    for (i = 0; i < debug->numEntries; i++) {
+        hwc_gl_debug_entry_ptr entry = &debug->entries[i];
+
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "  id 0x%x type 0x%x %s: %lu\n",
+                   entry->id, entry->type, hwc_gl_debug_severity(entry->severity),
+                   entry->count);
+    }
+}
+
+void hwc_gl_debug_create_resources(xf86OutputPtr output)
+{
+    ScrnInfoPtr pScrn = output->scrn;
+    HWCPtr hwc = HWCPTR(pScrn);
+    INT32 range[2] = { HWC_GL_DEBUG_OFF, HWC_GL_DEBUG_FULL };
+    INT32 value = hwc->glDebug.level;
+    int err;
+
+    /* The CPU compositor has no GL context */
+    if (hwc->swCompositor)
+        return;
+
+    hwc_gl_debug_atom = MakeAtom("HWC_GL_DEBUG", strlen("HWC_GL_DEBUG"), TRUE);
+
+    err = RRConfigureOutputProperty(output->randr_output, hwc_gl_debug_atom,
+                                    FALSE, TRUE, FALSE, 2, range);
+    if (err != 0) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                   "RRConfigureOutputProperty error, %d\n", err);
+        return;
+    }
+
+    RRChangeOutputProperty(output->randr_output, hwc_gl_debug_atom, XA_INTEGER, 32,
+                           PropModeReplace, 1, &value, FALSE, FALSE);
+}
+
+/* 0 off, 1 errors, 2 full, e.g. xrandr --output hwcomposer --set HWC_GL_DEBUG 1 */
+Bool hwc_gl_debug_set_property(xf86OutputPtr output, Atom property, RRPropertyValuePtr value)
+{
+    HWCPtr hwc = HWCPTR(output->scrn);
+    INT32 level;
+
+    if (property != hwc_gl_debug_atom)
+        return TRUE;
+
+    if (value->type != XA_INTEGER || value->format != 32 || value->size != 1)
+        return FALSE;
+
+    level = *(INT32 *) value->data;
+    if (level < HWC_GL_DEBUG_OFF || level > HWC_GL_DEBUG_FULL)
+        return FALSE;
+
+    hwc_gl_debug_set_level(output->scrn, level);
+    return hwc->glDebug.level == level;
+}
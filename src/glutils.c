@@ -68,6 +68,9 @@ GLuint hwc_link_program(const GLchar *vert_src, const GLchar *frag_src) {
 	GLuint prog = glCreateProgram();
 	glAttachShader(prog, vert);
 	glAttachShader(prog, frag);
+	/* All our programs share the same attribute layout */
+	glBindAttribLocation(prog, HWC_ATTRIB_POSITION, "position");
+	glBindAttribLocation(prog, HWC_ATTRIB_TEXCOORDS, "texcoords");
 	glLinkProgram(prog);
 
 	glDetachShader(prog, vert);
@@ -84,3 +87,107 @@ GLuint hwc_link_program(const GLchar *vert_src, const GLchar *frag_src) {
 
 	return prog;
 }
+
+/*
+ * Minimal GL state tracker for the composite pass. Calls that wouldn't
+ * change the current state are skipped and counted. The context is
+ * shared with glamor, which doesn't go through the tracker, so callers
+ * must invalidate it whenever someone else may have touched the state.
+ */
+void hwc_gl_state_invalidate(hwc_gl_state_ptr state)
+{
+    int i;
+
+    state->program = HWC_GL_STATE_UNKNOWN;
+    state->texture = HWC_GL_STATE_UNKNOWN;
+    state->arrayBuffer = HWC_GL_STATE_UNKNOWN;
+    state->blend = -1;
+    for (i = 0; i < HWC_NUM_ATTRIBS; i++) {
+        state->attribEnabled[i] = -1;
+        state->attribBuffer[i] = HWC_GL_STATE_UNKNOWN;
+        state->attribOffset[i] = 0;
+    }
+}
+
+void hwc_gl_use_program(hwc_gl_state_ptr state, GLuint program)
+{
+    if (state->program == program) {
+        state->skipped++;
+        return;
+    }
+    glUseProgram(program);
+    state->program = program;
+    state->issued++;
+}
+
+void hwc_gl_bind_texture(hwc_gl_state_ptr state, GLuint texture)
+{
+    if (state->texture == texture) {
+        state->skipped++;
+        return;
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    state->texture = texture;
+    state->issued++;
+}
+
+void hwc_gl_bind_array_buffer(hwc_gl_state_ptr state, GLuint buffer)
+{
+    if (state->arrayBuffer == buffer) {
+        state->skipped++;
+        return;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    state->arrayBuffer = buffer;
+    state->issued++;
+}
+
+void hwc_gl_set_blend(hwc_gl_state_ptr state, Bool enable)
+{
+    if (state->blend == enable) {
+        state->skipped++;
+        return;
+    }
+    if (enable)
+        glEnable(GL_BLEND);
+    else
+        glDisable(GL_BLEND);
+    state->blend = enable;
+    state->issued++;
+}
+
+/* Source a vec2 attribute from the given offset into a buffer object */
+void hwc_gl_vertex_attrib(hwc_gl_state_ptr state, GLuint index,
+                          GLuint buffer, GLintptr offset)
+{
+    if (state->attribEnabled[index] != TRUE) {
+        glEnableVertexAttribArray(index);
+        state->attribEnabled[index] = TRUE;
+        state->issued++;
+    } else
+        state->skipped++;
+
+    if (state->attribBuffer[index] == buffer && state->attribOffset[index] == offset) {
+        state->skipped++;
+        return;
+    }
+    hwc_gl_bind_array_buffer(state, buffer);
+    glVertexAttribPointer(index, 2, GL_FLOAT, GL_FALSE, 0, (const void *) offset);
+    state->attribBuffer[index] = buffer;
+    state->attribOffset[index] = offset;
+    state->issued++;
+}
+
+/* Leave the context the way glamor expects to find it */
+void hwc_gl_state_restore(hwc_gl_state_ptr state)
+{
+    int i;
+
+    for (i = 0; i < HWC_NUM_ATTRIBS; i++)
+        glDisableVertexAttribArray(i);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDisable(GL_BLEND);
+    state->issued += HWC_NUM_ATTRIBS + 2;
+
+    hwc_gl_state_invalidate(state);
+}
@@ -37,26 +37,50 @@ inline static uint32_t interpreted_version(hw_device_t *hwc_device)
 	return version;
 }
 
-void hwc_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode)
+/*
+ * Set one of the HWC_POWER_MODE_* modes and return the one actually in
+ * effect. Doze needs HWC 1.4 or later, without it the display is turned
+ * off instead. Runs on the panel worker, so it only talks to the HAL and
+ * logs through the thread safe LogMessageVerbSigSafe.
+ */
+int hwc_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode)
 {
 	HWCPtr hwc = HWCPTR(pScrn);
-    
-	hwc_composer_device_1_t *hwcDevicePtr = hwc->hwcDevicePtr;
-	hw_device_t *hwcDevice = &hwcDevicePtr->common;
+	int err = 0;
 
-	uint32_t hwc_version = hwc->hwcVersion = interpreted_version(hwcDevice);
+	if (hwc->headless)
+		return mode;
 
-#ifdef HWC_DEVICE_API_VERSION_1_4
-	if (hwc_version == HWC_DEVICE_API_VERSION_1_4) {
-		hwcDevicePtr->setPowerMode(hwcDevicePtr, disp, (mode) ? HWC_POWER_MODE_NORMAL : HWC_POWER_MODE_OFF);
-	} else
+#ifdef HAVE_HWC2
+	if (hwc->hwc2)
+		return hwc_hwcomposer2_set_power_mode(pScrn, disp, mode);
 #endif
-#ifdef HWC_DEVICE_API_VERSION_1_5
-	if (hwc_version == HWC_DEVICE_API_VERSION_1_5) {
-		hwcDevicePtr->setPowerMode(hwcDevicePtr, disp, (mode) ? HWC_POWER_MODE_NORMAL : HWC_POWER_MODE_OFF);
+
+	hwc_composer_device_1_t *hwcDevicePtr = hwc->hwcDevicePtr;
+
+#ifdef HWC_DEVICE_API_VERSION_1_4
+	if (hwc->hwcVersion >= HWC_DEVICE_API_VERSION_1_4) {
+		err = hwcDevicePtr->setPowerMode(hwcDevicePtr, disp, mode);
+		if (err && mode != HWC_POWER_MODE_NORMAL && mode != HWC_POWER_MODE_OFF) {
+			LogMessageVerbSigSafe(X_WARNING, 1,
+					"%s(%d): doze power mode %d failed, turning the display off instead\n",
+					pScrn->driverName, pScrn->scrnIndex, mode);
+			mode = HWC_POWER_MODE_OFF;
+			err = hwcDevicePtr->setPowerMode(hwcDevicePtr, disp, mode);
+		}
 	} else
 #endif
-		hwcDevicePtr->blank(hwcDevicePtr, disp, (mode) ? 0 : 1);
+	{
+		if (mode == HWC_POWER_MODE_DOZE || mode == HWC_POWER_MODE_DOZE_SUSPEND)
+			mode = HWC_POWER_MODE_OFF;
+		err = hwcDevicePtr->blank(hwcDevicePtr, disp, mode == HWC_POWER_MODE_OFF);
+	}
+
+	if (err)
+		LogMessageVerbSigSafe(X_ERROR, 1, "%s(%d): failed to set power mode %d: %d\n",
+				pScrn->driverName, pScrn->scrnIndex, mode, err);
+
+	return mode;
 }
 
 void hwc_start_fake_surfaceflinger(ScrnInfoPtr pScrn) {
@@ -82,6 +106,81 @@ void hwc_start_fake_surfaceflinger(ScrnInfoPtr pScrn) {
 	}
 }
 
+typedef struct {
+	hwc_procs_t procs;
+	ScrnInfoPtr pScrn;
+} hwc_procs_rec;
+
+static hwc_procs_rec hwc_procs;
+
+static void hwc_callback_invalidate(const struct hwc_procs *procs)
+{
+	HWCPtr hwc = HWCPTR(((const hwc_procs_rec *) procs)->pScrn);
+
+	/* HWC lost the contents of the display, redraw on the next tick */
+	HWC_SET_DIRTY(hwc);
+}
+
+static void hwc_callback_vsync(const struct hwc_procs *procs, int disp, int64_t timestamp)
+{
+	/* Called from the HAL's vsync thread */
+	if (disp == HWC_DISPLAY_PRIMARY)
+		hwc_sched_vsync(((const hwc_procs_rec *) procs)->pScrn, timestamp);
+}
+
+static void hwc_callback_hotplug(const struct hwc_procs *procs, int disp, int connected)
+{
+}
+
+/*
+ * Register for vsync events for the frame scheduler, FALSE if HWC has
+ * none. They stay off until hwc_hwcomposer_set_vsync() asks for them.
+ */
+Bool hwc_hwcomposer_init_vsync(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_composer_device_1_t *hwcDevicePtr = hwc->hwcDevicePtr;
+
+	if (!hwc->hwc2) {
+		if (!hwcDevicePtr->registerProcs || !hwcDevicePtr->eventControl)
+			return FALSE;
+
+		hwc_procs.procs.invalidate = hwc_callback_invalidate;
+		hwc_procs.procs.vsync = hwc_callback_vsync;
+		hwc_procs.procs.hotplug = hwc_callback_hotplug;
+		hwc_procs.pScrn = pScrn;
+		hwcDevicePtr->registerProcs(hwcDevicePtr, &hwc_procs.procs);
+	}
+
+	return hwc_hwcomposer_set_vsync(pScrn, FALSE);
+}
+
+/* Turn vsync events of the primary display on or off */
+Bool hwc_hwcomposer_set_vsync(ScrnInfoPtr pScrn, Bool enable)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_composer_device_1_t *hwcDevicePtr = hwc->hwcDevicePtr;
+
+#ifdef HAVE_HWC2
+	if (hwc->hwc2)
+		return hwc_hwcomposer2_set_vsync(pScrn, enable);
+#endif
+
+	return hwcDevicePtr->eventControl(hwcDevicePtr, HWC_DISPLAY_PRIMARY, HWC_EVENT_VSYNC,
+									  enable ? 1 : 0) == 0;
+}
+
+#ifdef HAVE_HWC2
+static Bool hwc_use_hwcomposer2(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "using HWComposer 2 API\n");
+	hwc->hwc2 = TRUE;
+	return hwc_hwcomposer2_init(pScrn);
+}
+#endif
+
 Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn)
 {
 	HWCPtr hwc = HWCPTR(pScrn);
@@ -100,34 +199,83 @@ Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn)
 	hwc_start_fake_surfaceflinger(pScrn);
 
 	hw_module_t *hwcModule = 0;
+	hwc->hwc2 = FALSE;
 
 	err = hw_get_module(HWC_HARDWARE_MODULE_ID, (const hw_module_t **) &hwcModule);
+#ifdef HAVE_HWC2
+	if (hwc->hwcApi == 2 || (hwc->hwcApi == 0 && err != 0))
+		return hwc_use_hwcomposer2(pScrn);
+#endif
 	assert(err == 0);
 
 	hwc_composer_device_1_t *hwcDevicePtr = 0;
 	err = hwc_open_1(hwcModule, &hwcDevicePtr);
+#ifdef HAVE_HWC2
+	/* The HAL module may only provide a 2.x device */
+	if (hwc->hwcApi == 0 && (err != 0 || (interpreted_version(&hwcDevicePtr->common) >> 24) >= 2)) {
+		if (err == 0)
+			hwcDevicePtr->common.close(&hwcDevicePtr->common);
+		return hwc_use_hwcomposer2(pScrn);
+	}
+#endif
 	assert(err == 0);
 
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "using HWComposer 1 API\n");
 	hwc->hwcDevicePtr = hwcDevicePtr;
 	hw_device_t *hwcDevice = &hwcDevicePtr->common;
 
-	hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, 1);	uint32_t hwc_version = hwc->hwcVersion = interpreted_version(hwcDevice);
+	/* The version is fixed for the device's lifetime, interpret it once */
+	uint32_t hwc_version = hwc->hwcVersion = interpreted_version(hwcDevice);
+	hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, HWC_POWER_MODE_NORMAL);
 
-	uint32_t configs[5];
-	size_t numConfigs = 5;
+	uint32_t configs[HWC_MAX_CONFIGS];
+	size_t numConfigs = HWC_MAX_CONFIGS;
+	int active = 0;
 
 	err = hwcDevicePtr->getDisplayConfigs(hwcDevicePtr, HWC_DISPLAY_PRIMARY, configs, &numConfigs);
 	assert (err == 0);
 
-	int32_t attr_values[2];
-	uint32_t attributes[] = { HWC_DISPLAY_WIDTH, HWC_DISPLAY_HEIGHT, HWC_DISPLAY_NO_ATTRIBUTE };
+#ifdef HWC_DEVICE_API_VERSION_1_4
+	if (hwc_version >= HWC_DEVICE_API_VERSION_1_4 && hwcDevicePtr->getActiveConfig) {
+		active = hwcDevicePtr->getActiveConfig(hwcDevicePtr, HWC_DISPLAY_PRIMARY);
+		if (active < 0 || active >= (int) numConfigs)
+			active = 0;
+	}
+#endif
+
+	int32_t attr_values[3];
+	uint32_t attributes[] = { HWC_DISPLAY_WIDTH, HWC_DISPLAY_HEIGHT, HWC_DISPLAY_VSYNC_PERIOD,
+							  HWC_DISPLAY_NO_ATTRIBUTE };
 
 	hwcDevicePtr->getDisplayAttributes(hwcDevicePtr, HWC_DISPLAY_PRIMARY,
-			configs[0], attributes, attr_values);
+			configs[active], attributes, attr_values);
 
 	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "width: %i height: %i\n", attr_values[0], attr_values[1]);
 	hwc->hwcWidth = attr_values[0];
 	hwc->hwcHeight = attr_values[1];
+	hwc->vsyncPeriod = attr_values[2];
+
+	/* Other refresh rates at the same size, see refresh.c */
+	hwc->numConfigs = 0;
+	size_t i;
+	for (i = 0; i < numConfigs; i++) {
+		int32_t values[3];
+
+		if (i == (size_t) active)
+			memcpy(values, attr_values, sizeof(values));
+		else if (hwcDevicePtr->getDisplayAttributes(hwcDevicePtr, HWC_DISPLAY_PRIMARY,
+					configs[i], attributes, values) != 0 ||
+				 values[0] != attr_values[0] || values[1] != attr_values[1])
+			continue;
+
+		if (values[2] <= 0)
+			continue;
+		if (i == (size_t) active)
+			hwc->activeConfig = hwc->numConfigs;
+		hwc->configs[hwc->numConfigs].index = i;
+		hwc->configs[hwc->numConfigs].vsyncPeriod = values[2];
+		hwc->numConfigs++;
+	}
 
 	size_t size = sizeof(hwc_display_contents_1_t) + 2 * sizeof(hwc_layer_1_t);
 	hwc_display_contents_1_t *list = (hwc_display_contents_1_t *) malloc(size);
@@ -207,19 +355,114 @@ Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn)
 	list->flags = HWC_GEOMETRY_CHANGED;
 	list->numHwLayers = 2;
 
+	/* Make the first prepare() see a geometry change */
+	hwc->geometryGeneration = 1;
+	hwc->preparedGeometry = 0;
+
 	return TRUE;
 }
 
+/* Server exit, the device and layer list are kept across generations until then */
 void hwc_hwcomposer_close(ScrnInfoPtr pScrn)
 {
+	HWCPtr hwc = HWCPTR(pScrn);
+
+#ifdef HAVE_HWC2
+	if (hwc->hwc2)
+		hwc_hwcomposer2_close(pScrn);
+#endif
+
+	if (hwc->hwcContents) {
+		hwc_display_contents_1_t *list = hwc->hwcContents[0];
+
+		if (list->retireFenceFd != -1)
+			close(list->retireFenceFd);
+		free(list);
+		free(hwc->hwcContents);
+		hwc->hwcContents = NULL;
+		hwc->fblayer = NULL;
+	}
+
+	if (hwc->hwcDevicePtr) {
+		hwc->hwcDevicePtr->common.close(&hwc->hwcDevicePtr->common);
+		hwc->hwcDevicePtr = NULL;
+	}
+
+	if (hwc->alloc) {
+		gralloc_close(hwc->alloc);
+		hwc->alloc = NULL;
+	}
 }
 
-static void present(void *user_data, struct ANativeWindow *window,
-								struct ANativeWindowBuffer *buffer)
+/*
+ * Switch to another of the configs read at init, e.g. for a different
+ * refresh rate. Needs HWC 1.4, FALSE if the switch wasn't made.
+ */
+Bool hwc_hwcomposer_set_config(ScrnInfoPtr pScrn, int config)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_composer_device_1_t *hwcDevicePtr = hwc->hwcDevicePtr;
+
+#ifdef HWC_DEVICE_API_VERSION_1_4
+	if (hwc->hwc2 || hwc->hwcVersion < HWC_DEVICE_API_VERSION_1_4 || !hwcDevicePtr->setActiveConfig)
+		return FALSE;
+
+	if (hwcDevicePtr->setActiveConfig(hwcDevicePtr, HWC_DISPLAY_PRIMARY,
+			hwc->configs[config].index) != 0)
+		return FALSE;
+
+	hwc->activeConfig = config;
+	hwc->vsyncPeriod = hwc->configs[config].vsyncPeriod;
+	hwc->geometryGeneration++;
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+/*
+ * Layers, crops, transforms or visibility changed. The next prepare()
+ * will be told so and HWC gets to pick new composition types.
+ */
+void hwc_hwcomposer_geometry_changed(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	hwc->geometryGeneration++;
+}
+
+static void hwc_set_geometry_flags(HWCPtr hwc, hwc_display_contents_1_t *list)
+{
+	size_t i;
+
+	if (hwc->preparedGeometry == hwc->geometryGeneration) {
+		/* Keep the composition types HWC chose in the last prepare() */
+		list->flags &= ~HWC_GEOMETRY_CHANGED;
+		return;
+	}
+
+	list->flags |= HWC_GEOMETRY_CHANGED;
+	for (i = 0; i < list->numHwLayers; i++) {
+		if (list->hwLayers[i].compositionType != HWC_FRAMEBUFFER_TARGET)
+			list->hwLayers[i].compositionType = HWC_FRAMEBUFFER;
+	}
+}
+
+/*
+ * Show buffer as the framebuffer target once acquireFence has signaled.
+ * Returns a fence that signals when HWC no longer reads the buffer.
+ * Waits for the previous frame to retire, see hwc_hwcomposer_idle().
+ */
+int hwc_hwcomposer_present(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+						   int acquireFence)
 {
-	ScrnInfoPtr pScrn = (ScrnInfoPtr)user_data;
 	HWCPtr hwc = HWCPTR(pScrn);
 
+#ifdef HAVE_HWC2
+	if (hwc->hwc2)
+		return hwc_hwcomposer2_present(pScrn, buffer, acquireFence);
+#endif
+
 	hwc_display_contents_1_t **contents = hwc->hwcContents;
 	hwc_layer_1_t *fblayer = hwc->fblayer;
 	hwc_composer_device_1_t *hwcdevice = hwc->hwcDevicePtr;
@@ -228,21 +471,143 @@ static void present(void *user_data, struct ANativeWindow *window,
 	contents[0]->retireFenceFd = -1;
 
 	fblayer->handle = buffer->handle;
-	fblayer->acquireFenceFd = HWCNativeBufferGetFence(buffer);
+	fblayer->acquireFenceFd = acquireFence;
 	fblayer->releaseFenceFd = -1;
+
+	hwc_capture_attach(pScrn, buffer->handle, acquireFence);
+	hwc_set_geometry_flags(hwc, contents[0]);
 	int err = hwcdevice->prepare(hwcdevice, HWC_NUM_DISPLAY_TYPES, contents);
 	assert(err == 0);
+	hwc->preparedGeometry = hwc->geometryGeneration;
+	hwc_stats_layers(pScrn, contents[0]);
 
+	hwc_sched_submit(pScrn, fblayer->acquireFenceFd);
+	CARD64 submit = GetTimeInMicros();
 	err = hwcdevice->set(hwcdevice, HWC_NUM_DISPLAY_TYPES, contents);
+	hwc_capture_submitted(pScrn);
 	/* in Android, SurfaceFlinger ignores the return value as not all
 		display types may be supported */
-	HWCNativeBufferSetFence(buffer, fblayer->releaseFenceFd);
 
 	if (oldretire != -1)
 	{
+		CARD64 start = GetTimeInMicros();
+		sync_wait(oldretire, -1);
+		close(oldretire);
+		hwc_stats_fence_wait(pScrn, start);
+	}
+
+	hwc_latency_submit(pScrn, submit, contents[0]->retireFenceFd);
+	hwc_sched_retire(pScrn, contents[0]->retireFenceFd);
+
+	return fblayer->releaseFenceFd;
+}
+
+/*
+ * Show buffer as layer 0 with HWC_OVERLAY composition, nothing is drawn
+ * into the framebuffer target. Returns FALSE without showing anything
+ * if prepare() wants the layer composited by GL after all. Otherwise
+ * *releaseFence signals once HWC no longer reads the buffer.
+ */
+Bool hwc_hwcomposer_present_overlay(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+									int *releaseFence)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_display_contents_1_t **contents = hwc->hwcContents;
+	hwc_layer_1_t *layer = &contents[0]->hwLayers[0];
+	hwc_layer_1_t *fblayer = hwc->fblayer;
+	hwc_composer_device_1_t *hwcdevice = hwc->hwcDevicePtr;
+
+	if (layer->handle != buffer->handle) {
+		layer->handle = buffer->handle;
+		hwc_hwcomposer_geometry_changed(pScrn);
+	}
+	/* The CPU wrote the buffer and unlocked it, there is nothing to wait for */
+	layer->acquireFenceFd = -1;
+	layer->releaseFenceFd = -1;
+	fblayer->handle = NULL;
+	fblayer->acquireFenceFd = -1;
+	fblayer->releaseFenceFd = -1;
+
+	hwc_capture_attach(pScrn, buffer->handle, -1);
+	hwc_set_geometry_flags(hwc, contents[0]);
+	int err = hwcdevice->prepare(hwcdevice, HWC_NUM_DISPLAY_TYPES, contents);
+	assert(err == 0);
+	hwc->preparedGeometry = hwc->geometryGeneration;
+
+	if (layer->compositionType != HWC_OVERLAY) {
+		hwc_hwcomposer_overlay_off(pScrn);
+		return FALSE;
+	}
+	hwc_stats_layers(pScrn, contents[0]);
+
+	int oldretire = contents[0]->retireFenceFd;
+	contents[0]->retireFenceFd = -1;
+
+	hwc_sched_submit(pScrn, fblayer->acquireFenceFd);
+	CARD64 submit = GetTimeInMicros();
+	err = hwcdevice->set(hwcdevice, HWC_NUM_DISPLAY_TYPES, contents);
+	hwc_capture_submitted(pScrn);
+
+	if (oldretire != -1)
+	{
+		CARD64 start = GetTimeInMicros();
 		sync_wait(oldretire, -1);
 		close(oldretire);
+		hwc_stats_fence_wait(pScrn, start);
 	}
+
+	hwc_latency_submit(pScrn, submit, contents[0]->retireFenceFd);
+	hwc_sched_retire(pScrn, contents[0]->retireFenceFd);
+
+	if (fblayer->releaseFenceFd != -1) {
+		close(fblayer->releaseFenceFd);
+		fblayer->releaseFenceFd = -1;
+	}
+	*releaseFence = layer->releaseFenceFd;
+	layer->releaseFenceFd = -1;
+	return TRUE;
+}
+
+/* Layer 0 goes back to being an empty HWC_FRAMEBUFFER layer under the GL composite */
+void hwc_hwcomposer_overlay_off(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_layer_1_t *layer;
+
+	if (!hwc->hwcContents)
+		return;
+
+	layer = &hwc->hwcContents[0]->hwLayers[0];
+	if (!layer->handle)
+		return;
+
+	layer->handle = NULL;
+	hwc_hwcomposer_geometry_changed(pScrn);
+}
+
+/* Whether the last frame has retired, so that presenting won't block */
+Bool hwc_hwcomposer_idle(ScrnInfoPtr pScrn, Bool wait)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	int fence;
+
+#ifdef HAVE_HWC2
+	if (hwc->hwc2)
+		fence = hwc->hwc2PresentFence;
+	else
+#endif
+		fence = hwc->hwcContents[0]->retireFenceFd;
+
+	return fence == -1 || sync_wait(fence, wait ? -1 : 0) == 0;
+}
+
+static void present(void *user_data, struct ANativeWindow *window,
+								struct ANativeWindowBuffer *buffer)
+{
+	ScrnInfoPtr pScrn = (ScrnInfoPtr)user_data;
+
+	HWCNativeBufferSetFence(buffer,
+		hwc_hwcomposer_present(pScrn, buffer, HWCNativeBufferGetFence(buffer)));
 }
 
 struct ANativeWindow *hwc_get_native_window(ScrnInfoPtr pScrn) {
@@ -251,17 +616,19 @@ struct ANativeWindow *hwc_get_native_window(ScrnInfoPtr pScrn) {
 	return win;
 }
 
-void hwc_toggle_screen_brightness(ScrnInfoPtr pScrn)
+void hwc_destroy_native_window(struct ANativeWindow *win) {
+	HWCNativeWindowDestroy(win);
+}
+
+/* Set the backlight, 0 turns it off. Doesn't touch HWCRec, the panel worker calls it. */
+void hwc_set_screen_brightness(ScrnInfoPtr pScrn, int brightness)
 {
 	HWCPtr hwc = HWCPTR(pScrn);
 	struct light_state_t state;
-	int brightness;
 
 	if (!hwc->lightsDevice) {
 		return;
 	}
-	brightness = (hwc->dpmsMode == DPMSModeOn) ?
-							hwc->screenBrightness : 0;
 
 	state.flashMode = LIGHT_FLASH_NONE;
 	state.brightnessMode = BRIGHTNESS_MODE_USER;
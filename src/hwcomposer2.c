@@ -0,0 +1,236 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <android-config.h>
+#include <sync/sync.h>
+#include <hybris/hwcomposerwindow/hwcomposer.h>
+
+#include "driver.h"
+
+/*
+ * HWComposer 2.x backend, used through the libhybris hwc2 compat layer.
+ *
+ * The screen is a single client composited layer, the framebuffer
+ * target becomes the client target of the display. While the layer
+ * geometry is unchanged, presentOrValidate lets HWC present right away
+ * and skip the separate validate round trip.
+ */
+
+#define HWC2_HOTPLUG_TIMEOUT 5000 /* in milliseconds */
+
+typedef struct {
+	HWC2EventListener listener;
+	ScrnInfoPtr pScrn;
+} hwc2_listener_rec;
+
+static hwc2_listener_rec hwc2_listener;
+
+static void hwc2_callback_vsync(HWC2EventListener *listener, int32_t sequenceId,
+								hwc2_display_t display, int64_t timestamp)
+{
+	/* Called from a binder thread */
+	hwc_sched_vsync(((hwc2_listener_rec *) listener)->pScrn, timestamp);
+}
+
+static void hwc2_callback_hotplug(HWC2EventListener *listener, int32_t sequenceId,
+								  hwc2_display_t display, bool connected,
+								  bool primaryDisplay)
+{
+	HWCPtr hwc = HWCPTR(((hwc2_listener_rec *) listener)->pScrn);
+
+	hwc2_compat_device_on_hotplug(hwc->hwc2Device, display, connected);
+}
+
+static void hwc2_callback_refresh(HWC2EventListener *listener, int32_t sequenceId,
+								  hwc2_display_t display)
+{
+	HWCPtr hwc = HWCPTR(((hwc2_listener_rec *) listener)->pScrn);
+
+	/* HWC lost the contents of the display, redraw on the next tick */
+	HWC_SET_DIRTY(hwc);
+}
+
+Bool hwc_hwcomposer2_init(ScrnInfoPtr pScrn)
+{
+	static int composerSequenceId = 0;
+	HWCPtr hwc = HWCPTR(pScrn);
+	HWC2DisplayConfig *config;
+	hwc2_compat_layer_t *layer;
+	int i;
+
+	hwc->hwc2Device = hwc2_compat_device_new(false);
+	if (!hwc->hwc2Device) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "failed to open HWComposer 2 device\n");
+		return FALSE;
+	}
+
+	hwc2_listener.listener.on_vsync_received = hwc2_callback_vsync;
+	hwc2_listener.listener.on_hotplug_received = hwc2_callback_hotplug;
+	hwc2_listener.listener.on_refresh_received = hwc2_callback_refresh;
+	hwc2_listener.pScrn = pScrn;
+	hwc->hwc2PresentFence = -1;
+
+	hwc2_compat_device_register_callback(hwc->hwc2Device, &hwc2_listener.listener,
+										 composerSequenceId++);
+
+	/* The primary display appears with the first hotplug event */
+	for (i = 0; i < HWC2_HOTPLUG_TIMEOUT; i++) {
+		hwc->hwc2Display = hwc2_compat_device_get_display_by_id(hwc->hwc2Device, 0);
+		if (hwc->hwc2Display)
+			break;
+		usleep(1000);
+	}
+	if (!hwc->hwc2Display) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "no primary display reported by HWComposer 2\n");
+		return FALSE;
+	}
+
+	hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, HWC_POWER_MODE_NORMAL);
+
+	config = hwc2_compat_display_get_active_config(hwc->hwc2Display);
+	assert(config);
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "width: %i height: %i\n", config->width, config->height);
+	hwc->hwcWidth = config->width;
+	hwc->hwcHeight = config->height;
+	hwc->vsyncPeriod = config->vsyncPeriod;
+
+	hwc->hwc2Layer = layer = hwc2_compat_display_create_layer(hwc->hwc2Display);
+	assert(layer);
+
+	hwc2_compat_layer_set_composition_type(layer, HWC2_COMPOSITION_CLIENT);
+	hwc2_compat_layer_set_blend_mode(layer, HWC2_BLEND_MODE_NONE);
+	hwc2_compat_layer_set_source_crop(layer, 0.0f, 0.0f, hwc->hwcWidth, hwc->hwcHeight);
+	hwc2_compat_layer_set_display_frame(layer, 0, 0, hwc->hwcWidth, hwc->hwcHeight);
+	hwc2_compat_layer_set_visible_region(layer, 0, 0, hwc->hwcWidth, hwc->hwcHeight);
+
+	/* Make the first frame go through a full validate */
+	hwc->geometryGeneration = 1;
+	hwc->preparedGeometry = 0;
+
+	return TRUE;
+}
+
+void hwc_hwcomposer2_close(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	if (hwc->hwc2PresentFence != -1) {
+		close(hwc->hwc2PresentFence);
+		hwc->hwc2PresentFence = -1;
+	}
+}
+
+/* See hwc_hwcomposer_set_vsync() */
+Bool hwc_hwcomposer2_set_vsync(ScrnInfoPtr pScrn, Bool enable)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	return hwc2_compat_display_set_vsync_enabled(hwc->hwc2Display,
+			enable ? HWC2_VSYNC_ENABLE : HWC2_VSYNC_DISABLE) == HWC2_ERROR_NONE;
+}
+
+/* HWC2 power modes share their values with HWC_POWER_MODE_* */
+int hwc_hwcomposer2_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc2_error_t err;
+
+	err = hwc2_compat_display_set_power_mode(hwc->hwc2Display, mode);
+	if (err == HWC2_ERROR_UNSUPPORTED && mode != HWC2_POWER_MODE_ON) {
+		LogMessageVerbSigSafe(X_WARNING, 1,
+				"%s(%d): doze power mode %d is not supported, turning the display off instead\n",
+				pScrn->driverName, pScrn->scrnIndex, mode);
+		mode = HWC2_POWER_MODE_OFF;
+		err = hwc2_compat_display_set_power_mode(hwc->hwc2Display, mode);
+	}
+
+	if (err != HWC2_ERROR_NONE)
+		LogMessageVerbSigSafe(X_ERROR, 1, "%s(%d): failed to set power mode %d: %d\n",
+				pScrn->driverName, pScrn->scrnIndex, mode, err);
+	return mode;
+}
+
+/* Full validate, accepting whatever composition changes HWC asks for */
+static Bool hwc2_validate(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	uint32_t numTypes = 0, numRequests = 0;
+	hwc2_error_t err;
+
+	err = hwc2_compat_display_validate(hwc->hwc2Display, &numTypes, &numRequests);
+	if (err != HWC2_ERROR_NONE && err != HWC2_ERROR_HAS_CHANGES) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "validate failed: %d\n", err);
+		return FALSE;
+	}
+
+	if (numTypes || numRequests) {
+		err = hwc2_compat_display_accept_changes(hwc->hwc2Display);
+		if (err != HWC2_ERROR_NONE) {
+			xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "accept changes failed: %d\n", err);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* See hwc_hwcomposer_present() */
+int hwc_hwcomposer2_present(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+							int acquireFence)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc2_compat_display_t *display = hwc->hwc2Display;
+	uint32_t numTypes = 0, numRequests = 0, presented = 0;
+	int32_t presentFence = -1;
+	int oldPresentFence = hwc->hwc2PresentFence;
+	CARD64 submit = GetTimeInMicros();
+	hwc2_error_t err;
+
+	hwc_sched_submit(pScrn, acquireFence);
+	hwc2_compat_display_set_client_target(display, 0, buffer, acquireFence,
+										  HAL_DATASPACE_UNKNOWN);
+
+	if (hwc->preparedGeometry == hwc->geometryGeneration) {
+		err = hwc2_compat_display_present_or_validate(display, &numTypes, &numRequests,
+													  &presentFence, &presented);
+		if (err != HWC2_ERROR_NONE && err != HWC2_ERROR_HAS_CHANGES) {
+			xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "presentOrValidate failed: %d\n", err);
+			return -1;
+		}
+		if (!presented && (numTypes || numRequests))
+			hwc2_compat_display_accept_changes(display);
+	}
+	else if (!hwc2_validate(pScrn))
+		return -1;
+	hwc->preparedGeometry = hwc->geometryGeneration;
+
+	if (!presented) {
+		err = hwc2_compat_display_present(display, &presentFence);
+		if (err != HWC2_ERROR_NONE)
+			xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "present failed: %d\n", err);
+	}
+
+	/* The client target is free again once the frame is on screen */
+	hwc->hwc2PresentFence = presentFence != -1 ? dup(presentFence) : -1;
+
+	if (oldPresentFence != -1)
+	{
+		CARD64 start = GetTimeInMicros();
+		sync_wait(oldPresentFence, -1);
+		close(oldPresentFence);
+		hwc_stats_fence_wait(pScrn, start);
+	}
+
+	hwc_latency_submit(pScrn, submit, hwc->hwc2PresentFence);
+	hwc_sched_retire(pScrn, hwc->hwc2PresentFence);
+
+	return presentFence;
+}
@@ -0,0 +1,206 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <unistd.h>
+#include "eventstr.h"
+
+#include <android-config.h>
+#include <sync/sync.h>
+
+#include "driver.h"
+
+/*
+ * Input to scanout latency trace.
+ *
+ * Each composited frame carries the time of the first input event and
+ * the first damage that were not yet on screen when it started, and the
+ * time it was handed to HWC. Its retire fence records when the frame
+ * actually reached the panel, so once that has signaled the three
+ * latencies are added to the HWC_LATENCY property and the close summary.
+ * Fence timestamps and GetTimeInMicros both use CLOCK_MONOTONIC.
+ */
+
+typedef struct {
+    CARD64 input;
+    CARD64 damage;
+    CARD64 submit;
+    int fence;
+} hwc_latency_frame_rec;
+
+static void hwc_latency_sample(hwc_latency_ptr latency, int kind, CARD64 start, CARD64 end)
+{
+    if (!start || end < start)
+        return;
+
+    latency->samples[kind][latency->index[kind]] = (CARD32) min(end - start, 0xffffffffULL);
+    latency->index[kind] = (latency->index[kind] + 1) % HWC_STATS_SAMPLES;
+    if (latency->count[kind] < HWC_STATS_SAMPLES)
+        latency->count[kind]++;
+}
+
+/* Signal time of the latest point in a fence, 0 if it hasn't signaled */
+CARD64 hwc_latency_fence_time(int fence)
+{
+    struct sync_fence_info_data *info;
+    struct sync_pt_info *pt = NULL;
+    CARD64 signaled = 0;
+
+    info = sync_fence_info(fence);
+    if (!info)
+        return 0;
+
+    if (info->status == 1) {
+        while ((pt = sync_pt_info(info, pt)) != NULL)
+            signaled = max(signaled, pt->timestamp_ns / 1000);
+    }
+
+    sync_fence_info_free(info);
+    return signaled;
+}
+
+/* The frame in flight is on screen, account it */
+static void hwc_latency_resolve(hwc_latency_ptr latency)
+{
+    CARD64 photon;
+
+    if (!latency->inflightSubmit)
+        return;
+
+    if (latency->inflightFence != -1) {
+        photon = hwc_latency_fence_time(latency->inflightFence);
+        close(latency->inflightFence);
+        latency->inflightFence = -1;
+    }
+    else
+        photon = latency->inflightSubmit;
+
+    if (photon) {
+        hwc_latency_sample(latency, HWC_LATENCY_INPUT, latency->inflightInput, photon);
+        hwc_latency_sample(latency, HWC_LATENCY_DAMAGE, latency->inflightDamage, photon);
+        hwc_latency_sample(latency, HWC_LATENCY_SUBMIT, latency->inflightSubmit, photon);
+        latency->frames++;
+    }
+    else
+        latency->unresolved++;
+
+    latency->inflightInput = latency->inflightDamage = latency->inflightSubmit = 0;
+}
+
+static void hwc_latency_input(CallbackListPtr *list, void *closure, void *data)
+{
+    hwc_latency_ptr latency = &HWCPTR((ScrnInfoPtr) closure)->latency;
+    DeviceEventInfoRec *info = data;
+    CARD32 age;
+
+    switch (info->event->any.type) {
+    case ET_KeyPress:
+    case ET_ButtonPress:
+    case ET_Motion:
+    case ET_TouchBegin:
+    case ET_TouchUpdate:
+        break;
+    default:
+        return;
+    }
+
+    if (latency->pendingInput)
+        return;
+
+    /* Event times are in milliseconds, backdate the stamp to when it was read */
+    age = GetTimeInMillis() - info->event->any.time;
+    latency->pendingInput = GetTimeInMicros() - (CARD64) min(age, 1000) * 1000;
+}
+
+void hwc_latency_init(ScrnInfoPtr pScrn, Bool enable)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_latency_ptr latency = &hwc->latency;
+
+    memset(latency, 0, sizeof(*latency));
+    latency->inflightFence = -1;
+    latency->enabled = enable;
+
+    if (enable) {
+        AddCallback(&DeviceEventCallback, hwc_latency_input, pScrn);
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "latency trace enabled\n");
+    }
+}
+
+void hwc_latency_damage(ScrnInfoPtr pScrn)
+{
+    hwc_latency_ptr latency = &HWCPTR(pScrn)->latency;
+
+    if (latency->enabled && !latency->pendingDamage)
+        latency->pendingDamage = GetTimeInMicros();
+}
+
+/* A frame starts compositing, everything pending so far goes into it */
+void hwc_latency_frame_begin(ScrnInfoPtr pScrn)
+{
+    hwc_latency_ptr latency = &HWCPTR(pScrn)->latency;
+
+    latency->frameInput = latency->pendingInput;
+    latency->frameDamage = latency->pendingDamage;
+    latency->pendingInput = latency->pendingDamage = 0;
+}
+
+/* Nothing is shown while the screen is off, don't count that as latency */
+void hwc_latency_discard(ScrnInfoPtr pScrn)
+{
+    hwc_latency_ptr latency = &HWCPTR(pScrn)->latency;
+
+    latency->pendingInput = latency->pendingDamage = 0;
+}
+
+/*
+ * The current frame was handed to the display at submit, fence (or -1)
+ * signals when it is on screen. Called once the previous frame's fence
+ * has been waited for, so that one can be accounted right away.
+ */
+void hwc_latency_submit(ScrnInfoPtr pScrn, CARD64 submit, int fence)
+{
+    hwc_latency_ptr latency = &HWCPTR(pScrn)->latency;
+
+    if (!latency->enabled)
+        return;
+
+    hwc_latency_resolve(latency);
+
+    latency->inflightInput = latency->frameInput;
+    latency->inflightDamage = latency->frameDamage;
+    latency->inflightSubmit = submit;
+    latency->inflightFence = fence != -1 ? dup(fence) : -1;
+    latency->frameInput = latency->frameDamage = 0;
+}
+
+void hwc_latency_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_latency_ptr latency = &hwc->latency;
+    INT32 p[3 * HWC_LATENCY_KINDS];
+    int i;
+
+    if (!latency->enabled)
+        return;
+
+    DeleteCallback(&DeviceEventCallback, hwc_latency_input, pScrn);
+
+    if (latency->inflightFence != -1)
+        sync_wait(latency->inflightFence, -1);
+    hwc_latency_resolve(latency);
+
+    for (i = 0; i < HWC_LATENCY_KINDS; i++)
+        hwc_stats_percentiles(latency->samples[i], latency->count[i], p + i * 3);
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "latency (p50/p90/p99 us): input %d/%d/%d, damage %d/%d/%d, submit %d/%d/%d "
+               "over %lu frames (%lu unresolved)\n",
+               p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8],
+               latency->frames, latency->unresolved);
+
+    latency->enabled = FALSE;
+}
@@ -0,0 +1,150 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <unistd.h>
+
+#include <android-config.h>
+#include <sync/sync.h>
+
+#include "driver.h"
+
+/*
+ * Root overlay ("RootOverlay" option).
+ *
+ * In fb mode the root window already is a gralloc buffer, yet every
+ * frame the GL renderer reads all of it to draw a copy into the window
+ * surface, which HWC then scans out. When nothing has to be added to
+ * the root on the way, i.e. no rotation, no gamma ramp and no cursor
+ * (this driver draws the cursor with GL), the root buffer is handed to
+ * HWC as an overlay layer instead and the GPU isn't used at all. The
+ * root is allocated as BGRA_8888 for this, the layout X draws in, so
+ * HWC shows it without the swizzle the GL path does.
+ *
+ * There is a single root buffer and X keeps drawing into it while HWC
+ * scans it out, so an update can tear when it lands mid-scanout. That
+ * is the price of the option. The release fence only matters when the
+ * buffer is freed, it is waited for then.
+ *
+ * If prepare() won't take the layer, that frame and all following ones
+ * go through GL until the setup changes.
+ */
+
+/* How long the release fence is waited for when no frame follows */
+#define HWC_OVERLAY_RELEASE_TIMEOUT 100 /* in milliseconds */
+
+void hwc_overlay_init(ScrnInfoPtr pScrn, Bool enable)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_overlay_ptr overlay = &hwc->overlay;
+
+    memset(overlay, 0, sizeof(*overlay));
+    overlay->releaseFence = -1;
+
+    if (!enable)
+        return;
+
+    if (hwc->headless || hwc->hwc2 || hwc->upload.enabled) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "RootOverlay needs HWComposer 1 and a native root buffer, ignoring it\n");
+        return;
+    }
+
+    overlay->enabled = TRUE;
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "root window may be scanned out as an overlay\n");
+}
+
+/* Whether the root can be shown as it is */
+static Bool hwc_overlay_eligible(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    return hwc->buffer && !hwc->glamor &&
+           !hwc->swapchain.depth && /* it queues GL frames of its own */
+           hwc->rotation == HWC_ROTATE_NORMAL &&
+           !hwc->renderer.gammaEnabled &&
+           !hwc->cursorShown &&
+           hwc->bufferWidth == hwc->hwcWidth && hwc->bufferHeight == hwc->hwcHeight;
+}
+
+static void hwc_overlay_wait(hwc_overlay_ptr overlay, int timeout)
+{
+    if (overlay->releaseFence == -1)
+        return;
+
+    sync_wait(overlay->releaseFence, timeout);
+    close(overlay->releaseFence);
+    overlay->releaseFence = -1;
+}
+
+/* Back to the GL composite, HWC may still read the root until that frame is up */
+static void hwc_overlay_leave(ScrnInfoPtr pScrn)
+{
+    hwc_overlay_ptr overlay = &HWCPTR(pScrn)->overlay;
+
+    if (!overlay->active)
+        return;
+
+    hwc_hwcomposer_overlay_off(pScrn);
+    overlay->active = FALSE;
+}
+
+/*
+ * Present the unlocked root buffer as an overlay. Returns FALSE if the
+ * frame has to be composited by GL, nothing has been shown then.
+ */
+Bool hwc_overlay_present(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_overlay_ptr overlay = &hwc->overlay;
+    int fence = -1;
+
+    if (!overlay->enabled)
+        return FALSE;
+
+    if (!hwc_overlay_eligible(pScrn)) {
+        overlay->rejected = FALSE;
+        hwc_overlay_leave(pScrn);
+        return FALSE;
+    }
+
+    if (overlay->rejected)
+        return FALSE;
+
+    if (!hwc_hwcomposer_present_overlay(pScrn, (struct ANativeWindowBuffer *) hwc->buffer, &fence)) {
+        if (overlay->rejections++ == 0)
+            xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                       "HWC won't scan the root out as an overlay, compositing it with GL\n");
+        overlay->rejected = TRUE;
+        overlay->active = FALSE;
+        return FALSE;
+    }
+
+    /* Only the latest fence is kept for hwc_overlay_release() */
+    if (overlay->releaseFence != -1)
+        close(overlay->releaseFence);
+    overlay->releaseFence = fence;
+    overlay->active = TRUE;
+    overlay->frames++;
+    return TRUE;
+}
+
+/* The root buffer is about to be released, HWC must let go of it first */
+void hwc_overlay_release(ScrnInfoPtr pScrn)
+{
+    hwc_overlay_ptr overlay = &HWCPTR(pScrn)->overlay;
+
+    if (!overlay->enabled)
+        return;
+
+    /* Only a following frame would signal the fence, and none may come */
+    hwc_overlay_leave(pScrn);
+    hwc_overlay_wait(overlay, HWC_OVERLAY_RELEASE_TIMEOUT);
+
+    if (overlay->frames || overlay->rejections)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "root overlay: %lu frames, %lu rejections\n",
+                   overlay->frames, overlay->rejections);
+}
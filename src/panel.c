@@ -0,0 +1,186 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <pthread.h>
+
+#include "driver.h"
+
+/*
+ * Panel power and backlight transitions.
+ *
+ * setPowerMode, blank and the lights HAL can block for hundreds of
+ * milliseconds while a panel powers up or down, which would stall every
+ * client and the input. DPMS only queues the transition here and a
+ * worker thread carries it out. A request that arrives while another
+ * is still queued replaces it, so a burst of on/off toggles collapses
+ * into one transition to the last state asked for.
+ *
+ * The compositor doesn't send frames to HWC until the worker is done,
+ * see hwc_panel_ready, so the HAL never sees a frame while it is still
+ * powering the panel up, nor two threads at once.
+ */
+
+/* Darken the panel before it goes off, light it once it shows something */
+static int hwc_panel_transition(ScrnInfoPtr pScrn, int mode, int brightness)
+{
+    hwc_panel_ptr panel = &HWCPTR(pScrn)->panel;
+
+    if (brightness == 0 && brightness != panel->appliedBrightness)
+        hwc_set_screen_brightness(pScrn, 0);
+
+    if (mode != panel->appliedMode)
+        mode = hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, mode);
+
+    if (brightness != 0 && brightness != panel->appliedBrightness)
+        hwc_set_screen_brightness(pScrn, brightness);
+
+    return mode;
+}
+
+static void *hwc_panel_thread(void *data)
+{
+    ScrnInfoPtr pScrn = data;
+    hwc_panel_ptr panel = &HWCPTR(pScrn)->panel;
+    int mode, brightness;
+    CARD32 start, elapsed;
+
+    pthread_mutex_lock(&panel->lock);
+    for (;;) {
+        while (!panel->pending && !panel->quit)
+            pthread_cond_wait(&panel->cond, &panel->lock);
+        if (panel->quit)
+            break;
+
+        mode = panel->mode;
+        brightness = panel->brightness;
+        panel->pending = FALSE;
+        panel->busy = TRUE;
+        pthread_mutex_unlock(&panel->lock);
+
+        start = GetTimeInMillis();
+        mode = hwc_panel_transition(pScrn, mode, brightness);
+        elapsed = GetTimeInMillis() - start;
+
+        pthread_mutex_lock(&panel->lock);
+        panel->appliedMode = mode;
+        panel->appliedBrightness = brightness;
+        panel->busy = FALSE;
+        panel->transitions++;
+        panel->lastTransitionMs = elapsed;
+        panel->maxTransitionMs = max(panel->maxTransitionMs, elapsed);
+    }
+    pthread_mutex_unlock(&panel->lock);
+
+    return NULL;
+}
+
+/* HWC has just been set to HWC_POWER_MODE_NORMAL by its init */
+void hwc_panel_init(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_panel_ptr panel = &hwc->panel;
+
+    memset(panel, 0, sizeof(*panel));
+    panel->mode = panel->appliedMode = HWC_POWER_MODE_NORMAL;
+    panel->brightness = panel->appliedBrightness = -1;
+
+    /* The headless output has nothing that could block */
+    if (hwc->headless)
+        return;
+
+    pthread_mutex_init(&panel->lock, NULL);
+    pthread_cond_init(&panel->cond, NULL);
+    if (pthread_create(&panel->thread, NULL, hwc_panel_thread, pScrn) != 0) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "failed to start the panel power thread, DPMS will block\n");
+        pthread_cond_destroy(&panel->cond);
+        pthread_mutex_destroy(&panel->lock);
+        return;
+    }
+    panel->threaded = TRUE;
+}
+
+void hwc_panel_close(ScrnInfoPtr pScrn)
+{
+    hwc_panel_ptr panel = &HWCPTR(pScrn)->panel;
+
+    if (!panel->threaded)
+        return;
+
+    /* A queued transition is dropped, one in progress is finished */
+    pthread_mutex_lock(&panel->lock);
+    panel->quit = TRUE;
+    pthread_cond_signal(&panel->cond);
+    pthread_mutex_unlock(&panel->lock);
+    pthread_join(panel->thread, NULL);
+
+    pthread_cond_destroy(&panel->cond);
+    pthread_mutex_destroy(&panel->lock);
+    panel->threaded = FALSE;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "panel power: %lu transitions (%lu coalesced), slowest %u ms\n",
+               panel->transitions, panel->coalesced,
+               (unsigned int) panel->maxTransitionMs);
+}
+
+/* Queue a move to an HWC_POWER_MODE_* mode and backlight level, 0 is off */
+void hwc_panel_request(ScrnInfoPtr pScrn, int mode, int brightness)
+{
+    hwc_panel_ptr panel = &HWCPTR(pScrn)->panel;
+
+    panel->target = mode;
+
+    if (!panel->threaded) {
+        panel->appliedMode = hwc_panel_transition(pScrn, mode, brightness);
+        panel->appliedBrightness = brightness;
+        panel->transitions++;
+        return;
+    }
+
+    pthread_mutex_lock(&panel->lock);
+    if (panel->pending)
+        panel->coalesced++;
+    panel->mode = mode;
+    panel->brightness = brightness;
+    panel->pending = TRUE;
+    pthread_cond_signal(&panel->cond);
+    pthread_mutex_unlock(&panel->lock);
+}
+
+/*
+ * Whether the last requested transition is done, and frames may go to
+ * HWC again. Called from the compositor timer.
+ */
+Bool hwc_panel_ready(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_panel_ptr panel = &hwc->panel;
+    Bool settled = TRUE;
+    int applied;
+
+    if (panel->threaded) {
+        pthread_mutex_lock(&panel->lock);
+        settled = !panel->pending && !panel->busy;
+        applied = panel->appliedMode;
+        pthread_mutex_unlock(&panel->lock);
+    }
+    else
+        applied = panel->appliedMode;
+
+    if (!settled)
+        return FALSE;
+
+    /* The HAL refused to doze and turned the display off */
+    if (applied != panel->target) {
+        panel->target = applied;
+        hwc->powerMode = applied;
+        hwc_stats_power_mode(pScrn, applied);
+    }
+
+    return TRUE;
+}
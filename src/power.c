@@ -0,0 +1,173 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <android-config.h>
+#include <hardware/power.h>
+
+#include "driver.h"
+
+/*
+ * Power HAL hints.
+ *
+ * When drawing resumes after the screen has been idle, or the cursor
+ * moves, the CPU and GPU are usually still at idle clocks and the first
+ * frames miss their deadline. Like SurfaceFlinger and the input
+ * dispatcher on Android, we give the power HAL a heads up with an
+ * interaction hint. A launch hint covers the longer burst that
+ * typically follows a long idle period, e.g. an application starting.
+ */
+
+Bool hwc_power_init(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_power_ptr power = &hwc->power;
+    power_module_t *module = NULL;
+
+    memset(power, 0, sizeof(*power));
+
+    if (hw_get_module(POWER_HARDWARE_MODULE_ID, (const hw_module_t **) &module) != 0) {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "no power HAL, power hints disabled\n");
+        return FALSE;
+    }
+
+    if (module->init)
+        module->init(module);
+
+    power->module = module;
+    return TRUE;
+}
+
+static void hwc_power_hint(hwc_power_ptr power, power_hint_t hint, int data)
+{
+    power_module_t *module = power->module;
+
+    if (module->powerHint)
+        module->powerHint(module, hint, &data);
+}
+
+static CARD32 hwc_power_launch_end(OsTimerPtr timer, CARD32 time, void *ptr)
+{
+    hwc_power_ptr power = ptr;
+
+    hwc_power_hint(power, POWER_HINT_LAUNCH, 0);
+    power->launchActive = FALSE;
+    return 0;
+}
+
+static void hwc_power_cancel_launch(hwc_power_ptr power)
+{
+    if (!power->launchActive)
+        return;
+
+    TimerCancel(power->launchTimer);
+    hwc_power_launch_end(power->launchTimer, 0, power);
+}
+
+/* Ask for an interaction boost unless one is still running */
+void hwc_power_interaction(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_power_ptr power = &hwc->power;
+    CARD32 now;
+
+    if (!power->module)
+        return;
+
+    /* Boosts overlap by half their length, so a continuous burst keeps one going */
+    now = GetTimeInMillis();
+    if (power->interactionHints &&
+        (CARD32) (now - power->lastInteraction) < HWC_POWER_INTERACTION_MS / 2) {
+        power->suppressedHints++;
+        return;
+    }
+
+    hwc_power_hint(power, POWER_HINT_INTERACTION, HWC_POWER_INTERACTION_MS);
+    power->lastInteraction = now;
+    power->interactionHints++;
+}
+
+/*
+ * The cursor moved. Called from the input thread, which must not block
+ * in the HAL, so the hint is left to the main thread's block handler.
+ */
+void hwc_power_cursor(ScrnInfoPtr pScrn)
+{
+    hwc_power_ptr power = &HWCPTR(pScrn)->power;
+
+    if (power->module)
+        __atomic_store_n(&power->cursorMoved, TRUE, __ATOMIC_RELEASE);
+}
+
+/* From the block handler, hints asked for by other threads */
+void hwc_power_flush(ScrnInfoPtr pScrn)
+{
+    hwc_power_ptr power = &HWCPTR(pScrn)->power;
+
+    if (power->module && __atomic_exchange_n(&power->cursorMoved, FALSE, __ATOMIC_ACQUIRE))
+        hwc_power_interaction(pScrn);
+}
+
+/* Called for every batch of screen damage */
+void hwc_power_damage(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_power_ptr power = &hwc->power;
+    CARD32 now, idle;
+
+    if (!power->module)
+        return;
+
+    now = GetTimeInMillis();
+    idle = now - power->lastDamage;
+    power->lastDamage = now;
+
+    if (idle < HWC_POWER_IDLE_MS)
+        return;
+
+    if (idle >= HWC_POWER_LAUNCH_IDLE_MS && !power->launchActive) {
+        hwc_power_hint(power, POWER_HINT_LAUNCH, 1);
+        power->launchActive = TRUE;
+        power->launchHints++;
+        power->launchTimer = TimerSet(power->launchTimer, 0, HWC_POWER_LAUNCH_MS,
+                                      hwc_power_launch_end, power);
+    }
+
+    hwc_power_interaction(pScrn);
+}
+
+/* Screen on or off, this also lets the HAL drop to its screen off profile */
+void hwc_power_set_interactive(ScrnInfoPtr pScrn, Bool on)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_power_ptr power = &hwc->power;
+
+    if (!power->module)
+        return;
+
+    if (!on)
+        hwc_power_cancel_launch(power);
+
+    if (power->module->setInteractive)
+        power->module->setInteractive(power->module, on);
+}
+
+void hwc_power_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_power_ptr power = &hwc->power;
+
+    if (!power->module)
+        return;
+
+    hwc_power_cancel_launch(power);
+    TimerFree(power->launchTimer);
+    power->launchTimer = NULL;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "power hints: %lu interaction (%lu rate limited), %lu launch\n",
+               power->interactionHints, power->suppressedHints, power->launchHints);
+}
@@ -0,0 +1,326 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "xf86.h"
+
+#include "eventstr.h"
+
+#include "driver.h"
+
+/*
+ * Adaptive refresh rate ("AdaptiveRefresh" option).
+ *
+ * A 90 or 120 Hz panel draws at its full rate even when all that moves
+ * is a clock. HWC 1.4 can switch between the configs of the display,
+ * and those that only differ in their vsync period are used to follow
+ * the rate of the composited frames, i.e. of damage and of the clients'
+ * Present copies, over the last second:
+ *
+ *  - rates close to a video cadence (24, 25, 30, 50 or 60 fps) take the
+ *    lowest config that is a multiple of it, to show every frame for
+ *    the same time,
+ *  - other rates take the lowest config with some headroom above them,
+ *  - frames on every vsync may want more than the current config shows,
+ *    so they take the highest one, for a while only if the rate turns
+ *    out to be what the lower config already had,
+ *  - pointer and touch input takes the highest config right away.
+ *
+ * Switching up happens at once, switching down only once a lower rate
+ * has done for HWC_REFRESH_DOWN_DELAY.
+ */
+
+#define HWC_REFRESH_WINDOW 1000000      /* frames counted over, in microseconds */
+#define HWC_REFRESH_CHECK 100000        /* between checks, in microseconds */
+#define HWC_REFRESH_DOWN_DELAY 2000000  /* in microseconds */
+#define HWC_REFRESH_PROBE_DELAY 10000000 /* before the highest config is tried again */
+#define HWC_REFRESH_HEADROOM 125        /* percent of the frame rate */
+#define HWC_REFRESH_SATURATED 95        /* percent of the refresh rate */
+
+#ifdef HWC_DEVICE_API_VERSION_1_4
+#define HWC_REFRESH_MIN_VERSION HWC_DEVICE_API_VERSION_1_4
+#else
+#define HWC_REFRESH_MIN_VERSION UINT32_MAX /* no setActiveConfig() */
+#endif
+
+/* Video frame rates, in mHz */
+static const int hwc_refresh_cadences[] = { 24000, 25000, 30000, 50000, 60000 };
+
+/* Refresh rate of a config, in mHz */
+static int hwc_refresh_rate(HWCPtr hwc, int config)
+{
+    return 1000000000000LL / hwc->configs[config].vsyncPeriod;
+}
+
+static int hwc_refresh_highest(HWCPtr hwc)
+{
+    int i, best = 0;
+
+    for (i = 1; i < hwc->numConfigs; i++)
+        if (hwc->configs[i].vsyncPeriod < hwc->configs[best].vsyncPeriod)
+            best = i;
+    return best;
+}
+
+/* Lowest config of at least rate mHz, or one that is a multiple of it */
+static int hwc_refresh_lowest(HWCPtr hwc, int rate, Bool multiple)
+{
+    int i, r, best = -1;
+
+    for (i = 0; i < hwc->numConfigs; i++) {
+        r = hwc_refresh_rate(hwc, i);
+        if (r < rate - rate / 100)
+            continue;
+        /* Within 1%, 59.94 Hz shows 60 fps video fine */
+        if (multiple && abs((r + rate / 2) / rate * rate - r) > rate / 100)
+            continue;
+        if (best == -1 || r < hwc_refresh_rate(hwc, best))
+            best = i;
+    }
+    return best;
+}
+
+static void hwc_refresh_input(CallbackListPtr *list, void *closure, void *data)
+{
+    hwc_refresh_ptr refresh = &HWCPTR((ScrnInfoPtr) closure)->refresh;
+    DeviceEventInfoRec *info = data;
+
+    switch (info->event->any.type) {
+    case ET_ButtonPress:
+    case ET_Motion:
+    case ET_TouchBegin:
+    case ET_TouchUpdate:
+        refresh->input = TRUE;
+        break;
+    default:
+        break;
+    }
+}
+
+void hwc_refresh_init(ScrnInfoPtr pScrn, Bool enable)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_refresh_ptr refresh = &hwc->refresh;
+    int i;
+
+    memset(refresh, 0, sizeof(*refresh));
+    refresh->probed = -1;
+
+    if (!enable)
+        return;
+
+    if (hwc->headless || hwc->hwc2 || hwc->hwcVersion < HWC_REFRESH_MIN_VERSION) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "AdaptiveRefresh needs HWComposer 1.4 or later, ignoring it\n");
+        return;
+    }
+
+    if (hwc->numConfigs < 2) {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "the display has a single refresh rate, AdaptiveRefresh has nothing to do\n");
+        return;
+    }
+
+    for (i = 0; i < hwc->numConfigs; i++)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "refresh rate %d.%02d Hz%s\n",
+                   hwc_refresh_rate(hwc, i) / 1000, hwc_refresh_rate(hwc, i) % 1000 / 10,
+                   i == hwc->activeConfig ? " (active)" : "");
+
+    refresh->enabled = TRUE;
+    refresh->lastCheck = GetTimeInMicros();
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "refresh rate follows the content\n");
+}
+
+void hwc_refresh_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_refresh_ptr refresh = &hwc->refresh;
+    int i;
+
+    if (!refresh->enabled)
+        return;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "adaptive refresh: %lu switches\n", refresh->switches);
+    for (i = 0; i < hwc->numConfigs; i++)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "  %d.%02d Hz for %lu s\n",
+                   hwc_refresh_rate(hwc, i) / 1000, hwc_refresh_rate(hwc, i) % 1000 / 10,
+                   (unsigned long) (refresh->configTime[i] / 1000000));
+}
+
+/* Callback lists are freed at server reset, input is listened to per generation */
+void hwc_refresh_screen_init(ScrnInfoPtr pScrn)
+{
+    hwc_refresh_ptr refresh = &HWCPTR(pScrn)->refresh;
+
+    if (refresh->enabled && !refresh->listening)
+        refresh->listening = AddCallback(&DeviceEventCallback, hwc_refresh_input, pScrn);
+}
+
+void hwc_refresh_close_screen(ScrnInfoPtr pScrn)
+{
+    hwc_refresh_ptr refresh = &HWCPTR(pScrn)->refresh;
+
+    if (refresh->listening)
+        DeleteCallback(&DeviceEventCallback, hwc_refresh_input, pScrn);
+    refresh->listening = FALSE;
+}
+
+/* A frame has been composited */
+void hwc_refresh_frame(ScrnInfoPtr pScrn)
+{
+    hwc_refresh_ptr refresh = &HWCPTR(pScrn)->refresh;
+
+    if (!refresh->enabled)
+        return;
+
+    refresh->frames[refresh->nextFrame] = GetTimeInMicros();
+    refresh->nextFrame = (refresh->nextFrame + 1) % HWC_REFRESH_FRAMES;
+    if (refresh->numFrames < HWC_REFRESH_FRAMES)
+        refresh->numFrames++;
+}
+
+/* Composited frames per second over the last window, in mHz */
+static int hwc_refresh_content_rate(hwc_refresh_ptr refresh, CARD64 now)
+{
+    CARD64 first = 0, last = 0, t;
+    int i, n = 0;
+
+    for (i = 1; i <= refresh->numFrames; i++) {
+        t = refresh->frames[(refresh->nextFrame - i + HWC_REFRESH_FRAMES) % HWC_REFRESH_FRAMES];
+        if (t + HWC_REFRESH_WINDOW < now)
+            break;
+        if (!last)
+            last = t;
+        first = t;
+        n++;
+    }
+
+    /* The whole ring may fit in the window, count what it holds */
+    if (n == HWC_REFRESH_FRAMES)
+        return (CARD64) (n - 1) * 1000000000 / max(last - first, 1);
+
+    if (n < 2)
+        return n * 1000;
+
+    /* Frames that stopped leave a gap, the average over the window covers it */
+    if ((now - last) * (n - 1) > 2 * (last - first))
+        return (CARD64) n * 1000000000 / HWC_REFRESH_WINDOW;
+
+    return (CARD64) (n - 1) * 1000000000 / max(last - first, 1);
+}
+
+/* Config for content at rate mHz */
+static int hwc_refresh_pick(HWCPtr hwc, int rate)
+{
+    int i, config;
+
+    for (i = 0; i < sizeof(hwc_refresh_cadences) / sizeof(hwc_refresh_cadences[0]); i++) {
+        int cadence = hwc_refresh_cadences[i];
+
+        if (abs(rate - cadence) <= cadence * 3 / 100) {
+            config = hwc_refresh_lowest(hwc, cadence, TRUE);
+            if (config != -1)
+                return config;
+            break;
+        }
+    }
+
+    config = hwc_refresh_lowest(hwc, (CARD64) rate * HWC_REFRESH_HEADROOM / 100, FALSE);
+    return config != -1 ? config : hwc_refresh_highest(hwc);
+}
+
+static void hwc_refresh_switch(ScrnInfoPtr pScrn, int config)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_refresh_ptr refresh = &hwc->refresh;
+    int rate = hwc_refresh_rate(hwc, config);
+
+    refresh->lowerSince = 0;
+
+    if (!hwc_hwcomposer_set_config(pScrn, config)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "HWC won't switch to %d.%02d Hz, disabling AdaptiveRefresh\n",
+                   rate / 1000, rate % 1000 / 10);
+        hwc_refresh_close(pScrn);
+        refresh->enabled = FALSE;
+        return;
+    }
+
+    refresh->switches++;
+    hwc_sched_set_period(pScrn);
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, 3, "refresh rate %d.%02d Hz\n",
+                   rate / 1000, rate % 1000 / 10);
+}
+
+/* Called from the compositor timer, switches the config when the content asks for it */
+void hwc_refresh_update(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_refresh_ptr refresh = &hwc->refresh;
+    CARD64 now = GetTimeInMicros();
+    int current = hwc->activeConfig;
+    int highest = hwc_refresh_highest(hwc);
+    int rate, currentRate, want;
+
+    if (!refresh->enabled || now - refresh->lastCheck < HWC_REFRESH_CHECK)
+        return;
+
+    refresh->configTime[current] += now - refresh->lastCheck;
+    refresh->lastCheck = now;
+
+    /* Frames to a panel that is off or dozing don't tell anything */
+    if (hwc->powerMode != HWC_POWER_MODE_NORMAL) {
+        refresh->lowerSince = 0;
+        return;
+    }
+
+    currentRate = hwc_refresh_rate(hwc, current);
+    rate = hwc_refresh_content_rate(refresh, now);
+
+    if (refresh->input) {
+        refresh->input = FALSE;
+        refresh->probed = -1;
+        want = highest;
+    }
+    else if (rate >= currentRate / 100 * HWC_REFRESH_SATURATED) {
+        /* Every vsync had a frame, the content may be faster than it */
+        if (current != highest &&
+            (refresh->probed != current || now - refresh->probedAt >= HWC_REFRESH_PROBE_DELAY)) {
+            refresh->probed = current;
+            refresh->probedAt = now;
+            want = highest;
+        }
+        else
+            want = current;
+    }
+    else {
+        if (refresh->probed == current)
+            refresh->probed = -1;
+        want = hwc_refresh_pick(hwc, rate);
+    }
+
+    if (want == current || hwc_refresh_rate(hwc, want) == currentRate) {
+        refresh->lowerSince = 0;
+        return;
+    }
+
+    if (hwc_refresh_rate(hwc, want) > currentRate) {
+        hwc_refresh_switch(pScrn, want);
+        return;
+    }
+
+    /* Down only once the lower rate has done for a while, to the highest wanted meanwhile */
+    if (!refresh->lowerSince) {
+        refresh->lowerSince = now;
+        refresh->lowerConfig = want;
+        return;
+    }
+
+    if (hwc_refresh_rate(hwc, want) > hwc_refresh_rate(hwc, refresh->lowerConfig))
+        refresh->lowerConfig = want;
+
+    if (now - refresh->lowerSince >= HWC_REFRESH_DOWN_DELAY)
+        hwc_refresh_switch(pScrn, refresh->lowerConfig);
+}
@@ -17,6 +17,8 @@ extern const char vertex_src[];
 extern const char vertex_mvp_src[];
 extern const char fragment_src[];
 extern const char fragment_src_bgra[];
+extern const char fragment_lut_src[];
+extern const char fragment_lut_src_bgra[];
 
 static const GLfloat squareVertices[] = {
     -1.0f, -1.0f,
@@ -25,6 +27,14 @@ static const GLfloat squareVertices[] = {
     1.0f,  1.0f,
 };
 
+/* FBOs have their origin at the top of the buffer, unlike window surfaces */
+static const GLfloat flippedSquareVertices[] = {
+    -1.0f,  1.0f,
+    1.0f,  1.0f,
+    -1.0f, -1.0f,
+    1.0f, -1.0f,
+};
+
 static const GLfloat textureVertices[][8] = {
     { // NORMAL - 0 degrees
         0.0f,  1.0f,
@@ -52,7 +62,12 @@ static const GLfloat textureVertices[][8] = {
     }
 };
 
-GLfloat cursorVertices[8];
+/* Offset of the texture coordinates for a rotation in the static vertex buffer */
+#define TEXCOORDS_OFFSET(rotation) \
+    ((GLintptr) (sizeof(squareVertices) + (rotation) * sizeof(textureVertices[0])))
+
+/* ... and of the flipped quad, stored after them */
+#define FLIPPED_OFFSET ((GLintptr) (sizeof(squareVertices) + sizeof(textureVertices)))
 
 Bool hwc_init_hybris_native_buffer(ScrnInfoPtr pScrn)
 {
@@ -61,7 +76,7 @@ Bool hwc_init_hybris_native_buffer(ScrnInfoPtr pScrn)
 
     if (strstr(eglQueryString(renderer->display, EGL_EXTENSIONS), "EGL_HYBRIS_native_buffer") == NULL)
     {
-        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "EGL_HYBRIS_native_buffer is missing. Make sure libhybris EGL implementation is used\n");
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "EGL_HYBRIS_native_buffer is missing, the root window has to be uploaded\n");
         return FALSE;
     }
 
@@ -88,20 +103,6 @@ Bool hwc_init_hybris_native_buffer(ScrnInfoPtr pScrn)
     return TRUE;
 }
 
-void GLAPIENTRY
-MessageCallback( GLenum source,
-                 GLenum type,
-                 GLuint id,
-                 GLenum severity,
-                 GLsizei length,
-                 const GLchar* message,
-                 const void* userParam )
-{
-  fprintf( stderr, "GL CALLBACK: %s type = 0x%x, severity = 0x%x, message = %s\n",
-           ( type == GL_DEBUG_TYPE_ERROR ? "** GL ERROR **" : "" ),
-            type, severity, message );
-}
-
 Bool hwc_egl_renderer_init(ScrnInfoPtr pScrn)
 {
     HWCPtr hwc = HWCPTR(pScrn);
@@ -131,7 +132,7 @@ Bool hwc_egl_renderer_init(ScrnInfoPtr pScrn)
     EGLBoolean rv;
     int err;
 
-    struct ANativeWindow *win = hwc_get_native_window(pScrn);
+    struct ANativeWindow *win = NULL;
 
     display = eglGetDisplay(NULL);
     assert(eglGetError() == EGL_SUCCESS);
@@ -146,10 +147,32 @@ Bool hwc_egl_renderer_init(ScrnInfoPtr pScrn)
     assert(eglGetError() == EGL_SUCCESS);
     assert(rv == EGL_TRUE);
 
-    surface = eglCreateWindowSurface((EGLDisplay) display, ecfg, (EGLNativeWindowType)win, NULL);
+    if (hwc->headless) {
+        /* Offscreen output, composite into a pbuffer of the output size */
+        EGLint pbufferAttr[] = { EGL_WIDTH, hwc->hwcWidth, EGL_HEIGHT, hwc->hwcHeight, EGL_NONE };
+
+        surface = eglCreatePbufferSurface((EGLDisplay) display, ecfg, pbufferAttr);
+    }
+    else if (hwc->swapchain.depth) {
+        /* Frames go to the swapchain FBOs, the surface only makes the context current */
+        EGLint pbufferAttr[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+
+        surface = eglCreatePbufferSurface((EGLDisplay) display, ecfg, pbufferAttr);
+    }
+    else {
+        win = hwc_get_native_window(pScrn);
+        surface = eglCreateWindowSurface((EGLDisplay) display, ecfg, (EGLNativeWindowType)win, NULL);
+    }
     assert(eglGetError() == EGL_SUCCESS);
     assert(surface != EGL_NO_SURFACE);
     renderer->surface = surface;
+    renderer->window = win;
+    renderer->config = ecfg;
+    renderer->idleSurface = EGL_NO_SURFACE;
+    renderer->surfaceless = strstr(eglQueryString(display, EGL_EXTENSIONS),
+                                   "EGL_KHR_surfaceless_context") != NULL;
+    renderer->nativeFenceSync = epoxy_has_egl_extension(display, "EGL_ANDROID_native_fence_sync");
+    renderer->waitSync = epoxy_has_egl_extension(display, "EGL_KHR_wait_sync");
 
     context = eglCreateContext((EGLDisplay) display, ecfg, EGL_NO_CONTEXT, ctxattr);
     assert(eglGetError() == EGL_SUCCESS);
@@ -158,10 +181,7 @@ Bool hwc_egl_renderer_init(ScrnInfoPtr pScrn)
 
     assert(eglMakeCurrent((EGLDisplay) display, surface, surface, context) == EGL_TRUE);
 
-    // During init, enable debug output
-    glEnable              ( GL_DEBUG_OUTPUT );
-    glDebugMessageCallback( MessageCallback, 0 );
-
+    hwc_gl_debug_init(pScrn);
 
     const char *version = glGetString(GL_VERSION);
     assert(version);
@@ -169,41 +189,103 @@ Bool hwc_egl_renderer_init(ScrnInfoPtr pScrn)
 
     glGenTextures(1, &renderer->rootTexture);
     glGenTextures(1, &renderer->cursorTexture);
+    renderer->vertexBuffer = 0;
+    renderer->cursorBuffer = 0;
+    hwc_gl_state_invalidate(&renderer->state);
     renderer->image = EGL_NO_IMAGE_KHR;
     renderer->rootShader.program = 0;
     renderer->projShader.program = 0;
+    renderer->rootLutShader.program = 0;
+    renderer->projLutShader.program = 0;
+    renderer->gammaTexture = 0;
+    renderer->gammaEnabled = FALSE;
 
     return TRUE;
 }
 
+/* Composite into the libhybris native window, which presents on eglSwapBuffers */
+static Bool hwc_egl_renderer_create_window(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+
+    renderer->window = hwc_get_native_window(pScrn);
+    renderer->surface = eglCreateWindowSurface(renderer->display, renderer->config,
+                                               (EGLNativeWindowType) renderer->window, NULL);
+    if (renderer->surface == EGL_NO_SURFACE)
+        return FALSE;
+
+    eglMakeCurrent(renderer->display, renderer->surface, renderer->surface, renderer->context);
+    return TRUE;
+}
+
+/* The swapchain couldn't be set up, go back to the native window */
+static void hwc_egl_renderer_swapchain_fallback(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    EGLSurface pbuffer = renderer->surface;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "swapchain disabled, using the native window\n");
+    hwc->swapchain.depth = 0;
+
+    if (!hwc_egl_renderer_create_window(pScrn))
+        FatalError("failed to create EGL window surface\n");
+
+    /* glamor-hybris may still make the surface it was handed current */
+    if (hwc->glamor)
+        renderer->idleSurface = pbuffer;
+    else
+        eglDestroySurface(renderer->display, pbuffer);
+}
+
+/* Whether the root texture samples as RGBA while holding X's BGRA */
+static Bool hwc_root_swizzle(HWCPtr hwc)
+{
+    return !hwc->glamor && !hwc->bufferBGRA;
+}
+
+/* Sample the root native buffer through rootTexture, which must be bound */
+static void hwc_egl_renderer_import_root(hwc_renderer_ptr renderer, EGLClientBuffer buffer)
+{
+    renderer->image = renderer->eglCreateImageKHR(renderer->display, EGL_NO_CONTEXT, EGL_NATIVE_BUFFER_HYBRIS,
+                                        buffer, NULL);
+    renderer->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, renderer->image);
+}
+
 void hwc_egl_renderer_screen_init(ScreenPtr pScreen)
 {
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     HWCPtr hwc = HWCPTR(pScrn);
     hwc_renderer_ptr renderer = &hwc->renderer;
+    hwc_gl_state_ptr state = &renderer->state;
+    float width, height;
 
-    glBindTexture(GL_TEXTURE_2D, renderer->rootTexture);
+    hwc_gl_state_invalidate(state);
+    glActiveTexture(GL_TEXTURE0);
+    hwc_gl_bind_texture(state, renderer->rootTexture);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    if (!hwc->glamor && renderer->image == EGL_NO_IMAGE_KHR) {
-        renderer->image = renderer->eglCreateImageKHR(renderer->display, EGL_NO_CONTEXT, EGL_NATIVE_BUFFER_HYBRIS,
-                                            (EGLClientBuffer)hwc->buffer, NULL);
-        renderer->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, renderer->image);
-    }
+    if (!hwc->glamor && hwc->buffer && renderer->image == EGL_NO_IMAGE_KHR)
+        hwc_egl_renderer_import_root(renderer, hwc->buffer);
+
+    if (hwc->swapchain.depth && !hwc->swapchain.buffers[0].buffer &&
+        !hwc_swapchain_alloc(pScrn))
+        hwc_egl_renderer_swapchain_fallback(pScrn);
 
     if (!renderer->rootShader.program) {
         GLuint prog;
         renderer->rootShader.program = prog =
-            hwc_link_program(vertex_src, hwc->glamor ? fragment_src : fragment_src_bgra);
+            hwc_link_program(vertex_src, hwc_root_swizzle(hwc) ? fragment_src_bgra : fragment_src);
 
         if (!prog) {
             xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
                        "hwc_egl_renderer_screen_init: failed to link root window shader\n");
         }
 
-        renderer->rootShader.position  = glGetAttribLocation(prog, "position");
-        renderer->rootShader.texcoords = glGetAttribLocation(prog, "texcoords");
+        renderer->rootShader.position  = HWC_ATTRIB_POSITION;
+        renderer->rootShader.texcoords = HWC_ATTRIB_TEXCOORDS;
         renderer->rootShader.texture = glGetUniformLocation(prog, "texture");
     }
 
@@ -217,16 +299,67 @@ void hwc_egl_renderer_screen_init(ScreenPtr pScreen)
                        "hwc_egl_renderer_screen_init: failed to link cursor shader\n");
         }
 
-        renderer->projShader.position  = glGetAttribLocation(prog, "position");
-        renderer->projShader.texcoords = glGetAttribLocation(prog, "texcoords");
+        renderer->projShader.position  = HWC_ATTRIB_POSITION;
+        renderer->projShader.texcoords = HWC_ATTRIB_TEXCOORDS;
         renderer->projShader.transform = glGetUniformLocation(prog, "transform");
         renderer->projShader.texture = glGetUniformLocation(prog, "texture");
     }
 
-    if (hwc->rotation == HWC_ROTATE_CW || hwc->rotation == HWC_ROTATE_CCW)
-        hwc_ortho_2d(renderer->projection, 0.0f, pScrn->virtualY, 0.0f, pScrn->virtualX);
+    if (hwc->rotation == HWC_ROTATE_CW || hwc->rotation == HWC_ROTATE_CCW) {
+        width = pScrn->virtualY;
+        height = pScrn->virtualX;
+    }
+    else {
+        width = pScrn->virtualX;
+        height = pScrn->virtualY;
+    }
+    if (hwc->swapchain.depth)
+        hwc_ortho_2d(renderer->projection, 0.0f, width, height, 0.0f);
     else
-        hwc_ortho_2d(renderer->projection, 0.0f, pScrn->virtualX, 0.0f, pScrn->virtualY);
+        hwc_ortho_2d(renderer->projection, 0.0f, width, 0.0f, height);
+
+    /* Uniforms never change between frames, upload them once */
+    hwc_gl_use_program(state, renderer->rootShader.program);
+    glUniform1i(renderer->rootShader.texture, 0);
+
+    hwc_gl_use_program(state, renderer->projShader.program);
+    glUniform1i(renderer->projShader.texture, 0);
+    glUniformMatrix4fv(renderer->projShader.transform, 1, GL_FALSE, renderer->projection);
+
+    if (renderer->projLutShader.program) {
+        hwc_gl_use_program(state, renderer->projLutShader.program);
+        glUniformMatrix4fv(renderer->projLutShader.transform, 1, GL_FALSE, renderer->projection);
+    }
+
+    /*
+     * Full screen quad followed by the texture coordinates for every
+     * rotation and the quad flipped for the swapchain
+     */
+    if (!renderer->vertexBuffer) {
+        glGenBuffers(1, &renderer->vertexBuffer);
+        hwc_gl_bind_array_buffer(state, renderer->vertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, FLIPPED_OFFSET + sizeof(flippedSquareVertices),
+                     NULL, GL_STATIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(squareVertices), squareVertices);
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(squareVertices),
+                        sizeof(textureVertices), textureVertices);
+        glBufferSubData(GL_ARRAY_BUFFER, FLIPPED_OFFSET,
+                        sizeof(flippedSquareVertices), flippedSquareVertices);
+    }
+
+    /* Cursor quad positions followed by its atlas texture coordinates */
+    if (!renderer->cursorBuffer) {
+        glGenBuffers(1, &renderer->cursorBuffer);
+        hwc_gl_bind_array_buffer(state, renderer->cursorBuffer);
+        memset(renderer->cursorVertices, 0, sizeof(renderer->cursorVertices));
+        glBufferData(GL_ARRAY_BUFFER, sizeof(renderer->cursorVertices),
+                     renderer->cursorVertices, GL_DYNAMIC_DRAW);
+    }
+
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    if (hwc->glamor)
+        hwc_gl_state_restore(state);
 
     eglSwapInterval(renderer->display, 0);
 }
@@ -281,37 +414,141 @@ void hwc_translate_cursor(hwc_rotation rotation, int x, int y, int width, int he
     #undef P
 }
 
-void hwc_egl_render_cursor(ScreenPtr pScreen) {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+/*
+ * The gamma programs are only linked once a non-linear ramp is set, the
+ * default identity ramp keeps using the plain programs.
+ */
+static Bool hwc_egl_renderer_link_lut_shaders(ScrnInfoPtr pScrn)
+{
     HWCPtr hwc = HWCPTR(pScrn);
     hwc_renderer_ptr renderer = &hwc->renderer;
+    hwc_gl_state_ptr state = &renderer->state;
+    const char *fragment = hwc->glamor ? fragment_lut_src : fragment_lut_src_bgra;
+    GLuint prog;
+
+    renderer->rootLutShader.program = prog =
+        hwc_link_program(vertex_src, hwc_root_swizzle(hwc) ? fragment_lut_src_bgra : fragment_lut_src);
+    if (!prog) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "failed to link gamma root window shader\n");
+        return FALSE;
+    }
+    renderer->rootLutShader.position  = HWC_ATTRIB_POSITION;
+    renderer->rootLutShader.texcoords = HWC_ATTRIB_TEXCOORDS;
+    renderer->rootLutShader.texture = glGetUniformLocation(prog, "texture");
+    renderer->rootLutShader.lut = glGetUniformLocation(prog, "lut");
+    hwc_gl_use_program(state, prog);
+    glUniform1i(renderer->rootLutShader.texture, 0);
+    glUniform1i(renderer->rootLutShader.lut, 1);
+
+    renderer->projLutShader.program = prog = hwc_link_program(vertex_mvp_src, fragment);
+    if (!prog) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "failed to link gamma cursor shader\n");
+        return FALSE;
+    }
+    renderer->projLutShader.position  = HWC_ATTRIB_POSITION;
+    renderer->projLutShader.texcoords = HWC_ATTRIB_TEXCOORDS;
+    renderer->projLutShader.transform = glGetUniformLocation(prog, "transform");
+    renderer->projLutShader.texture = glGetUniformLocation(prog, "texture");
+    renderer->projLutShader.lut = glGetUniformLocation(prog, "lut");
+    hwc_gl_use_program(state, prog);
+    glUniform1i(renderer->projLutShader.texture, 0);
+    glUniform1i(renderer->projLutShader.lut, 1);
+    glUniformMatrix4fv(renderer->projLutShader.transform, 1, GL_FALSE, renderer->projection);
 
-    glUseProgram(renderer->projShader.program);
+    return TRUE;
+}
 
-    glBindTexture(GL_TEXTURE_2D, renderer->cursorTexture);
-    glUniform1i(renderer->projShader.texture, 0);
+/* Upload the gamma LUT if needed and bind it to texture unit 1 */
+static void hwc_egl_renderer_bind_lut(hwc_renderer_ptr renderer)
+{
+    glActiveTexture(GL_TEXTURE1);
+
+    if (!renderer->gammaTexture) {
+        glGenTextures(1, &renderer->gammaTexture);
+        glBindTexture(GL_TEXTURE_2D, renderer->gammaTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        renderer->gammaDirty = TRUE;
+    }
+    else
+        glBindTexture(GL_TEXTURE_2D, renderer->gammaTexture);
 
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glEnable(GL_BLEND);
+    if (renderer->gammaDirty) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, HWC_GAMMA_SIZE, 1, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, renderer->gammaLut);
+        renderer->gammaDirty = FALSE;
+    }
 
-    hwc_translate_cursor(hwc->rotation, hwc->cursorX, hwc->cursorY,
-                         hwc->cursorWidth, hwc->cursorHeight,
-                         pScrn->virtualX, pScrn->virtualY,
-                         cursorVertices);
+    glActiveTexture(GL_TEXTURE0);
+}
 
-    glVertexAttribPointer(renderer->projShader.position, 2, GL_FLOAT, 0, 0, cursorVertices);
-    glEnableVertexAttribArray(renderer->projShader.position);
+/*
+ * RandR gamma ramp of the crtc. It is resampled to HWC_GAMMA_SIZE
+ * entries and applied by the composite shaders.
+ */
+void hwc_egl_renderer_set_gamma(ScrnInfoPtr pScrn, CARD16 *red, CARD16 *green,
+                                CARD16 *blue, int size)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    Bool identity = TRUE;
+    int i, j;
+
+    if (size < 2)
+        return;
+
+    for (i = 0; i < HWC_GAMMA_SIZE; i++) {
+        j = i * (size - 1) / (HWC_GAMMA_SIZE - 1);
+        renderer->gammaLut[i * 4 + 0] = red[j] >> 8;
+        renderer->gammaLut[i * 4 + 1] = green[j] >> 8;
+        renderer->gammaLut[i * 4 + 2] = blue[j] >> 8;
+        renderer->gammaLut[i * 4 + 3] = 0xff;
+
+        if (renderer->gammaLut[i * 4 + 0] != i ||
+            renderer->gammaLut[i * 4 + 1] != i ||
+            renderer->gammaLut[i * 4 + 2] != i)
+            identity = FALSE;
+    }
 
-    glVertexAttribPointer(renderer->projShader.texcoords, 2, GL_FLOAT, 0, 0, textureVertices[hwc->rotation]);
-    glEnableVertexAttribArray(renderer->projShader.texcoords);
+    renderer->gammaEnabled = !identity;
+    renderer->gammaDirty = TRUE;
+    HWC_SET_DIRTY(hwc);
+}
 
-    glUniformMatrix4fv(renderer->projShader.transform, 1, GL_FALSE, renderer->projection);
+void hwc_egl_render_cursor(ScreenPtr pScreen) {
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    hwc_gl_state_ptr state = &renderer->state;
+    GLfloat vertices[16];
+    int x, y;
 
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    hwc_gl_use_program(state, renderer->gammaEnabled ?
+                       renderer->projLutShader.program : renderer->projShader.program);
+    hwc_gl_bind_texture(state, renderer->cursorTexture);
+    hwc_gl_set_blend(state, TRUE);
 
-    glDisable(GL_BLEND);
-    glDisableVertexAttribArray(renderer->projShader.position);
-    glDisableVertexAttribArray(renderer->projShader.texcoords);
+    hwc_cursor_sample(pScrn, &x, &y);
+    hwc_translate_cursor(hwc->rotation, x, y,
+                         hwc->cursorWidth, hwc->cursorHeight,
+                         pScrn->virtualX, pScrn->virtualY,
+                         vertices);
+    hwc_cursor_cache_texcoords(pScrn, textureVertices[hwc->rotation], vertices + 8);
+
+    /* Only touch the buffer when the cursor moved or changed */
+    if (memcmp(vertices, renderer->cursorVertices, sizeof(vertices)) != 0) {
+        memcpy(renderer->cursorVertices, vertices, sizeof(vertices));
+        hwc_gl_bind_array_buffer(state, renderer->cursorBuffer);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
+    }
+
+    hwc_gl_vertex_attrib(state, HWC_ATTRIB_POSITION, renderer->cursorBuffer, 0);
+    hwc_gl_vertex_attrib(state, HWC_ATTRIB_TEXCOORDS, renderer->cursorBuffer,
+                         8 * sizeof(GLfloat));
+
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 }
 
 void hwc_egl_renderer_update(ScreenPtr pScreen)
@@ -319,33 +556,50 @@ void hwc_egl_renderer_update(ScreenPtr pScreen)
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     HWCPtr hwc = HWCPTR(pScrn);
     hwc_renderer_ptr renderer = &hwc->renderer;
+    hwc_gl_state_ptr state = &renderer->state;
 
     if (hwc->glamor) {
+        /* glamor shares our context and may have changed anything since the last frame */
+        hwc_gl_state_invalidate(state);
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
         glViewport(0, 0, hwc->hwcWidth, hwc->hwcHeight);
+        glActiveTexture(GL_TEXTURE0);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     }
 
-    glUseProgram(renderer->rootShader.program);
+    if (hwc->swapchain.depth)
+        hwc_swapchain_begin_frame(pScrn);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, renderer->rootTexture);
-    glUniform1i(renderer->rootShader.texture, 0);
+    if (renderer->gammaEnabled && !renderer->rootLutShader.program &&
+        !hwc_egl_renderer_link_lut_shaders(pScrn))
+        renderer->gammaEnabled = FALSE;
 
-    glVertexAttribPointer(renderer->rootShader.position, 2, GL_FLOAT, 0, 0, squareVertices);
-    glEnableVertexAttribArray(renderer->rootShader.position);
+    if (renderer->gammaEnabled) {
+        hwc_egl_renderer_bind_lut(renderer);
+        hwc_gl_use_program(state, renderer->rootLutShader.program);
+    }
+    else
+        hwc_gl_use_program(state, renderer->rootShader.program);
+    hwc_gl_bind_texture(state, renderer->rootTexture);
+    hwc_gl_set_blend(state, FALSE);
 
-    glVertexAttribPointer(renderer->rootShader.texcoords, 2, GL_FLOAT, 0, 0, textureVertices[hwc->rotation]);
-    glEnableVertexAttribArray(renderer->rootShader.texcoords);
+    hwc_gl_vertex_attrib(state, HWC_ATTRIB_POSITION, renderer->vertexBuffer,
+                         hwc->swapchain.depth ? FLIPPED_OFFSET : 0);
+    hwc_gl_vertex_attrib(state, HWC_ATTRIB_TEXCOORDS, renderer->vertexBuffer,
+                         TEXCOORDS_OFFSET(hwc->rotation));
 
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
-    glDisableVertexAttribArray(renderer->rootShader.position);
-    glDisableVertexAttribArray(renderer->rootShader.texcoords);
-
     if (hwc->cursorShown)
         hwc_egl_render_cursor(pScreen);
 
-    eglSwapBuffers (renderer->display, renderer->surface );  // get the rendered buffer to the screen
+    if (hwc->glamor)
+        hwc_gl_state_restore(state);
+
+    if (hwc->swapchain.depth)
+        hwc_swapchain_end_frame(pScrn);
+    else
+        eglSwapBuffers (renderer->display, renderer->surface );  // get the rendered buffer to the screen
 }
 
 void hwc_egl_renderer_screen_close(ScreenPtr pScreen)
@@ -354,12 +608,198 @@ void hwc_egl_renderer_screen_close(ScreenPtr pScreen)
     HWCPtr hwc = HWCPTR(pScrn);
     hwc_renderer_ptr renderer = &hwc->renderer;
 
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "GL state: %lu calls issued, %lu skipped\n",
+               renderer->state.issued, renderer->state.skipped);
+    hwc_gl_debug_report(pScrn);
+
+    /*
+     * Programs, buffers and the root EGLImage stay alive for the next
+     * server generation, glamor sets its own state up again.
+     */
+    hwc_gl_state_invalidate(&renderer->state);
+}
+
+/*
+ * Native fence fd that signals once the GL commands issued so far have
+ * completed, -1 if the driver can't export one. This also flushes.
+ */
+int hwc_egl_renderer_fence(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    EGLint attr[] = {
+        EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+        EGL_NONE
+    };
+    EGLSyncKHR sync;
+    int fence;
+
+    if (!renderer->nativeFenceSync)
+        return -1;
+
+    sync = eglCreateSyncKHR(renderer->display, EGL_SYNC_NATIVE_FENCE_ANDROID, attr);
+    if (sync == EGL_NO_SYNC_KHR)
+        return -1;
+
+    /* The fd only exists once the fence command has been flushed */
+    glFlush();
+    fence = eglDupNativeFenceFDANDROID(renderer->display, sync);
+    eglDestroySyncKHR(renderer->display, sync);
+
+    return fence;
+}
+
+/*
+ * Make the GPU wait for a native fence before running the commands
+ * issued after this, the CPU doesn't block. On success EGL owns the
+ * fence, on failure the caller still has to wait for and close it.
+ */
+Bool hwc_egl_renderer_wait_fence(ScrnInfoPtr pScrn, int fence)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    EGLint attr[] = { EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fence, EGL_NONE };
+    EGLSyncKHR sync;
+
+    if (!renderer->nativeFenceSync || !renderer->waitSync)
+        return FALSE;
+
+    sync = eglCreateSyncKHR(renderer->display, EGL_SYNC_NATIVE_FENCE_ANDROID, attr);
+    if (sync == EGL_NO_SYNC_KHR)
+        return FALSE;
+
+    eglWaitSyncKHR(renderer->display, sync, 0);
+    eglDestroySyncKHR(renderer->display, sync);
+    return TRUE;
+}
+
+/* The root native buffer is about to be released */
+void hwc_egl_renderer_release_root(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+
     if (renderer->image != EGL_NO_IMAGE_KHR) {
         renderer->eglDestroyImageKHR(renderer->display, renderer->image);
         renderer->image = EGL_NO_IMAGE_KHR;
     }
 }
 
+/*
+ * Drop the window surface, its buffers and the root EGLImage while the
+ * panel is off. The context stays alive on a surfaceless or 1x1 pbuffer
+ * drawable, so textures, programs and vertex buffers survive and resume
+ * only has to recreate what is dropped here.
+ */
+void hwc_egl_renderer_suspend(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    EGLint pbufferAttr[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    EGLSurface idle = EGL_NO_SURFACE;
+
+    /* Nothing but the swapchain buffers depend on the panel being on */
+    if (hwc->swapchain.depth) {
+        hwc_swapchain_release(pScrn);
+        return;
+    }
+
+    /* glamor-hybris was handed our window surface and may make it current */
+    if (hwc->glamor || hwc->headless)
+        return;
+
+    if (renderer->image != EGL_NO_IMAGE_KHR) {
+        renderer->eglDestroyImageKHR(renderer->display, renderer->image);
+        renderer->image = EGL_NO_IMAGE_KHR;
+    }
+
+    if (!renderer->surfaceless) {
+        idle = eglCreatePbufferSurface(renderer->display, renderer->config, pbufferAttr);
+        if (idle == EGL_NO_SURFACE) {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "failed to create idle pbuffer, keeping window surface\n");
+            return;
+        }
+    }
+
+    eglMakeCurrent(renderer->display, idle, idle, renderer->context);
+    eglDestroySurface(renderer->display, renderer->surface);
+    hwc_destroy_native_window(renderer->window);
+
+    renderer->surface = EGL_NO_SURFACE;
+    renderer->window = NULL;
+    renderer->idleSurface = idle;
+}
+
+void hwc_egl_renderer_resume(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+
+    if (hwc->swapchain.depth && !hwc->swapchain.buffers[0].buffer &&
+        !hwc_swapchain_alloc(pScrn))
+        hwc_egl_renderer_swapchain_fallback(pScrn);
+
+    if (renderer->surface == EGL_NO_SURFACE) {
+        if (!hwc_egl_renderer_create_window(pScrn))
+            FatalError("failed to create EGL window surface\n");
+
+        if (renderer->idleSurface != EGL_NO_SURFACE) {
+            eglDestroySurface(renderer->display, renderer->idleSurface);
+            renderer->idleSurface = EGL_NO_SURFACE;
+        }
+    }
+
+    if (!hwc->glamor && hwc->buffer && renderer->image == EGL_NO_IMAGE_KHR) {
+        hwc_gl_bind_texture(&renderer->state, renderer->rootTexture);
+        hwc_egl_renderer_import_root(renderer, hwc->buffer);
+    }
+}
+
+/* Server exit, everything created by hwc_egl_renderer_init goes */
 void hwc_egl_renderer_close(ScrnInfoPtr pScrn)
 {
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    GLuint programs[] = {
+        renderer->rootShader.program, renderer->projShader.program,
+        renderer->rootLutShader.program, renderer->projLutShader.program
+    };
+    int i;
+
+    if (renderer->display == EGL_NO_DISPLAY)
+        return;
+
+    hwc_swapchain_close(pScrn);
+    hwc_egl_renderer_release_root(pScrn);
+
+    if (renderer->context != EGL_NO_CONTEXT) {
+        for (i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+            if (programs[i])
+                glDeleteProgram(programs[i]);
+        }
+        if (renderer->vertexBuffer)
+            glDeleteBuffers(1, &renderer->vertexBuffer);
+        if (renderer->cursorBuffer)
+            glDeleteBuffers(1, &renderer->cursorBuffer);
+        if (renderer->gammaTexture)
+            glDeleteTextures(1, &renderer->gammaTexture);
+        if (renderer->cursorTexture)
+            glDeleteTextures(1, &renderer->cursorTexture);
+        if (!hwc->glamor)
+            glDeleteTextures(1, &renderer->rootTexture);
+
+        eglMakeCurrent(renderer->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(renderer->display, renderer->context);
+    }
+
+    if (renderer->surface != EGL_NO_SURFACE)
+        eglDestroySurface(renderer->display, renderer->surface);
+    if (renderer->idleSurface != EGL_NO_SURFACE)
+        eglDestroySurface(renderer->display, renderer->idleSurface);
+    if (renderer->window)
+        hwc_destroy_native_window(renderer->window);
+    eglTerminate(renderer->display);
+
+    memset(renderer, 0, sizeof(*renderer));
 }
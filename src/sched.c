@@ -0,0 +1,261 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <unistd.h>
+
+#include <android-config.h>
+#include <sync/sync.h>
+
+#include "driver.h"
+
+/*
+ * Frame scheduler ("FrameScheduler" option).
+ *
+ * A fixed timer starts compositing at an arbitrary point of the vsync
+ * period. Started too early, damage arriving during the rest of the
+ * period waits a whole frame. Started too late, the frame misses its
+ * vsync. Instead each frame starts at
+ *
+ *   next vsync - predicted cost - margin
+ *
+ * where the vsync phase comes from HWC's vsync events and the cost is a
+ * moving average of the time from the frame start until both the GPU
+ * is done (the acquire fence given to HWC) and HWC has been handed the
+ * frame. The margin grows with the variation of the cost. The retire
+ * fence tells whether a frame made the vsync it was aimed at.
+ *
+ * Vsync events wake the HAL's thread every period, so they are only on
+ * while frames are drawn to a panel that is on. HWC_SCHED_IDLE after
+ * the last frame they are turned off. Until they come back the phase
+ * is extrapolated from the last one.
+ */
+
+#define HWC_SCHED_MARGIN 1500  /* minimum, in microseconds */
+#define HWC_SCHED_WEIGHT 8     /* a new cost sample counts 1/WEIGHT */
+#define HWC_SCHED_IDLE 250000  /* without frames before vsync events stop, in microseconds */
+
+static void hwc_sched_close_fences(hwc_sched_ptr sched)
+{
+    if (sched->gpuFence != -1)
+        close(sched->gpuFence);
+    if (sched->retireFence != -1)
+        close(sched->retireFence);
+    sched->gpuFence = sched->retireFence = -1;
+    sched->inflight = FALSE;
+}
+
+void hwc_sched_init(ScrnInfoPtr pScrn, Bool enable)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sched_ptr sched = &hwc->sched;
+
+    memset(sched, 0, sizeof(*sched));
+    sched->gpuFence = sched->retireFence = -1;
+
+    /* The headless output has its own cadence */
+    if (!enable || hwc->headless)
+        return;
+
+    if (hwc->vsyncPeriod <= 0 || !hwc_hwcomposer_init_vsync(pScrn)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "HWC has no vsync events, frames start on a fixed timer\n");
+        return;
+    }
+
+    sched->enabled = TRUE;
+    sched->period = hwc->vsyncPeriod / 1000;
+    /* Until there are samples, assume half a period */
+    sched->cost = sched->period / 2;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "frames start before each vsync, period %u us\n",
+               (unsigned int) sched->period);
+}
+
+static void hwc_sched_set_vsync(ScrnInfoPtr pScrn, Bool on)
+{
+    hwc_sched_ptr sched = &HWCPTR(pScrn)->sched;
+
+    if (sched->vsyncOn == on)
+        return;
+
+    /* If HWC refuses, the phase is extrapolated as while idle */
+    sched->vsyncOn = on;
+    if (!hwc_hwcomposer_set_vsync(pScrn, on))
+        xf86DrvMsgVerb(pScrn->scrnIndex, X_WARNING, 3, "HWC won't turn vsync events %s\n",
+                       on ? "on" : "off");
+}
+
+/*
+ * No frames for a while, or the panel is off or dozes: stop vsync
+ * events. Only from the compositor timer once hwc_panel_ready(), the
+ * panel worker may be in the HAL before.
+ */
+void hwc_sched_idle(ScrnInfoPtr pScrn)
+{
+    if (HWCPTR(pScrn)->sched.enabled)
+        hwc_sched_set_vsync(pScrn, FALSE);
+}
+
+void hwc_sched_close(ScrnInfoPtr pScrn)
+{
+    hwc_sched_ptr sched = &HWCPTR(pScrn)->sched;
+
+    if (!sched->enabled)
+        return;
+
+    hwc_sched_idle(pScrn);
+    hwc_sched_close_fences(sched);
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "frame schedule: %lu on time, %lu late (%lu by more than a frame), "
+               "%lu unresolved, cost %u us\n",
+               sched->onTime, sched->missed, sched->missedMore, sched->unresolved,
+               (unsigned int) sched->cost);
+}
+
+/* The display switched configs, see refresh.c. Vsync events bring the new phase. */
+void hwc_sched_set_period(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sched_ptr sched = &hwc->sched;
+
+    if (sched->enabled)
+        sched->period = hwc->vsyncPeriod / 1000;
+}
+
+/* From the HAL's vsync thread, timestamp in nanoseconds of CLOCK_MONOTONIC */
+void hwc_sched_vsync(ScrnInfoPtr pScrn, int64_t timestamp)
+{
+    hwc_sched_ptr sched = &HWCPTR(pScrn)->sched;
+
+    __atomic_store_n(&sched->vsync, timestamp, __ATOMIC_RELEASE);
+}
+
+/* First vsync at or after time, on a made up phase until HWC reported one */
+static CARD64 hwc_sched_vsync_after(hwc_sched_ptr sched, CARD64 time)
+{
+    CARD64 vsync = __atomic_load_n(&sched->vsync, __ATOMIC_ACQUIRE) / 1000;
+
+    if (vsync >= time)
+        return vsync;
+    return vsync + (time - vsync + sched->period - 1) / sched->period * sched->period;
+}
+
+static CARD64 hwc_sched_lead(hwc_sched_ptr sched)
+{
+    CARD64 lead = sched->cost + max(2 * sched->deviation, HWC_SCHED_MARGIN);
+
+    /* A frame that costs more than a period can't make every vsync anyway */
+    return min(lead, sched->period);
+}
+
+/* Account the frame in flight once its fences have signaled */
+static void hwc_sched_resolve(hwc_sched_ptr sched, Bool force)
+{
+    CARD64 ready, shown;
+    int64_t sample, error;
+
+    if (!sched->inflight)
+        return;
+
+    if ((sched->gpuFence != -1 && sync_wait(sched->gpuFence, 0) != 0) ||
+        (sched->retireFence != -1 && sync_wait(sched->retireFence, 0) != 0)) {
+        if (force) {
+            sched->unresolved++;
+            hwc_sched_close_fences(sched);
+        }
+        return;
+    }
+
+    ready = sched->submit;
+    if (sched->gpuFence != -1)
+        ready = max(ready, hwc_latency_fence_time(sched->gpuFence));
+    shown = sched->retireFence != -1 ? hwc_latency_fence_time(sched->retireFence) : ready;
+    hwc_sched_close_fences(sched);
+
+    sample = ready - sched->inflightStart;
+    error = sample - (int64_t) sched->cost;
+    sched->cost += error / HWC_SCHED_WEIGHT;
+    sched->deviation += ((error < 0 ? -error : error) - (int64_t) sched->deviation) /
+                        HWC_SCHED_WEIGHT;
+    sched->lastCost = sample;
+
+    /* On screen at the vsync it was aimed at, or a later one */
+    if (shown <= sched->inflightTarget + sched->period / 2)
+        sched->onTime++;
+    else {
+        sched->missed++;
+        if (shown > sched->inflightTarget + sched->period * 3 / 2)
+            sched->missedMore++;
+    }
+}
+
+/* A frame starts now */
+void hwc_sched_frame_begin(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sched_ptr sched = &hwc->sched;
+    CARD64 now;
+
+    if (!sched->enabled)
+        return;
+
+    if (hwc->powerMode == HWC_POWER_MODE_NORMAL)
+        hwc_sched_set_vsync(pScrn, TRUE);
+    hwc_sched_resolve(sched, TRUE);
+
+    now = GetTimeInMicros();
+    sched->start = sched->lastFrame = now;
+    /* Frames drawn off schedule aim at the first vsync they can make */
+    sched->inflightTarget = sched->target > now ? sched->target :
+                            hwc_sched_vsync_after(sched, now + sched->cost);
+}
+
+/* Before HWC gets the frame, the acquire fence signals when the GPU is done */
+void hwc_sched_submit(ScrnInfoPtr pScrn, int acquireFence)
+{
+    hwc_sched_ptr sched = &HWCPTR(pScrn)->sched;
+
+    if (!sched->enabled || !sched->start)
+        return;
+
+    hwc_sched_close_fences(sched);
+    sched->submit = GetTimeInMicros();
+    sched->gpuFence = acquireFence != -1 ? dup(acquireFence) : -1;
+}
+
+/* After HWC got the frame, the retire fence signals once it is on screen */
+void hwc_sched_retire(ScrnInfoPtr pScrn, int retireFence)
+{
+    hwc_sched_ptr sched = &HWCPTR(pScrn)->sched;
+
+    if (!sched->enabled || !sched->start)
+        return;
+
+    sched->retireFence = retireFence != -1 ? dup(retireFence) : -1;
+    sched->inflight = TRUE;
+    sched->inflightStart = sched->start;
+    sched->start = 0;
+}
+
+/* Milliseconds until the next frame should start, called from the compositor timer */
+CARD32 hwc_sched_delay(ScrnInfoPtr pScrn)
+{
+    hwc_sched_ptr sched = &HWCPTR(pScrn)->sched;
+    CARD64 now = GetTimeInMicros();
+    CARD64 lead, start;
+
+    hwc_sched_resolve(sched, FALSE);
+
+    if (sched->vsyncOn && now - sched->lastFrame >= HWC_SCHED_IDLE)
+        hwc_sched_idle(pScrn);
+
+    /* The timer has millisecond resolution, keep a millisecond to spare */
+    lead = sched->lead = hwc_sched_lead(sched);
+    sched->target = hwc_sched_vsync_after(sched, now + lead + 1000);
+    start = sched->target - lead;
+
+    return max((start - now) / 1000, 1);
+}
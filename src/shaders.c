@@ -38,3 +38,36 @@ const char fragment_src_bgra [] =
     "{\n"
     "    gl_FragColor = texture2D(texture, textureCoordinate).bgra;\n"
     "}\n";
+
+/* Same as above with the RandR gamma ramp applied through a 256x1 LUT */
+const char fragment_lut_src [] =
+    "precision mediump float;\n"
+    "varying highp vec2 textureCoordinate;\n"
+    "uniform sampler2D texture;\n"
+    "uniform sampler2D lut;\n"
+
+    "void main()\n"
+    "{\n"
+    "    vec4 color = texture2D(texture, textureCoordinate);\n"
+    "    vec3 index = color.rgb * (255.0 / 256.0) + (0.5 / 256.0);\n"
+    "    gl_FragColor = vec4(texture2D(lut, vec2(index.r, 0.5)).r,\n"
+    "                        texture2D(lut, vec2(index.g, 0.5)).g,\n"
+    "                        texture2D(lut, vec2(index.b, 0.5)).b,\n"
+    "                        color.a);\n"
+    "}\n";
+
+const char fragment_lut_src_bgra [] =
+    "precision mediump float;\n"
+    "varying highp vec2 textureCoordinate;\n"
+    "uniform sampler2D texture;\n"
+    "uniform sampler2D lut;\n"
+
+    "void main()\n"
+    "{\n"
+    "    vec4 color = texture2D(texture, textureCoordinate).bgra;\n"
+    "    vec3 index = color.rgb * (255.0 / 256.0) + (0.5 / 256.0);\n"
+    "    gl_FragColor = vec4(texture2D(lut, vec2(index.r, 0.5)).r,\n"
+    "                        texture2D(lut, vec2(index.g, 0.5)).g,\n"
+    "                        texture2D(lut, vec2(index.b, 0.5)).b,\n"
+    "                        color.a);\n"
+    "}\n";
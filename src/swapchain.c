@@ -0,0 +1,334 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <unistd.h>
+
+#include <android-config.h>
+#include <sync/sync.h>
+#include <system/window.h>
+
+#include "driver.h"
+
+/*
+ * Driver owned swapchain ("SwapchainDepth" 2 to 4).
+ *
+ * Instead of going through the libhybris native window, the GL renderer
+ * composites into a ring of gralloc buffers that are rendered to as
+ * EGLImage backed FBOs and handed to HWC directly. A rendered frame is
+ * queued and only presented once HWC has retired the previous one.
+ * In FIFO mode every queued frame is shown in order and rendering
+ * waits for a free buffer. In mailbox mode the newest frame is shown
+ * and older queued ones are dropped, so a slow HWC never delays the
+ * frame that reflects the latest state of the screen.
+ */
+
+static Bool hwc_swapchain_alloc_buffer(ScrnInfoPtr pScrn, hwc_swapchain_buffer_ptr buf)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    int stride;
+
+    buf->sync = EGL_NO_SYNC_KHR;
+    buf->acquireFence = -1;
+    buf->releaseFence = -1;
+    renderer->eglHybrisCreateNativeBuffer(hwc->hwcWidth, hwc->hwcHeight,
+                                          HYBRIS_USAGE_HW_RENDER | HYBRIS_USAGE_HW_TEXTURE |
+                                          HYBRIS_USAGE_HW_COMPOSER | HYBRIS_USAGE_HW_FB,
+                                          HYBRIS_PIXEL_FORMAT_RGBA_8888,
+                                          &stride, &buf->buffer);
+    if (!buf->buffer)
+        return FALSE;
+
+    buf->image = renderer->eglCreateImageKHR(renderer->display, EGL_NO_CONTEXT,
+                                             EGL_NATIVE_BUFFER_HYBRIS, buf->buffer, NULL);
+    if (buf->image == EGL_NO_IMAGE_KHR)
+        return FALSE;
+
+    glGenTextures(1, &buf->texture);
+    hwc_gl_bind_texture(&renderer->state, buf->texture);
+    renderer->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, buf->image);
+
+    glGenFramebuffers(1, &buf->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, buf->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, buf->texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        return FALSE;
+
+    buf->state = HWC_BUFFER_FREE;
+    return TRUE;
+}
+
+static void hwc_swapchain_free_buffer(ScrnInfoPtr pScrn, hwc_swapchain_buffer_ptr buf)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+
+    if (!buf->buffer)
+        return;
+
+    if (buf->sync != EGL_NO_SYNC_KHR)
+        eglDestroySyncKHR(renderer->display, buf->sync);
+    if (buf->acquireFence != -1)
+        close(buf->acquireFence);
+    if (buf->releaseFence != -1) {
+        sync_wait(buf->releaseFence, -1);
+        close(buf->releaseFence);
+    }
+    if (buf->fbo)
+        glDeleteFramebuffers(1, &buf->fbo);
+    if (buf->texture)
+        glDeleteTextures(1, &buf->texture);
+    if (buf->image != EGL_NO_IMAGE_KHR)
+        renderer->eglDestroyImageKHR(renderer->display, buf->image);
+    if (buf->buffer)
+        renderer->eglHybrisReleaseNativeBuffer(buf->buffer);
+
+    memset(buf, 0, sizeof(*buf));
+}
+
+/* Allocate the ring, the renderer falls back to the native window on failure */
+Bool hwc_swapchain_alloc(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_swapchain_ptr chain = &hwc->swapchain;
+    int i;
+
+    /* Buffers are libhybris native buffers */
+    if (!hwc->renderer.eglHybrisCreateNativeBuffer)
+        return FALSE;
+
+    chain->fenceSync = epoxy_has_egl_extension(hwc->renderer.display, "EGL_KHR_fence_sync");
+
+    for (i = 0; i < chain->depth; i++) {
+        if (!hwc_swapchain_alloc_buffer(pScrn, &chain->buffers[i])) {
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                       "failed to allocate swapchain buffer %d\n", i);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            hwc_swapchain_release(pScrn);
+            return FALSE;
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    hwc_gl_state_invalidate(&hwc->renderer.state);
+    return TRUE;
+}
+
+/* Free every buffer, waiting for HWC to let go of them first */
+void hwc_swapchain_release(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_swapchain_ptr chain = &hwc->swapchain;
+    int i;
+
+    for (i = 0; i < HWC_SWAPCHAIN_MAX; i++)
+        hwc_swapchain_free_buffer(pScrn, &chain->buffers[i]);
+}
+
+void hwc_swapchain_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_swapchain_ptr chain = &hwc->swapchain;
+
+    if (!chain->depth)
+        return;
+
+    hwc_swapchain_release(pScrn);
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "swapchain: %lu frames presented, %lu dropped, %lu stalls, %lu CPU fence waits, "
+               "average occupancy %lu.%02lu\n",
+               chain->presented, chain->dropped, chain->stalls, chain->cpuWaits,
+               hwc_swapchain_occupancy(pScrn) / 100, hwc_swapchain_occupancy(pScrn) % 100);
+}
+
+/* Average number of frames waiting for HWC when one is queued, in hundredths */
+unsigned long hwc_swapchain_occupancy(ScrnInfoPtr pScrn)
+{
+    hwc_swapchain_ptr chain = &HWCPTR(pScrn)->swapchain;
+
+    if (!chain->occupancySamples)
+        return 0;
+    return chain->occupancySum * 100 / chain->occupancySamples;
+}
+
+int hwc_swapchain_queued(ScrnInfoPtr pScrn)
+{
+    hwc_swapchain_ptr chain = &HWCPTR(pScrn)->swapchain;
+    int i, n = 0;
+
+    for (i = 0; i < chain->depth; i++)
+        n += chain->buffers[i].state == HWC_BUFFER_QUEUED;
+    return n;
+}
+
+/* Oldest or newest queued buffer, NULL if none */
+static hwc_swapchain_buffer_ptr hwc_swapchain_pick(hwc_swapchain_ptr chain, Bool newest)
+{
+    hwc_swapchain_buffer_ptr pick = NULL;
+    int i;
+
+    for (i = 0; i < chain->depth; i++) {
+        hwc_swapchain_buffer_ptr buf = &chain->buffers[i];
+
+        if (buf->state != HWC_BUFFER_QUEUED)
+            continue;
+        if (!pick || (newest ? (int32_t) (buf->sequence - pick->sequence) > 0
+                             : (int32_t) (buf->sequence - pick->sequence) < 0))
+            pick = buf;
+    }
+    return pick;
+}
+
+static hwc_swapchain_buffer_ptr hwc_swapchain_find_free(hwc_swapchain_ptr chain)
+{
+    int i;
+
+    for (i = 0; i < chain->depth; i++) {
+        if (chain->buffers[i].state == HWC_BUFFER_FREE)
+            return &chain->buffers[i];
+    }
+    return NULL;
+}
+
+static void hwc_swapchain_drop(HWCPtr hwc, hwc_swapchain_buffer_ptr buf)
+{
+    if (buf->sync != EGL_NO_SYNC_KHR) {
+        eglDestroySyncKHR(hwc->renderer.display, buf->sync);
+        buf->sync = EGL_NO_SYNC_KHR;
+    }
+    if (buf->acquireFence != -1) {
+        close(buf->acquireFence);
+        buf->acquireFence = -1;
+    }
+    buf->state = HWC_BUFFER_FREE;
+    hwc->swapchain.dropped++;
+}
+
+/*
+ * Present a queued frame once HWC has retired the previous one, or
+ * right away after waiting for it if wait is set.
+ */
+void hwc_swapchain_present(ScrnInfoPtr pScrn, Bool wait)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_swapchain_ptr chain = &hwc->swapchain;
+    hwc_swapchain_buffer_ptr buf, shown = NULL;
+    int i;
+
+    if (!hwc_swapchain_queued(pScrn))
+        return;
+
+    if (!hwc_hwcomposer_idle(pScrn, wait))
+        return;
+
+    buf = hwc_swapchain_pick(chain, chain->mode == HWC_SWAPCHAIN_MAILBOX);
+
+    /* Anything queued before the newest frame is stale */
+    if (chain->mode == HWC_SWAPCHAIN_MAILBOX) {
+        for (i = 0; i < chain->depth; i++) {
+            if (chain->buffers[i].state == HWC_BUFFER_QUEUED && &chain->buffers[i] != buf)
+                hwc_swapchain_drop(hwc, &chain->buffers[i]);
+        }
+    }
+
+    if (buf->sync != EGL_NO_SYNC_KHR) {
+        eglClientWaitSyncKHR(hwc->renderer.display, buf->sync,
+                             EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+        eglDestroySyncKHR(hwc->renderer.display, buf->sync);
+        buf->sync = EGL_NO_SYNC_KHR;
+        chain->cpuWaits++;
+    }
+
+    for (i = 0; i < chain->depth; i++) {
+        if (chain->buffers[i].state == HWC_BUFFER_DISPLAYED)
+            shown = &chain->buffers[i];
+    }
+
+    /* HWC takes ownership of the acquire fence */
+    buf->releaseFence = hwc_hwcomposer_present(pScrn, (struct ANativeWindowBuffer *) buf->buffer,
+                                               buf->acquireFence);
+    buf->acquireFence = -1;
+    buf->state = HWC_BUFFER_DISPLAYED;
+    if (shown)
+        shown->state = HWC_BUFFER_FREE;
+    chain->presented++;
+}
+
+/* Pick the buffer to composite the next frame into and bind its FBO */
+void hwc_swapchain_begin_frame(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_swapchain_ptr chain = &hwc->swapchain;
+    hwc_swapchain_buffer_ptr buf;
+
+    buf = hwc_swapchain_find_free(chain);
+    if (!buf) {
+        chain->stalls++;
+        if (chain->mode == HWC_SWAPCHAIN_MAILBOX) {
+            /* Overwrite the oldest frame HWC hasn't picked up yet */
+            buf = hwc_swapchain_pick(chain, FALSE);
+            hwc_swapchain_drop(hwc, buf);
+        }
+        else {
+            /* Wait for HWC to take frames until the one it was showing is free */
+            while (!(buf = hwc_swapchain_find_free(chain)))
+                hwc_swapchain_present(pScrn, TRUE);
+        }
+    }
+
+    buf->state = HWC_BUFFER_RENDERING;
+    chain->current = buf;
+    glBindFramebuffer(GL_FRAMEBUFFER, buf->fbo);
+
+    /* HWC may still be reading it, have the GPU wait for that if it can */
+    if (buf->releaseFence != -1) {
+        if (!hwc_egl_renderer_wait_fence(pScrn, buf->releaseFence)) {
+            sync_wait(buf->releaseFence, -1);
+            close(buf->releaseFence);
+            chain->cpuWaits++;
+        }
+        buf->releaseFence = -1;
+    }
+    glViewport(0, 0, hwc->hwcWidth, hwc->hwcHeight);
+}
+
+/* The frame is composited, queue it and present it if HWC is ready */
+void hwc_swapchain_end_frame(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_swapchain_ptr chain = &hwc->swapchain;
+    hwc_swapchain_buffer_ptr buf = chain->current;
+
+    /*
+     * A native fence goes to HWC as the acquire fence and nobody waits
+     * on the CPU. Without one, present waits for an EGL fence, and
+     * without that, for everything to finish right here.
+     */
+    buf->acquireFence = hwc_egl_renderer_fence(pScrn);
+    if (buf->acquireFence == -1) {
+        if (chain->fenceSync)
+            buf->sync = eglCreateSyncKHR(hwc->renderer.display, EGL_SYNC_FENCE_KHR, NULL);
+        if (buf->sync != EGL_NO_SYNC_KHR)
+            glFlush();
+        else {
+            glFinish();
+            chain->cpuWaits++;
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    buf->state = HWC_BUFFER_QUEUED;
+    buf->sequence = ++chain->sequence;
+    chain->current = NULL;
+
+    chain->occupancySum += hwc_swapchain_queued(pScrn);
+    chain->occupancySamples++;
+
+    hwc_swapchain_present(pScrn, FALSE);
+}
@@ -0,0 +1,303 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HWC_BLIT_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HWC_BLIT_NEON 1
+#endif
+
+#include "driver.h"
+
+/*
+ * CPU blitters for the software compositor.
+ *
+ * They copy a box of the X root window (x8r8g8b8, i.e. BGRA in memory)
+ * into an RGBA_8888 framebuffer target, swapping red and blue and
+ * applying the screen rotation on the way. Each rotation gets its own
+ * specialized copy of the kernel. Rotated copies are done in tiles so
+ * that both the source rows and the destination rows of a tile stay in
+ * cache, and in 4x4 blocks transposed in SIMD registers where available.
+ */
+
+#ifdef __GNUC__
+#define HWC_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define HWC_ALWAYS_INLINE inline
+#endif
+
+#define HWC_BLIT_TILE 32
+
+static HWC_ALWAYS_INLINE uint32_t swizzle(uint32_t p)
+{
+    return (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+}
+
+/* Destination index of root pixel (x, y) for a rotation */
+static HWC_ALWAYS_INLINE size_t
+dst_index(hwc_rotation rotation, int x, int y, int dstStride, int dstWidth, int dstHeight)
+{
+    switch (rotation) {
+    case HWC_ROTATE_CW:
+        return (size_t) x * dstStride + (dstWidth - 1 - y);
+    case HWC_ROTATE_UD:
+        return (size_t) (dstHeight - 1 - y) * dstStride + (dstWidth - 1 - x);
+    case HWC_ROTATE_CCW:
+        return (size_t) (dstHeight - 1 - x) * dstStride + y;
+    case HWC_ROTATE_NORMAL:
+    default:
+        return (size_t) y * dstStride + x;
+    }
+}
+
+#if defined(HWC_BLIT_SSE2)
+
+typedef __m128i vec4;
+
+#define V_LOAD(p) _mm_loadu_si128((const __m128i *) (p))
+#define V_STORE(p, v) _mm_storeu_si128((__m128i *) (p), (v))
+#define V_REVERSE(v) _mm_shuffle_epi32((v), _MM_SHUFFLE(0, 1, 2, 3))
+
+static HWC_ALWAYS_INLINE vec4 v_swizzle(vec4 p)
+{
+    vec4 ag = _mm_and_si128(p, _mm_set1_epi32(0xff00ff00));
+    vec4 rb = _mm_and_si128(p, _mm_set1_epi32(0x00ff00ff));
+
+    rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+    return _mm_or_si128(ag, rb);
+}
+
+static HWC_ALWAYS_INLINE void v_transpose(vec4 *r)
+{
+    __m128 r0 = _mm_castsi128_ps(r[0]), r1 = _mm_castsi128_ps(r[1]);
+    __m128 r2 = _mm_castsi128_ps(r[2]), r3 = _mm_castsi128_ps(r[3]);
+
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    r[0] = _mm_castps_si128(r0);
+    r[1] = _mm_castps_si128(r1);
+    r[2] = _mm_castps_si128(r2);
+    r[3] = _mm_castps_si128(r3);
+}
+
+#elif defined(HWC_BLIT_NEON)
+
+typedef uint32x4_t vec4;
+
+#define V_LOAD(p) vld1q_u32((const uint32_t *) (p))
+#define V_STORE(p, v) vst1q_u32((uint32_t *) (p), (v))
+
+static HWC_ALWAYS_INLINE vec4 V_REVERSE(vec4 v)
+{
+    v = vrev64q_u32(v);
+    return vcombine_u32(vget_high_u32(v), vget_low_u32(v));
+}
+
+static HWC_ALWAYS_INLINE vec4 v_swizzle(vec4 p)
+{
+    vec4 ag = vandq_u32(p, vdupq_n_u32(0xff00ff00));
+    vec4 rb = vandq_u32(p, vdupq_n_u32(0x00ff00ff));
+
+    rb = vorrq_u32(vshlq_n_u32(rb, 16), vshrq_n_u32(rb, 16));
+    return vorrq_u32(ag, rb);
+}
+
+static HWC_ALWAYS_INLINE void v_transpose(vec4 *r)
+{
+    uint32x4x2_t t0 = vtrnq_u32(r[0], r[1]);
+    uint32x4x2_t t1 = vtrnq_u32(r[2], r[3]);
+
+    r[0] = vcombine_u32(vget_low_u32(t0.val[0]), vget_low_u32(t1.val[0]));
+    r[1] = vcombine_u32(vget_low_u32(t0.val[1]), vget_low_u32(t1.val[1]));
+    r[2] = vcombine_u32(vget_high_u32(t0.val[0]), vget_high_u32(t1.val[0]));
+    r[3] = vcombine_u32(vget_high_u32(t0.val[1]), vget_high_u32(t1.val[1]));
+}
+
+#endif
+
+#if defined(HWC_BLIT_SSE2) || defined(HWC_BLIT_NEON)
+#define HWC_BLIT_SIMD 1
+#endif
+
+/* Copy one row of a NORMAL or UD blit */
+static HWC_ALWAYS_INLINE void
+blit_row(hwc_rotation rotation, const uint32_t *src, uint32_t *dst,
+         int x1, int x2, int y, int dstStride, int dstWidth, int dstHeight)
+{
+    int x = x1;
+
+#ifdef HWC_BLIT_SIMD
+    for (; x + 4 <= x2; x += 4) {
+        vec4 v = v_swizzle(V_LOAD(src + x));
+
+        if (rotation == HWC_ROTATE_UD)
+            V_STORE(dst + dst_index(rotation, x + 3, y, dstStride, dstWidth, dstHeight),
+                    V_REVERSE(v));
+        else
+            V_STORE(dst + dst_index(rotation, x, y, dstStride, dstWidth, dstHeight), v);
+    }
+#endif
+    for (; x < x2; x++)
+        dst[dst_index(rotation, x, y, dstStride, dstWidth, dstHeight)] = swizzle(src[x]);
+}
+
+/* Copy one tile of a CW or CCW blit */
+static HWC_ALWAYS_INLINE void
+blit_tile(hwc_rotation rotation, const uint32_t *src, int srcStride,
+          uint32_t *dst, int dstStride, int dstWidth, int dstHeight,
+          int x1, int y1, int x2, int y2)
+{
+    int x, y = y1;
+
+#ifdef HWC_BLIT_SIMD
+    for (; y + 4 <= y2; y += 4) {
+        const uint32_t *s = src + (size_t) y * srcStride;
+
+        for (x = x1; x + 4 <= x2; x += 4) {
+            vec4 r[4];
+            int j;
+
+            r[0] = V_LOAD(s + x);
+            r[1] = V_LOAD(s + srcStride + x);
+            r[2] = V_LOAD(s + 2 * srcStride + x);
+            r[3] = V_LOAD(s + 3 * srcStride + x);
+            v_transpose(r);
+
+            /* r[j] now holds column x + j, rows y .. y + 3 */
+            for (j = 0; j < 4; j++) {
+                if (rotation == HWC_ROTATE_CW)
+                    V_STORE(dst + dst_index(rotation, x + j, y + 3,
+                                            dstStride, dstWidth, dstHeight),
+                            V_REVERSE(v_swizzle(r[j])));
+                else
+                    V_STORE(dst + dst_index(rotation, x + j, y,
+                                            dstStride, dstWidth, dstHeight),
+                            v_swizzle(r[j]));
+            }
+        }
+        for (; x < x2; x++) {
+            int k;
+            for (k = 0; k < 4; k++)
+                dst[dst_index(rotation, x, y + k, dstStride, dstWidth, dstHeight)] =
+                    swizzle(s[(size_t) k * srcStride + x]);
+        }
+    }
+#endif
+    for (; y < y2; y++) {
+        const uint32_t *s = src + (size_t) y * srcStride;
+
+        for (x = x1; x < x2; x++)
+            dst[dst_index(rotation, x, y, dstStride, dstWidth, dstHeight)] = swizzle(s[x]);
+    }
+}
+
+static HWC_ALWAYS_INLINE void
+blit_box(hwc_rotation rotation, const uint32_t *src, int srcStride,
+         uint32_t *dst, int dstStride, int dstWidth, int dstHeight,
+         const BoxRec *box)
+{
+    int x, y;
+
+    if (rotation == HWC_ROTATE_NORMAL || rotation == HWC_ROTATE_UD) {
+        for (y = box->y1; y < box->y2; y++)
+            blit_row(rotation, src + (size_t) y * srcStride, dst,
+                     box->x1, box->x2, y, dstStride, dstWidth, dstHeight);
+        return;
+    }
+
+    for (y = box->y1; y < box->y2; y += HWC_BLIT_TILE) {
+        int ty2 = y + HWC_BLIT_TILE < box->y2 ? y + HWC_BLIT_TILE : box->y2;
+
+        for (x = box->x1; x < box->x2; x += HWC_BLIT_TILE) {
+            int tx2 = x + HWC_BLIT_TILE < box->x2 ? x + HWC_BLIT_TILE : box->x2;
+
+            blit_tile(rotation, src, srcStride, dst, dstStride, dstWidth, dstHeight,
+                      x, y, tx2, ty2);
+        }
+    }
+}
+
+#define DEFINE_BLIT(name, rotation) \
+static void name(const uint32_t *src, int srcStride, \
+                 uint32_t *dst, int dstStride, int dstWidth, int dstHeight, \
+                 const BoxRec *box) \
+{ \
+    blit_box(rotation, src, srcStride, dst, dstStride, dstWidth, dstHeight, box); \
+}
+
+DEFINE_BLIT(blit_normal, HWC_ROTATE_NORMAL)
+DEFINE_BLIT(blit_cw, HWC_ROTATE_CW)
+DEFINE_BLIT(blit_ud, HWC_ROTATE_UD)
+DEFINE_BLIT(blit_ccw, HWC_ROTATE_CCW)
+
+/*
+ * Copy a box of the root window (in root coordinates) into the rotated
+ * framebuffer target of dstWidth x dstHeight pixels. Strides are in pixels.
+ */
+void hwc_sw_blit(hwc_rotation rotation, const uint32_t *src, int srcStride,
+                 uint32_t *dst, int dstStride, int dstWidth, int dstHeight,
+                 const BoxRec *box)
+{
+    switch (rotation) {
+    case HWC_ROTATE_CW:
+        blit_cw(src, srcStride, dst, dstStride, dstWidth, dstHeight, box);
+        break;
+    case HWC_ROTATE_UD:
+        blit_ud(src, srcStride, dst, dstStride, dstWidth, dstHeight, box);
+        break;
+    case HWC_ROTATE_CCW:
+        blit_ccw(src, srcStride, dst, dstStride, dstWidth, dstHeight, box);
+        break;
+    case HWC_ROTATE_NORMAL:
+    default:
+        blit_normal(src, srcStride, dst, dstStride, dstWidth, dstHeight, box);
+        break;
+    }
+}
+
+/* Premultiplied "over" of one pixel, x / 255 approximated as in pixman */
+static inline uint32_t over(uint32_t src, uint32_t dst)
+{
+    uint32_t ia = 255 - (src >> 24);
+    uint32_t rb = (dst & 0x00ff00ff) * ia + 0x00800080;
+    uint32_t ag = ((dst >> 8) & 0x00ff00ff) * ia + 0x00800080;
+
+    rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+    ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+
+    return src + (rb | ag);
+}
+
+/*
+ * Blend a premultiplied ARGB cursor image at (x, y) in root coordinates
+ * over the framebuffer target, clipped to the rootWidth x rootHeight root.
+ */
+void hwc_sw_blend_cursor(hwc_rotation rotation, const CARD32 *image,
+                         int width, int height, int x, int y,
+                         int rootWidth, int rootHeight,
+                         uint32_t *dst, int dstStride, int dstWidth, int dstHeight)
+{
+    int i, j;
+
+    for (j = 0; j < height; j++) {
+        if (y + j < 0 || y + j >= rootHeight)
+            continue;
+        for (i = 0; i < width; i++) {
+            uint32_t s = image[j * width + i];
+            size_t idx;
+
+            if (x + i < 0 || x + i >= rootWidth || (s >> 24) == 0)
+                continue;
+
+            idx = dst_index(rotation, x + i, y + j, dstStride, dstWidth, dstHeight);
+            dst[idx] = over(swizzle(s), dst[idx]);
+        }
+    }
+}
@@ -0,0 +1,309 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <android-config.h>
+#include <sync/sync.h>
+#include <system/window.h>
+
+#include "driver.h"
+
+/*
+ * Software compositor ("AccelMethod" "none").
+ *
+ * The root window lives in ordinary malloc'd memory. Every frame a
+ * framebuffer target buffer is dequeued from the HWC native window,
+ * the parts of it that are out of date are copied from the root with
+ * the CPU blitters, the cursor is blended on top and the buffer is
+ * queued, which hands it to HWC through the usual present() callback.
+ * EGL and GLES are never touched.
+ *
+ * The native window cycles through a few buffers, so for every buffer
+ * we remember which part of the root changed since it was last shown
+ * and only copy that.
+ */
+
+static Bool hwc_sw_create_window(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sw_renderer_ptr sw = &hwc->swRenderer;
+
+    sw->window = hwc_get_native_window(pScrn);
+    if (!sw->window)
+        return FALSE;
+
+    native_window_set_usage(sw->window,
+                            GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN |
+                            GRALLOC_USAGE_HW_COMPOSER | GRALLOC_USAGE_HW_FB);
+    return TRUE;
+}
+
+Bool hwc_sw_renderer_init(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sw_renderer_ptr sw = &hwc->swRenderer;
+    int i;
+
+    if (!hwc_sw_create_window(pScrn))
+        return FALSE;
+
+    for (i = 0; i < HWC_SW_MAX_BUFFERS; i++) {
+        sw->buffers[i].buffer = NULL;
+        RegionNull(&sw->buffers[i].pending);
+    }
+    sw->root = NULL;
+    sw->rootSize = 0;
+
+    return TRUE;
+}
+
+void hwc_sw_renderer_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sw_renderer_ptr sw = &hwc->swRenderer;
+    int i;
+
+    if (sw->window) {
+        hwc_destroy_native_window(sw->window);
+        sw->window = NULL;
+    }
+
+    for (i = 0; i < HWC_SW_MAX_BUFFERS; i++)
+        RegionUninit(&sw->buffers[i].pending);
+
+    free(sw->root);
+    sw->root = NULL;
+    sw->rootSize = 0;
+}
+
+void hwc_sw_renderer_screen_init(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sw_renderer_ptr sw = &hwc->swRenderer;
+    size_t size;
+    int i;
+
+    hwc->stride = pScrn->displayWidth;
+    size = (size_t) hwc->stride * pScrn->virtualY;
+
+    /* The root of the previous server generation is reused if the size still fits */
+    if (size != sw->rootSize) {
+        free(sw->root);
+        sw->root = xnfcalloc(size, sizeof(uint32_t));
+        sw->rootSize = size;
+    }
+    else
+        memset(sw->root, 0, size * sizeof(uint32_t));
+
+    /* Buffers we already know may hold anything, redraw them completely */
+    for (i = 0; i < HWC_SW_MAX_BUFFERS; i++)
+        sw->buffers[i].buffer = NULL;
+}
+
+void hwc_sw_renderer_screen_close(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sw_renderer_ptr sw = &hwc->swRenderer;
+    int i;
+
+    for (i = 0; i < HWC_SW_MAX_BUFFERS; i++) {
+        sw->buffers[i].buffer = NULL;
+        RegionEmpty(&sw->buffers[i].pending);
+    }
+}
+
+/* Free the framebuffer target buffers while the panel is off */
+void hwc_sw_renderer_suspend(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sw_renderer_ptr sw = &hwc->swRenderer;
+    int i;
+
+    if (!sw->window)
+        return;
+
+    hwc_destroy_native_window(sw->window);
+    sw->window = NULL;
+
+    for (i = 0; i < HWC_SW_MAX_BUFFERS; i++) {
+        sw->buffers[i].buffer = NULL;
+        RegionEmpty(&sw->buffers[i].pending);
+    }
+}
+
+/* New buffers are redrawn completely the first time they are dequeued */
+void hwc_sw_renderer_resume(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (!hwc->swRenderer.window && !hwc_sw_create_window(pScrn))
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "failed to recreate framebuffer target window\n");
+}
+
+/* Mark a region of the root as changed in every buffer */
+void hwc_sw_renderer_damage(ScrnInfoPtr pScrn, RegionPtr region)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sw_renderer_ptr sw = &hwc->swRenderer;
+    int i;
+
+    for (i = 0; i < HWC_SW_MAX_BUFFERS; i++) {
+        if (sw->buffers[i].buffer)
+            RegionUnion(&sw->buffers[i].pending, &sw->buffers[i].pending, region);
+    }
+}
+
+/*
+ * The part of the root that lands on the panel, in root coordinates. A
+ * "Virtual" size other than the panel's leaves a part of one or the
+ * other uncovered, nothing may be blitted outside of both.
+ */
+static void hwc_sw_extent(ScrnInfoPtr pScrn, BoxPtr box)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    Bool swap = hwc->rotation == HWC_ROTATE_CW || hwc->rotation == HWC_ROTATE_CCW;
+
+    box->x1 = box->y1 = 0;
+    box->x2 = min(pScrn->virtualX, swap ? hwc->hwcHeight : hwc->hwcWidth);
+    box->y2 = min(pScrn->virtualY, swap ? hwc->hwcWidth : hwc->hwcHeight);
+}
+
+static hwc_sw_buffer_ptr
+hwc_sw_get_buffer(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sw_renderer_ptr sw = &hwc->swRenderer;
+    BoxRec box;
+    hwc_sw_buffer_ptr slot = NULL;
+    int i;
+
+    sw->dequeues++;
+    for (i = 0; i < HWC_SW_MAX_BUFFERS; i++) {
+        if (sw->buffers[i].buffer == buffer) {
+            sw->buffers[i].used = sw->dequeues;
+            return &sw->buffers[i];
+        }
+        if (!slot && !sw->buffers[i].buffer)
+            slot = &sw->buffers[i];
+    }
+
+    /* More buffers than we track, forget the one dequeued longest ago */
+    if (!slot) {
+        slot = &sw->buffers[0];
+        for (i = 1; i < HWC_SW_MAX_BUFFERS; i++) {
+            if (sw->buffers[i].used < slot->used)
+                slot = &sw->buffers[i];
+        }
+    }
+
+    /* First time we see this buffer, its contents are undefined */
+    hwc_sw_extent(pScrn, &box);
+    slot->buffer = buffer;
+    slot->used = sw->dequeues;
+    RegionUninit(&slot->pending);
+    RegionInit(&slot->pending, &box, 1);
+    return slot;
+}
+
+/* Returns the number of bytes composited */
+size_t hwc_sw_renderer_update(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_sw_renderer_ptr sw = &hwc->swRenderer;
+    struct ANativeWindowBuffer *buffer = NULL;
+    hwc_sw_buffer_ptr slot;
+    BoxRec extent;
+    RegionRec clip;
+    int fenceFd = -1;
+    void *vaddr = NULL;
+    BoxPtr boxes;
+    size_t bytes = 0;
+    CARD64 start;
+    int i, n, err;
+
+    /* Resume couldn't recreate the window, try again and keep the frame due until then */
+    if (!sw->window && !hwc_sw_create_window(pScrn)) {
+        HWC_SET_DIRTY(hwc);
+        return 0;
+    }
+
+    err = sw->window->dequeueBuffer(sw->window, &buffer, &fenceFd);
+    if (err != 0 || !buffer) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "failed to dequeue framebuffer target: %d\n", err);
+        return 0;
+    }
+
+    if (fenceFd >= 0) {
+        start = GetTimeInMicros();
+        sync_wait(fenceFd, -1);
+        close(fenceFd);
+        hwc_stats_fence_wait(pScrn, start);
+    }
+
+    slot = hwc_sw_get_buffer(pScrn, buffer);
+
+    err = hwc->gralloc->lock(hwc->gralloc, buffer->handle,
+                             GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN,
+                             0, 0, hwc->hwcWidth, hwc->hwcHeight, &vaddr);
+    if (err != 0) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "failed to lock framebuffer target: %d\n", err);
+        sw->window->cancelBuffer(sw->window, buffer, -1);
+        return 0;
+    }
+
+    /* Damage outside of the panel has nowhere to go */
+    hwc_sw_extent(pScrn, &extent);
+    RegionInit(&clip, &extent, 1);
+    RegionIntersect(&slot->pending, &slot->pending, &clip);
+    RegionUninit(&clip);
+
+    n = RegionNumRects(&slot->pending);
+    boxes = RegionRects(&slot->pending);
+    for (i = 0; i < n; i++) {
+        hwc_sw_blit(hwc->rotation, sw->root, hwc->stride,
+                    vaddr, buffer->stride, hwc->hwcWidth, hwc->hwcHeight,
+                    &boxes[i]);
+        bytes += (boxes[i].x2 - boxes[i].x1) * (boxes[i].y2 - boxes[i].y1) * 4;
+    }
+    RegionEmpty(&slot->pending);
+
+    if (hwc->cursorShown && hwc->cursorCache.slots[hwc->cursorCache.current].valid) {
+        BoxRec box;
+        RegionRec cursor;
+        int x, y;
+
+        hwc_cursor_sample(pScrn, &x, &y);
+        hwc_sw_blend_cursor(hwc->rotation,
+                            hwc->cursorCache.slots[hwc->cursorCache.current].image,
+                            hwc->cursorWidth, hwc->cursorHeight,
+                            x, y,
+                            extent.x2, extent.y2,
+                            vaddr, buffer->stride, hwc->hwcWidth, hwc->hwcHeight);
+
+        /* The cursor has to be wiped from this buffer the next time it's used */
+        box.x1 = max(x, 0);
+        box.y1 = max(y, 0);
+        box.x2 = min(x + hwc->cursorWidth, extent.x2);
+        box.y2 = min(y + hwc->cursorHeight, extent.y2);
+        if (box.x1 < box.x2 && box.y1 < box.y2) {
+            RegionInit(&cursor, &box, 1);
+            RegionUnion(&slot->pending, &slot->pending, &cursor);
+            RegionUninit(&cursor);
+        }
+    }
+
+    hwc->gralloc->unlock(hwc->gralloc, buffer->handle);
+
+    sw->window->queueBuffer(sw->window, buffer, -1);
+
+    return bytes;
+}
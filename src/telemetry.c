@@ -0,0 +1,264 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+#include "xf86Crtc.h"
+
+#include <stdlib.h>
+#include <X11/Xatom.h>
+#include "randrstr.h"
+
+#include "driver.h"
+
+/*
+ * Performance telemetry.
+ *
+ * The compositor records a few cheap counters per frame. They are
+ * published as read-only properties on the "hwcomposer" RandR output,
+ * so "xrandr --prop" shows how the server is doing. The properties are
+ * refreshed when a client reads them, at most once per
+ * HWC_STATS_REFRESH_INTERVAL.
+ */
+
+#define HWC_STATS_REFRESH_INTERVAL 1000 /* in milliseconds */
+
+typedef enum {
+    HWC_PROP_FPS,
+    HWC_PROP_FRAME_TIME,
+    HWC_PROP_FRAMES,
+    HWC_PROP_SKIPPED_FRAMES,
+    HWC_PROP_COMPOSITED_KB,
+    HWC_PROP_FENCE_WAIT,
+    HWC_PROP_LAYER_COMPOSITION,
+    HWC_PROP_LATENCY,
+    HWC_PROP_SWAPCHAIN,
+    HWC_PROP_POWER,
+    HWC_PROP_CURSOR_LATENCY,
+    HWC_PROP_FRAME_SCHEDULE,
+    HWC_NUM_PROPS
+} hwc_stats_prop;
+
+static const char *hwc_stats_prop_names[HWC_NUM_PROPS] = {
+    "HWC_FPS",
+    "HWC_FRAME_TIME",
+    "HWC_FRAMES",
+    "HWC_SKIPPED_FRAMES",
+    "HWC_COMPOSITED_KB",
+    "HWC_FENCE_WAIT",
+    "HWC_LAYER_COMPOSITION",
+    "HWC_LATENCY",
+    "HWC_SWAPCHAIN",
+    "HWC_POWER",
+    "HWC_CURSOR_LATENCY",
+    "HWC_FRAME_SCHEDULE"
+};
+
+static Atom hwc_stats_atoms[HWC_NUM_PROPS];
+
+/* Account one composited frame that started at the given time */
+void hwc_stats_frame(ScrnInfoPtr pScrn, CARD64 start, size_t bytes)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_stats_ptr stats = &hwc->stats;
+
+    stats->frameTimes[stats->frameTimeIndex] = GetTimeInMicros() - start;
+    stats->frameTimeIndex = (stats->frameTimeIndex + 1) % HWC_STATS_SAMPLES;
+    if (stats->frameTimeCount < HWC_STATS_SAMPLES)
+        stats->frameTimeCount++;
+
+    stats->frames++;
+    if (bytes >= (size_t) hwc->hwcWidth * hwc->hwcHeight * 4)
+        stats->fullFrames++;
+    else
+        stats->partialFrames++;
+    stats->bytesComposited += bytes;
+}
+
+void hwc_stats_fence_wait(ScrnInfoPtr pScrn, CARD64 start)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    CARD64 wait = GetTimeInMicros() - start;
+
+    hwc->stats.lastFenceWait = wait;
+    hwc->stats.fenceWaitTotal += wait;
+}
+
+/* Remember which composition type HWC picked for each layer in prepare() */
+void hwc_stats_layers(ScrnInfoPtr pScrn, hwc_display_contents_1_t *list)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_stats_ptr stats = &hwc->stats;
+    size_t i;
+
+    stats->numLayers = min(list->numHwLayers, HWC_STATS_MAX_LAYERS);
+    for (i = 0; i < stats->numLayers; i++)
+        stats->compositionTypes[i] = list->hwLayers[i].compositionType;
+}
+
+/* Account the time spent in the previous power mode */
+void hwc_stats_power_mode(ScrnInfoPtr pScrn, int mode)
+{
+    hwc_stats_ptr stats = &HWCPTR(pScrn)->stats;
+    CARD64 now = GetTimeInMicros();
+
+    if (stats->powerModeSince && stats->powerMode < HWC_STATS_POWER_MODES)
+        stats->powerModeTime[stats->powerMode] += now - stats->powerModeSince;
+
+    stats->powerMode = mode;
+    stats->powerModeSince = now;
+}
+
+static int hwc_stats_compare(const void *a, const void *b)
+{
+    CARD32 x = *(const CARD32 *) a, y = *(const CARD32 *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* p50, p90 and p99 of up to HWC_STATS_SAMPLES samples */
+void hwc_stats_percentiles(const CARD32 *samples, int n, INT32 *out)
+{
+    CARD32 sorted[HWC_STATS_SAMPLES];
+
+    n = min(n, HWC_STATS_SAMPLES);
+    memcpy(sorted, samples, n * sizeof(CARD32));
+    qsort(sorted, n, sizeof(CARD32), hwc_stats_compare);
+    out[0] = n ? sorted[n * 50 / 100] : 0;
+    out[1] = n ? sorted[n * 90 / 100] : 0;
+    out[2] = n ? sorted[n * 99 / 100] : 0;
+}
+
+static void
+hwc_stats_set(xf86OutputPtr output, hwc_stats_prop prop, int count, INT32 *values)
+{
+    RRChangeOutputProperty(output->randr_output, hwc_stats_atoms[prop],
+                           XA_INTEGER, 32, PropModeReplace, count, values,
+                           FALSE, FALSE);
+}
+
+static void hwc_stats_refresh(xf86OutputPtr output)
+{
+    HWCPtr hwc = HWCPTR(output->scrn);
+    hwc_stats_ptr stats = &hwc->stats;
+    CARD32 now = GetTimeInMillis();
+    CARD32 elapsed = now - stats->lastRefresh;
+    INT32 values[max(HWC_STATS_MAX_LAYERS, 3 * HWC_LATENCY_KINDS)];
+    int n = stats->frameTimeCount;
+    size_t i;
+
+    if (stats->lastRefresh && elapsed < HWC_STATS_REFRESH_INTERVAL)
+        return;
+
+    values[0] = elapsed ? (stats->frames - stats->lastRefreshFrames) * 1000 / elapsed : 0;
+    hwc_stats_set(output, HWC_PROP_FPS, 1, values);
+    stats->lastRefresh = now;
+    stats->lastRefreshFrames = stats->frames;
+
+    /* p50, p90 and p99 over the last HWC_STATS_SAMPLES frames, in microseconds */
+    hwc_stats_percentiles(stats->frameTimes, n, values);
+    hwc_stats_set(output, HWC_PROP_FRAME_TIME, 3, values);
+
+    values[0] = stats->fullFrames;
+    values[1] = stats->partialFrames;
+    hwc_stats_set(output, HWC_PROP_FRAMES, 2, values);
+
+    values[0] = stats->skippedFrames;
+    hwc_stats_set(output, HWC_PROP_SKIPPED_FRAMES, 1, values);
+
+    values[0] = stats->bytesComposited >> 10;
+    hwc_stats_set(output, HWC_PROP_COMPOSITED_KB, 1, values);
+
+    /* last wait in microseconds, total in milliseconds */
+    values[0] = stats->lastFenceWait;
+    values[1] = stats->fenceWaitTotal / 1000;
+    hwc_stats_set(output, HWC_PROP_FENCE_WAIT, 2, values);
+
+    for (i = 0; i < stats->numLayers; i++)
+        values[i] = stats->compositionTypes[i];
+    hwc_stats_set(output, HWC_PROP_LAYER_COMPOSITION, stats->numLayers, values);
+
+    /* input, damage and submit to scanout p50/p90/p99, in microseconds */
+    for (i = 0; i < HWC_LATENCY_KINDS; i++) {
+        hwc_latency_ptr latency = &hwc->latency;
+
+        hwc_stats_percentiles(latency->samples[i], latency->count[i], values + i * 3);
+    }
+    hwc_stats_set(output, HWC_PROP_LATENCY, 3 * HWC_LATENCY_KINDS, values);
+
+    /* depth, frames queued now, average queued in hundredths, presented, dropped */
+    values[0] = hwc->swapchain.depth;
+    values[1] = hwc_swapchain_queued(output->scrn);
+    values[2] = hwc_swapchain_occupancy(output->scrn);
+    values[3] = hwc->swapchain.presented;
+    values[4] = hwc->swapchain.dropped;
+    hwc_stats_set(output, HWC_PROP_SWAPCHAIN, 5, values);
+
+    /*
+     * Power mode, compositor wakeups per minute and seconds spent off,
+     * dozing, on and in doze suspend, the inputs for a power estimate.
+     */
+    hwc_stats_power_mode(output->scrn, stats->powerMode);
+    values[0] = stats->powerMode;
+    values[1] = elapsed ? (CARD64) (stats->wakeups - stats->lastRefreshWakeups) * 60000 / elapsed : 0;
+    for (i = 0; i < HWC_STATS_POWER_MODES; i++)
+        values[2 + i] = stats->powerModeTime[i] / 1000000;
+    hwc_stats_set(output, HWC_PROP_POWER, 2 + HWC_STATS_POWER_MODES, values);
+    stats->lastRefreshWakeups = stats->wakeups;
+
+    /* cursor move to drawn p50/p90/p99, in microseconds */
+    hwc_stats_percentiles(hwc->cursorPos.samples, hwc->cursorPos.count, values);
+    hwc_stats_set(output, HWC_PROP_CURSOR_LATENCY, 3, values);
+
+    /*
+     * Vsync period, cost estimate, last cost and lead time in microseconds,
+     * then frames on time, late, late by more than a frame and unaccounted.
+     */
+    values[0] = hwc->sched.period;
+    values[1] = hwc->sched.cost;
+    values[2] = hwc->sched.lastCost;
+    values[3] = hwc->sched.lead;
+    values[4] = hwc->sched.onTime;
+    values[5] = hwc->sched.missed;
+    values[6] = hwc->sched.missedMore;
+    values[7] = hwc->sched.unresolved;
+    hwc_stats_set(output, HWC_PROP_FRAME_SCHEDULE, 8, values);
+}
+
+void hwc_stats_create_resources(xf86OutputPtr output)
+{
+    ScrnInfoPtr pScrn = output->scrn;
+    HWCPtr hwc = HWCPTR(pScrn);
+    int i, err;
+
+    hwc->stats.lastRefresh = 0;
+
+    for (i = 0; i < HWC_NUM_PROPS; i++) {
+        hwc_stats_atoms[i] = MakeAtom(hwc_stats_prop_names[i],
+                                      strlen(hwc_stats_prop_names[i]), TRUE);
+
+        err = RRConfigureOutputProperty(output->randr_output, hwc_stats_atoms[i],
+                                        FALSE, FALSE, TRUE, 0, NULL);
+        if (err != 0) {
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                       "RRConfigureOutputProperty error, %d\n", err);
+        }
+    }
+
+    hwc_stats_refresh(output);
+}
+
+/* Called by RandR before a property value is returned to a client */
+Bool hwc_stats_get_property(xf86OutputPtr output, Atom property)
+{
+    int i;
+
+    for (i = 0; i < HWC_NUM_PROPS; i++) {
+        if (hwc_stats_atoms[i] == property) {
+            hwc_stats_refresh(output);
+            break;
+        }
+    }
+    return TRUE;
+}
@@ -0,0 +1,211 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <stdlib.h>
+
+#include "driver.h"
+
+/*
+ * Root window upload backend.
+ *
+ * Without EGL_HYBRIS_native_buffer (e.g. on Mesa) the root can't be a
+ * buffer shared with the GPU. It lives in malloc'd memory instead, and
+ * before each frame the parts damaged since the last one are copied
+ * into rootTexture. With GLES 3 they are packed into one of two pixel
+ * buffer objects used in turns, so the copy doesn't wait for the GPU
+ * to finish reading the previous frame's upload. GLES 2 uploads straight
+ * from the root, a rectangle at a time with GL_EXT_unpack_subimage or
+ * a row band at a time without it.
+ */
+
+/* More damage rectangles than this are uploaded as their bounding box */
+#define HWC_UPLOAD_MAX_RECTS 16
+
+void hwc_upload_init(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_upload_ptr upload = &hwc->upload;
+
+    memset(upload, 0, sizeof(*upload));
+    upload->enabled = TRUE;
+    upload->usePbo = epoxy_gl_version() >= 30;
+    upload->rowLength = upload->usePbo || epoxy_has_gl_extension("GL_EXT_unpack_subimage");
+    RegionNull(&upload->pending);
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "uploading root window damage %s\n",
+               upload->usePbo ? "through pixel buffer objects" :
+               upload->rowLength ? "with GL_EXT_unpack_subimage" : "in row bands");
+}
+
+/* Allocate the root and rootTexture storage, the renderer's context must be current */
+void *hwc_upload_create_root(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_upload_ptr upload = &hwc->upload;
+    size_t size;
+    BoxRec box;
+
+    hwc->stride = pScrn->displayWidth;
+    size = (size_t) hwc->stride * pScrn->virtualY;
+
+    /* The root of the previous server generation is reused if the size still fits */
+    if (size != upload->rootSize) {
+        free(upload->root);
+        upload->root = xnfcalloc(size, sizeof(uint32_t));
+        upload->rootSize = size;
+    }
+    else
+        memset(upload->root, 0, size * sizeof(uint32_t));
+
+    if (upload->usePbo && !upload->pbo[0])
+        glGenBuffers(2, upload->pbo);
+
+    hwc_gl_bind_texture(&hwc->renderer.state, hwc->renderer.rootTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, pScrn->virtualX, pScrn->virtualY, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    upload->width = pScrn->virtualX;
+    upload->height = pScrn->virtualY;
+
+    /* The texture starts out undefined, the first frame uploads everything */
+    box.x1 = box.y1 = 0;
+    box.x2 = upload->width;
+    box.y2 = upload->height;
+    RegionUninit(&upload->pending);
+    RegionInit(&upload->pending, &box, 1);
+
+    return upload->root;
+}
+
+void hwc_upload_damage(ScrnInfoPtr pScrn, RegionPtr region)
+{
+    hwc_upload_ptr upload = &HWCPTR(pScrn)->upload;
+
+    RegionUnion(&upload->pending, &upload->pending, region);
+}
+
+static size_t hwc_upload_pbo(hwc_upload_ptr upload, int stride, BoxPtr boxes, int n)
+{
+    size_t size = 0, offset = 0;
+    uint8_t *map;
+    int i, y, w;
+
+    for (i = 0; i < n; i++)
+        size += (size_t) (boxes[i].x2 - boxes[i].x1) * (boxes[i].y2 - boxes[i].y1) * 4;
+
+    upload->pboIndex ^= 1;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->pbo[upload->pboIndex]);
+    /* Orphan the old storage in case the GPU still reads it */
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    map = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                           GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!map) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return 0;
+    }
+
+    /* Rectangles are packed tightly one after the other */
+    for (i = 0; i < n; i++) {
+        w = boxes[i].x2 - boxes[i].x1;
+        for (y = boxes[i].y1; y < boxes[i].y2; y++) {
+            memcpy(map + offset, upload->root + (size_t) y * stride + boxes[i].x1, w * 4);
+            offset += w * 4;
+        }
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    for (i = 0, offset = 0; i < n; i++) {
+        w = boxes[i].x2 - boxes[i].x1;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, boxes[i].x1, boxes[i].y1,
+                        w, boxes[i].y2 - boxes[i].y1,
+                        GL_RGBA, GL_UNSIGNED_BYTE, (const void *) offset);
+        offset += (size_t) w * (boxes[i].y2 - boxes[i].y1) * 4;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return size;
+}
+
+static size_t hwc_upload_direct(hwc_upload_ptr upload, int stride, BoxPtr boxes, int n)
+{
+    size_t size = 0;
+    int i, y, x1, w, h;
+
+    if (upload->rowLength)
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, stride);
+
+    for (i = 0; i < n; i++) {
+        /* Without a row length only whole rows of the root are contiguous */
+        x1 = upload->rowLength ? boxes[i].x1 : 0;
+        w = upload->rowLength ? boxes[i].x2 - boxes[i].x1 : upload->width;
+        h = boxes[i].y2 - boxes[i].y1;
+
+        if (upload->rowLength || stride == upload->width)
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x1, boxes[i].y1, w, h,
+                            GL_RGBA, GL_UNSIGNED_BYTE,
+                            upload->root + (size_t) boxes[i].y1 * stride + x1);
+        else {
+            for (y = boxes[i].y1; y < boxes[i].y2; y++)
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, w, 1,
+                                GL_RGBA, GL_UNSIGNED_BYTE, upload->root + (size_t) y * stride);
+        }
+        size += (size_t) w * h * 4;
+    }
+
+    if (upload->rowLength)
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+    return size;
+}
+
+/* Bring rootTexture up to date with the root before compositing */
+void hwc_upload_flush(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_upload_ptr upload = &hwc->upload;
+    int n = RegionNumRects(&upload->pending);
+    BoxPtr boxes = RegionRects(&upload->pending);
+    size_t size = 0;
+
+    if (!n || !upload->root)
+        return;
+
+    if (n > HWC_UPLOAD_MAX_RECTS) {
+        boxes = RegionExtents(&upload->pending);
+        n = 1;
+    }
+
+    hwc_gl_bind_texture(&hwc->renderer.state, hwc->renderer.rootTexture);
+
+    if (upload->usePbo)
+        size = hwc_upload_pbo(upload, hwc->stride, boxes, n);
+    if (!size)
+        size = hwc_upload_direct(upload, hwc->stride, boxes, n);
+
+    RegionEmpty(&upload->pending);
+    upload->frames++;
+    upload->bytes += size;
+}
+
+/* Server exit, the renderer's context must still be current */
+void hwc_upload_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_upload_ptr upload = &hwc->upload;
+
+    if (!upload->enabled)
+        return;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "root uploads: %lu frames, %lu KB\n",
+               upload->frames, (unsigned long) (upload->bytes >> 10));
+
+    if (upload->pbo[0])
+        glDeleteBuffers(2, upload->pbo);
+    free(upload->root);
+    RegionUninit(&upload->pending);
+    memset(upload, 0, sizeof(*upload));
+}
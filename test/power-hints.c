@@ -0,0 +1,161 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xf86.h"
+
+#include "driver.h"
+#include "power-stub.h"
+
+/*
+ * Hint scheduling of power.c against the stub power HAL, with the
+ * server's clock and timers replaced by ones the test drives.
+ */
+
+static CARD32 now;
+
+struct _OsTimerRec {
+    Bool armed;
+    CARD32 expires;
+    OsTimerCallback callback;
+    void *arg;
+};
+
+static struct _OsTimerRec timer;
+
+CARD32 GetTimeInMillis(void)
+{
+    return now;
+}
+
+OsTimerPtr TimerSet(OsTimerPtr t, int flags, CARD32 millis, OsTimerCallback func, void *arg)
+{
+    timer.armed = TRUE;
+    timer.expires = now + millis;
+    timer.callback = func;
+    timer.arg = arg;
+    return &timer;
+}
+
+void TimerCancel(OsTimerPtr t)
+{
+    if (t)
+        t->armed = FALSE;
+}
+
+void TimerFree(OsTimerPtr t)
+{
+    TimerCancel(t);
+}
+
+void xf86DrvMsg(int scrnIndex, MessageType type, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+int hw_get_module(const char *id, const struct hw_module_t **module)
+{
+    if (strcmp(id, POWER_HARDWARE_MODULE_ID) != 0)
+        return -1;
+
+    *module = &HAL_MODULE_INFO_SYM.common;
+    return 0;
+}
+
+/* Move the clock, firing the timer if it expires on the way */
+static void advance(CARD32 ms)
+{
+    now += ms;
+    if (timer.armed && (int) (now - timer.expires) >= 0) {
+        timer.armed = FALSE;
+        timer.callback(&timer, now, timer.arg);
+    }
+}
+
+int main(void)
+{
+    ScrnInfoRec scrn;
+    HWCPtr hwc = calloc(1, sizeof(HWCRec));
+    Bool initialized;
+    int i;
+
+    memset(&scrn, 0, sizeof(scrn));
+    scrn.driverPrivate = hwc;
+    power_stub_reset();
+    now = 10000;
+
+    initialized = hwc_power_init(&scrn);
+    assert(initialized);
+    assert(power_stub.initialized == 1);
+
+    /* Damage after a long idle time is a launch */
+    hwc_power_damage(&scrn);
+    assert(power_stub_count(POWER_HINT_LAUNCH) == 1);
+    assert(power_stub.hints[0].hint == POWER_HINT_LAUNCH && power_stub.hints[0].data == 1);
+    assert(power_stub_count(POWER_HINT_INTERACTION) == 1);
+
+    /* Damage within a burst asks for nothing */
+    advance(10);
+    hwc_power_damage(&scrn);
+    assert(power_stub.numHints == 2);
+
+    /* Cursor motion only reaches the HAL from the block handler */
+    advance(40);
+    hwc_power_cursor(&scrn);
+    hwc_power_cursor(&scrn);
+    assert(power_stub.numHints == 2);
+
+    /* ... and is rate limited there, the last boost is still running */
+    hwc_power_flush(&scrn);
+    assert(power_stub.numHints == 2);
+    assert(hwc->power.suppressedHints == 1);
+
+    /* Half a boost later the next one is sent, once per flush */
+    advance(HWC_POWER_INTERACTION_MS / 2);
+    hwc_power_cursor(&scrn);
+    hwc_power_flush(&scrn);
+    hwc_power_flush(&scrn);
+    assert(power_stub_count(POWER_HINT_INTERACTION) == 2);
+
+    /* The launch boost ends on its own */
+    advance(HWC_POWER_LAUNCH_MS);
+    assert(!hwc->power.launchActive);
+    assert(power_stub.hints[power_stub.numHints - 1].hint == POWER_HINT_LAUNCH &&
+           power_stub.hints[power_stub.numHints - 1].data == 0);
+
+    /* Damage after a short idle time is an interaction only */
+    advance(HWC_POWER_IDLE_MS);
+    hwc_power_damage(&scrn);
+    assert(power_stub_count(POWER_HINT_LAUNCH) == 2);
+    assert(power_stub_count(POWER_HINT_INTERACTION) == 3);
+
+    /* Continuous motion keeps about one boost per half boost */
+    for (i = 0; i < 100; i++) {
+        advance(10);
+        hwc_power_cursor(&scrn);
+        hwc_power_flush(&scrn);
+    }
+    assert(power_stub_count(POWER_HINT_INTERACTION) == 3 + 1000 / (HWC_POWER_INTERACTION_MS / 2));
+
+    /* Screen off ends a launch boost that is still running */
+    advance(HWC_POWER_LAUNCH_IDLE_MS);
+    hwc_power_damage(&scrn);
+    assert(hwc->power.launchActive);
+    power_stub.interactive = -1;
+    hwc_power_set_interactive(&scrn, FALSE);
+    assert(!hwc->power.launchActive && !timer.armed);
+    assert(power_stub.interactive == 0);
+
+    hwc_power_close(&scrn);
+    free(hwc);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include <string.h>
+
+#include "power-stub.h"
+
+power_stub_state power_stub;
+
+static void power_stub_init(struct power_module *module)
+{
+    power_stub.initialized++;
+}
+
+static void power_stub_set_interactive(struct power_module *module, int on)
+{
+    power_stub.interactive = on;
+}
+
+static void power_stub_hint_cb(struct power_module *module, power_hint_t hint, void *data)
+{
+    if (power_stub.numHints == POWER_STUB_MAX_HINTS)
+        return;
+
+    power_stub.hints[power_stub.numHints].hint = hint;
+    power_stub.hints[power_stub.numHints].data = data ? *(int *) data : 0;
+    power_stub.numHints++;
+}
+
+power_module_t HAL_MODULE_INFO_SYM = {
+    .common = {
+        .tag = HARDWARE_MODULE_TAG,
+        .module_api_version = POWER_MODULE_API_VERSION_0_2,
+        .hal_api_version = HARDWARE_HAL_API_VERSION,
+        .id = POWER_HARDWARE_MODULE_ID,
+        .name = "hwcomposer test power HAL",
+        .author = "xf86-video-hwcomposer",
+    },
+    .init = power_stub_init,
+    .setInteractive = power_stub_set_interactive,
+    .powerHint = power_stub_hint_cb,
+};
+
+void power_stub_reset(void)
+{
+    memset(&power_stub, 0, sizeof(power_stub));
+}
+
+int power_stub_count(power_hint_t hint)
+{
+    int i, n = 0;
+
+    for (i = 0; i < power_stub.numHints; i++)
+        if (power_stub.hints[i].hint == hint)
+            n++;
+    return n;
+}
@@ -0,0 +1,30 @@
+/*
+ * Stub power HAL module, records the hints it is given.
+ */
+
+#ifndef HWC_POWER_STUB_H
+#define HWC_POWER_STUB_H
+
+#include <hardware/power.h>
+
+#define POWER_STUB_MAX_HINTS 64
+
+typedef struct {
+    power_hint_t hint;
+    int data;
+} power_stub_hint;
+
+typedef struct {
+    int initialized;
+    int interactive;
+    power_stub_hint hints[POWER_STUB_MAX_HINTS];
+    int numHints;
+} power_stub_state;
+
+extern power_stub_state power_stub;
+extern power_module_t HAL_MODULE_INFO_SYM;
+
+void power_stub_reset(void);
+int power_stub_count(power_hint_t hint);
+
+#endif
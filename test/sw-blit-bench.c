@@ -0,0 +1,190 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "xf86.h"
+
+#include "driver.h"
+
+/*
+ * The software compositor against the GL composite at panel size.
+ *
+ * Prints the time per full frame of hwc_sw_blit() for every rotation,
+ * and of the GL path drawing the root into a pbuffer of the panel's
+ * size: once with the root uploaded first, what the upload path sends
+ * for a frame damaged all over, and once drawing only, what the native
+ * buffer path pays. The GL numbers are left out when there is no EGL
+ * display. The panel size may be given as WIDTHxHEIGHT.
+ */
+
+#define BENCH_FRAMES 30
+#define BENCH_WIDTH 1080
+#define BENCH_HEIGHT 1920
+
+extern const char vertex_src[];
+extern const char fragment_src_bgra[];
+
+static const GLfloat bench_quad[] = {
+    -1.0f, -1.0f, 0.0f, 1.0f,
+    1.0f, -1.0f, 1.0f, 1.0f,
+    -1.0f,  1.0f, 0.0f, 0.0f,
+    1.0f,  1.0f, 1.0f, 0.0f,
+};
+
+static const char *rotations[] = { "normal", "cw", "ud", "ccw" };
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void bench_sw(const uint32_t *root, int width, int height)
+{
+    uint32_t *target = calloc((size_t) width * height, sizeof(uint32_t));
+    hwc_rotation rotation;
+    double start;
+    BoxRec box;
+    int i;
+
+    if (!target)
+        exit(1);
+
+    for (rotation = HWC_ROTATE_NORMAL; rotation <= HWC_ROTATE_CCW; rotation++) {
+        Bool swap = rotation == HWC_ROTATE_CW || rotation == HWC_ROTATE_CCW;
+
+        /* The root has the panel's size turned by the rotation */
+        box.x1 = box.y1 = 0;
+        box.x2 = swap ? height : width;
+        box.y2 = swap ? width : height;
+
+        hwc_sw_blit(rotation, root, box.x2, target, width, width, height, &box);
+        start = now_ms();
+        for (i = 0; i < BENCH_FRAMES; i++)
+            hwc_sw_blit(rotation, root, box.x2, target, width, width, height, &box);
+        printf("sw blit %-6s  %7.2f ms\n", rotations[rotation],
+               (now_ms() - start) / BENCH_FRAMES);
+    }
+
+    free(target);
+}
+
+/* Average milliseconds per GL frame, the root uploaded first if upload */
+static double bench_gl_run(const uint32_t *root, int width, int height, Bool upload)
+{
+    double start = 0;
+    int i;
+
+    for (i = 0; i <= BENCH_FRAMES; i++) {
+        /* The first frame may still compile or allocate something */
+        if (i == 1)
+            start = now_ms();
+        if (upload)
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+                            GL_RGBA, GL_UNSIGNED_BYTE, root);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glFinish();
+    }
+
+    return (now_ms() - start) / BENCH_FRAMES;
+}
+
+static void bench_gl(const uint32_t *root, int width, int height)
+{
+    EGLint configAttr[] = {
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT, EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_NONE
+    };
+    EGLint surfaceAttr[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+    EGLint contextAttr[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
+    EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLSurface surface;
+    EGLContext context;
+    EGLConfig config;
+    EGLint numConfigs;
+    GLuint program, texture;
+
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) ||
+        !eglChooseConfig(display, configAttr, &config, 1, &numConfigs) || !numConfigs) {
+        printf("gl: no EGL display, skipped\n");
+        return;
+    }
+
+    surface = eglCreatePbufferSurface(display, config, surfaceAttr);
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttr);
+    if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(display, surface, surface, context)) {
+        printf("gl: no %dx%d pbuffer context, skipped\n", width, height);
+        eglTerminate(display);
+        return;
+    }
+
+    program = hwc_link_program(vertex_src, fragment_src_bgra);
+    if (!program) {
+        printf("gl: the root window shader doesn't link, skipped\n");
+        eglTerminate(display);
+        return;
+    }
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "texture"), 0);
+    glVertexAttribPointer(HWC_ATTRIB_POSITION, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+                          bench_quad);
+    glVertexAttribPointer(HWC_ATTRIB_TEXCOORDS, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+                          bench_quad + 2);
+    glEnableVertexAttribArray(HWC_ATTRIB_POSITION);
+    glEnableVertexAttribArray(HWC_ATTRIB_TEXCOORDS);
+    glViewport(0, 0, width, height);
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, root);
+
+    printf("gl upload+draw  %7.2f ms\n", bench_gl_run(root, width, height, TRUE));
+    printf("gl draw         %7.2f ms\n", bench_gl_run(root, width, height, FALSE));
+    printf("gl renderer     %s\n", (const char *) glGetString(GL_RENDERER));
+
+    glDeleteTextures(1, &texture);
+    glDeleteProgram(program);
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglDestroySurface(display, surface);
+    eglTerminate(display);
+}
+
+int main(int argc, char **argv)
+{
+    int width = BENCH_WIDTH, height = BENCH_HEIGHT;
+    uint32_t *root;
+    size_t i, size;
+
+    if (argc > 1 && (sscanf(argv[1], "%dx%d", &width, &height) != 2 ||
+                     width <= 0 || height <= 0)) {
+        fprintf(stderr, "usage: %s [WIDTHxHEIGHT]\n", argv[0]);
+        return 2;
+    }
+
+    size = (size_t) width * height;
+    root = malloc(size * sizeof(uint32_t));
+    if (!root)
+        return 1;
+    for (i = 0; i < size; i++)
+        root[i] = 0xff000000 | (i * 2654435761U >> 8);
+
+    printf("%dx%d, %d frames each\n", width, height, BENCH_FRAMES);
+    bench_sw(root, width, height);
+    bench_gl(root, width, height);
+
+    free(root);
+    return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * hwc-latency - repeatable input to photon measurements for the
+ * hwcomposer driver.
+ *
+ * Moves the pointer with XTest into a window of its own at a fixed
+ * interval and repaints the window for every motion event it receives,
+ * so each step is one input event followed by one burst of damage. The
+ * driver, with Option "LatencyTrace" on, records when each frame with
+ * them reached the panel. After the run the HWC_LATENCY output property
+ * is read back and printed along with the time the events took to
+ * reach this client.
+ *
+ * Each run overwrites the driver's sample window when it has at least
+ * as many steps, 128, so runs don't mix.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/Xrandr.h>
+
+#define HWC_LATENCY_PROPERTY "HWC_LATENCY"
+#define HWC_LATENCY_WINDOW 64      /* size of the test window */
+#define HWC_LATENCY_SETTLE 1100000 /* for the properties to refresh, in microseconds */
+
+static const char *kinds[] = { "input", "damage", "submit" };
+
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int compare(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-d display] [-n steps] [-i interval_ms] [-o output]\n"
+            "  -n  number of input events, default 200\n"
+            "  -i  time between them, default 50 ms\n"
+            "  -o  RandR output, default hwcomposer\n",
+            name);
+    exit(2);
+}
+
+/* HWC_LATENCY of the output, 9 values, False if it has none */
+static Bool read_latency(Display *dpy, Window root, const char *name, long *values)
+{
+    XRRScreenResources *res = XRRGetScreenResources(dpy, root);
+    Atom property = XInternAtom(dpy, HWC_LATENCY_PROPERTY, True);
+    Bool found = False;
+    int i;
+
+    if (!res || property == None) {
+        if (res)
+            XRRFreeScreenResources(res);
+        return False;
+    }
+
+    for (i = 0; i < res->noutput && !found; i++) {
+        XRROutputInfo *info = XRRGetOutputInfo(dpy, res, res->outputs[i]);
+        unsigned char *data = NULL;
+        unsigned long n, after;
+        Atom type;
+        int format;
+
+        if (!info)
+            continue;
+
+        if (!strcmp(info->name, name) &&
+            XRRGetOutputProperty(dpy, res->outputs[i], property, 0, 9, False, False,
+                                 AnyPropertyType, &type, &format, &n, &after,
+                                 &data) == Success &&
+            type == XA_INTEGER && format == 32 && n == 9) {
+            memcpy(values, data, 9 * sizeof(long));
+            found = True;
+        }
+
+        if (data)
+            XFree(data);
+        XRRFreeOutputInfo(info);
+    }
+
+    XRRFreeScreenResources(res);
+    return found;
+}
+
+int main(int argc, char **argv)
+{
+    const char *displayName = NULL, *output = "hwcomposer";
+    int steps = 200, interval = 50;
+    int opt, event, error, major, minor, i, received = 0;
+    unsigned long long *delays, *sent;
+    XSetWindowAttributes attrs;
+    Display *dpy;
+    Window root, win;
+    GC gc;
+    long values[9];
+
+    while ((opt = getopt(argc, argv, "d:n:i:o:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            displayName = optarg;
+            break;
+        case 'n':
+            steps = atoi(optarg);
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (steps <= 0 || interval <= 0)
+        usage(argv[0]);
+
+    dpy = XOpenDisplay(displayName);
+    if (!dpy) {
+        fprintf(stderr, "can't open display %s\n", XDisplayName(displayName));
+        return 1;
+    }
+
+    if (!XTestQueryExtension(dpy, &event, &error, &major, &minor)) {
+        fprintf(stderr, "the server has no XTEST extension\n");
+        return 1;
+    }
+
+    root = DefaultRootWindow(dpy);
+    attrs.override_redirect = True;
+    attrs.event_mask = PointerMotionMask | ExposureMask;
+    win = XCreateWindow(dpy, root, 0, 0, HWC_LATENCY_WINDOW, HWC_LATENCY_WINDOW, 0,
+                        CopyFromParent, InputOutput, CopyFromParent,
+                        CWOverrideRedirect | CWEventMask, &attrs);
+    gc = XCreateGC(dpy, win, 0, NULL);
+    XMapRaised(dpy, win);
+    XSync(dpy, False);
+
+    delays = calloc(steps, sizeof(*delays));
+    sent = calloc(steps, sizeof(*sent));
+    if (!delays || !sent)
+        return 1;
+
+    for (i = 0; i < steps; i++) {
+        unsigned long long deadline;
+
+        /* Alternate between two points of the window */
+        sent[i] = now_us();
+        XTestFakeMotionEvent(dpy, DefaultScreen(dpy),
+                             HWC_LATENCY_WINDOW / 4 + (i & 1) * HWC_LATENCY_WINDOW / 2,
+                             HWC_LATENCY_WINDOW / 2, CurrentTime);
+        XFlush(dpy);
+
+        deadline = sent[i] + (unsigned long long) interval * 1000;
+        while (now_us() < deadline) {
+            XEvent ev;
+
+            if (!XPending(dpy)) {
+                usleep(200);
+                continue;
+            }
+
+            XNextEvent(dpy, &ev);
+            if (ev.type != MotionNotify)
+                continue;
+
+            /* One repaint per input event, in a color telling the steps apart */
+            if (received < steps)
+                delays[received] = now_us() - sent[i];
+            received++;
+            XSetForeground(dpy, gc, (i & 1) ? 0xffffff : 0x000000);
+            XFillRectangle(dpy, win, gc, 0, 0, HWC_LATENCY_WINDOW, HWC_LATENCY_WINDOW);
+            XFlush(dpy);
+        }
+    }
+
+    XDestroyWindow(dpy, win);
+    XSync(dpy, False);
+
+    received = received < steps ? received : steps;
+    if (received) {
+        qsort(delays, received, sizeof(*delays), compare);
+        printf("input to client (us): p50 %llu p90 %llu p99 %llu over %d events\n",
+               delays[received * 50 / 100], delays[received * 90 / 100],
+               delays[received * 99 / 100], received);
+    }
+
+    usleep(HWC_LATENCY_SETTLE);
+    if (!read_latency(dpy, root, output, values)) {
+        fprintf(stderr, "output %s has no %s property, is Option \"LatencyTrace\" on?\n",
+                output, HWC_LATENCY_PROPERTY);
+        return 1;
+    }
+
+    for (i = 0; i < 3; i++)
+        printf("%s to scanout (us): p50 %ld p90 %ld p99 %ld\n",
+               kinds[i], values[i * 3], values[i * 3 + 1], values[i * 3 + 2]);
+
+    free(delays);
+    free(sent);
+    XCloseDisplay(dpy);
+    return 0;
+}